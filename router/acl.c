@@ -0,0 +1,438 @@
+/**
+ * acl.c
+ * Packet filter classifier by tuple space search.
+ *
+ * Rules are grouped by shape: which bits of each field they look at
+ * (source and destination prefix lengths, whether the next header and
+ * interface are fixed, and port prefix lengths). Port ranges are first
+ * split into aligned power-of-two blocks, so every range is a set of
+ * prefixes. All rules of one shape match a packet on exactly the same
+ * masked bits, so each shape is one hash table keyed by those bits, and a
+ * lookup masks the packet once per shape and probes its table.
+ *
+ * Shapes are probed in order of the highest priority rule they hold, and
+ * the search stops once no later shape can beat the match found so far.
+ * A thousand rules of a handful of shapes cost the same handful of probes
+ * as ten rules of those shapes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "acl.h"
+
+// Packet fields as words, so masking a packet is a few ANDs
+struct acl_key {
+    uint64_t src[2];
+    uint64_t dst[2];
+    uint64_t rest;               /* proto << 48 | iface << 32 | sport << 16 | dport */
+};
+
+struct acl_slot {
+    struct acl_key key;          /* Masked field values */
+    int rule;                    /* Highest priority rule matching them, -1 if empty */
+};
+
+// The rules of one shape
+struct acl_tuple {
+    struct acl_key mask;         /* Bits this shape looks at */
+    int needs_ports;             /* Looks at port bits */
+    int min_rule;                /* Highest priority rule in the table */
+    int num_entries;
+    uint32_t size_mask;          /* Table size - 1, size is a power of 2 */
+    struct acl_slot *slots;
+};
+
+struct acl_set {
+    int num_tuples;
+    struct acl_tuple *tuples;    /* By min_rule */
+};
+
+// A rule with its port ranges reduced to one block each, before hashing
+struct acl_pending {
+    struct acl_key key;
+    int tuple;
+    int rule;
+};
+
+static uint64_t pack_rest(uint8_t proto, int iface, uint16_t sport, uint16_t dport) {
+    return (uint64_t)proto << 48 | (uint64_t)(uint16_t)iface << 32 |
+           (uint64_t)sport << 16 | dport;
+}
+
+static void prefix_mask(int len, uint64_t mask[2]) {
+    uint8_t bytes[16];
+    memset(bytes, 0, sizeof(bytes));
+    memset(bytes, 0xff, len / 8);
+    if (len % 8 != 0) {
+        bytes[len / 8] = (uint8_t)(0xff << (8 - len % 8));
+    }
+    memcpy(mask, bytes, sizeof(bytes));
+}
+
+static void mask_key(const struct acl_key *key, const struct acl_key *mask,
+                     struct acl_key *out) {
+    out->src[0] = key->src[0] & mask->src[0];
+    out->src[1] = key->src[1] & mask->src[1];
+    out->dst[0] = key->dst[0] & mask->dst[0];
+    out->dst[1] = key->dst[1] & mask->dst[1];
+    out->rest = key->rest & mask->rest;
+}
+
+static uint32_t key_hash(const struct acl_key *key) {
+    uint64_t h = key->src[0] ^ (key->src[1] * 0xff51afd7ed558ccdULL) ^
+                 (key->dst[0] * 0xc4ceb9fe1a85ec53ULL) ^ (key->dst[1] * 0x94d049bb133111ebULL) ^
+                 (key->rest * 0xbf58476d1ce4e5b9ULL);
+    h ^= h >> 32;  // Fold the last bytes down, the multiply only carries upward
+    return (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/**
+ * Split [lo, hi] into aligned blocks, each a port prefix
+ * Returns the number of blocks, at most 32
+ */
+static int port_blocks(uint16_t lo, uint16_t hi, uint16_t *starts, uint8_t *lens) {
+    int n = 0;
+    uint32_t port = lo;
+    while (port <= hi) {
+        // Widen the block while it stays aligned and inside the range
+        int len = 16;
+        while (len > 0) {
+            uint32_t size = 1u << (17 - len);
+            if ((port & (size - 1)) != 0 || port + size - 1 > hi) {
+                break;
+            }
+            len--;
+        }
+        starts[n] = (uint16_t)port;
+        lens[n] = (uint8_t)len;
+        n++;
+        port += 1u << (16 - len);
+    }
+    return n;
+}
+
+/**
+ * Find the tuple with this mask, adding it if there is none
+ * Returns its index, or -1 if out of memory
+ */
+static int find_tuple(struct acl_set *set, int *capacity, const struct acl_key *mask,
+                      int needs_ports, int rule) {
+    for (int t = 0; t < set->num_tuples; t++) {
+        if (memcmp(&set->tuples[t].mask, mask, sizeof(*mask)) == 0) {
+            return t;
+        }
+    }
+    if (set->num_tuples == *capacity) {
+        int grown = *capacity ? 2 * *capacity : 16;
+        struct acl_tuple *tuples = realloc(set->tuples, grown * sizeof(struct acl_tuple));
+        if (tuples == NULL) {
+            return -1;
+        }
+        set->tuples = tuples;
+        *capacity = grown;
+    }
+    struct acl_tuple *tuple = &set->tuples[set->num_tuples];
+    memset(tuple, 0, sizeof(*tuple));
+    tuple->mask = *mask;
+    tuple->needs_ports = needs_ports;
+    tuple->min_rule = rule;
+    return set->num_tuples++;
+}
+
+static int compare_tuples(const void *a, const void *b) {
+    return ((const struct acl_tuple *)a)->min_rule - ((const struct acl_tuple *)b)->min_rule;
+}
+
+struct acl_set *acl_compile(const struct acl_rule *rules, int num_rules) {
+    struct acl_set *set = calloc(1, sizeof(struct acl_set));
+    struct acl_pending *pending = NULL;
+    int num_pending = 0, pending_capacity = 0, tuple_capacity = 0;
+    if (set == NULL) {
+        return NULL;
+    }
+
+    // Reduce each rule to one pending entry per pair of port blocks
+    for (int r = 0; r < num_rules; r++) {
+        const struct acl_rule *rule = &rules[r];
+        uint16_t sport_starts[32], dport_starts[32];
+        uint8_t sport_lens[32], dport_lens[32];
+        int num_sport = port_blocks(rule->sport_lo, rule->sport_hi, sport_starts, sport_lens);
+        int num_dport = port_blocks(rule->dport_lo, rule->dport_hi, dport_starts, dport_lens);
+
+        for (int s = 0; s < num_sport; s++) {
+            for (int d = 0; d < num_dport; d++) {
+                if (num_pending == ACL_MAX_ENTRIES) {
+                    goto fail;
+                }
+                if (num_pending == pending_capacity) {
+                    pending_capacity = pending_capacity ? 2 * pending_capacity : 256;
+                    struct acl_pending *grown = realloc(pending, pending_capacity *
+                                                        sizeof(struct acl_pending));
+                    if (grown == NULL) {
+                        goto fail;
+                    }
+                    pending = grown;
+                }
+
+                struct acl_key mask;
+                prefix_mask(rule->src_len, mask.src);
+                prefix_mask(rule->dst_len, mask.dst);
+                uint16_t sport_mask = sport_lens[s] ? (uint16_t)(0xffff << (16 - sport_lens[s])) : 0;
+                uint16_t dport_mask = dport_lens[d] ? (uint16_t)(0xffff << (16 - dport_lens[d])) : 0;
+                mask.rest = pack_rest(rule->proto >= 0 ? 0xff : 0, rule->iface >= 0 ? 0xffff : 0,
+                                      sport_mask, dport_mask);
+
+                struct acl_pending *entry = &pending[num_pending++];
+                memcpy(entry->key.src, &rule->src, sizeof(rule->src));
+                memcpy(entry->key.dst, &rule->dst, sizeof(rule->dst));
+                entry->key.rest = pack_rest(rule->proto >= 0 ? rule->proto : 0,
+                                            rule->iface, sport_starts[s], dport_starts[d]);
+                mask_key(&entry->key, &mask, &entry->key);
+                entry->rule = r;
+                entry->tuple = find_tuple(set, &tuple_capacity, &mask,
+                                          sport_mask != 0 || dport_mask != 0, r);
+                if (entry->tuple < 0) {
+                    goto fail;
+                }
+                set->tuples[entry->tuple].num_entries++;
+            }
+        }
+    }
+
+    // Size each tuple's table to at most a quarter full, misses are the
+    // common case and probe until they reach an empty slot
+    for (int t = 0; t < set->num_tuples; t++) {
+        struct acl_tuple *tuple = &set->tuples[t];
+        uint32_t size = 16;
+        while (size < 4 * (uint32_t)tuple->num_entries) {
+            size *= 2;
+        }
+        tuple->size_mask = size - 1;
+        tuple->slots = malloc(size * sizeof(struct acl_slot));
+        if (tuple->slots == NULL) {
+            goto fail;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            tuple->slots[i].rule = -1;
+        }
+    }
+
+    // Entries come in priority order, so the first rule to claim a key keeps it
+    for (int e = 0; e < num_pending; e++) {
+        struct acl_tuple *tuple = &set->tuples[pending[e].tuple];
+        uint32_t bucket = key_hash(&pending[e].key) & tuple->size_mask;
+        while (tuple->slots[bucket].rule >= 0 &&
+               memcmp(&tuple->slots[bucket].key, &pending[e].key, sizeof(struct acl_key)) != 0) {
+            bucket = (bucket + 1) & tuple->size_mask;
+        }
+        if (tuple->slots[bucket].rule < 0) {
+            tuple->slots[bucket].key = pending[e].key;
+            tuple->slots[bucket].rule = pending[e].rule;
+        }
+    }
+    free(pending);
+
+    qsort(set->tuples, set->num_tuples, sizeof(struct acl_tuple), compare_tuples);
+    return set;
+
+fail:
+    free(pending);
+    acl_free(set);
+    return NULL;
+}
+
+void acl_free(struct acl_set *set) {
+    if (set == NULL) {
+        return;
+    }
+    for (int t = 0; t < set->num_tuples; t++) {
+        free(set->tuples[t].slots);
+    }
+    free(set->tuples);
+    free(set);
+}
+
+int acl_classify(const struct acl_set *set, const struct acl_packet *pkt) {
+    struct acl_key key;
+    memcpy(key.src, &pkt->src, sizeof(pkt->src));
+    memcpy(key.dst, &pkt->dst, sizeof(pkt->dst));
+    key.rest = pack_rest(pkt->proto, pkt->iface, pkt->sport, pkt->dport);
+
+    int best = -1;
+    for (int t = 0; t < set->num_tuples; t++) {
+        const struct acl_tuple *tuple = &set->tuples[t];
+        if (best >= 0 && tuple->min_rule > best) {
+            break;  // Every later tuple only holds lower priority rules
+        }
+        if (tuple->needs_ports && !pkt->has_ports) {
+            continue;
+        }
+
+        struct acl_key masked;
+        mask_key(&key, &tuple->mask, &masked);
+        uint32_t bucket = key_hash(&masked) & tuple->size_mask;
+        while (tuple->slots[bucket].rule >= 0) {
+            if (memcmp(&tuple->slots[bucket].key, &masked, sizeof(masked)) == 0) {
+                if (best < 0 || tuple->slots[bucket].rule < best) {
+                    best = tuple->slots[bucket].rule;
+                }
+                break;
+            }
+            bucket = (bucket + 1) & tuple->size_mask;
+        }
+    }
+    return best;
+}
+
+int acl_num_tuples(const struct acl_set *set) {
+    return set->num_tuples;
+}
+
+#ifdef RUN_ACL_TEST
+/* to compile: gcc -Wall -Wextra -DRUN_ACL_TEST acl.c -o acl */
+
+#include <assert.h>
+#include <stdio.h>
+
+#define TEST_SETS 100
+#define TEST_RULES 64
+#define TEST_PACKETS 2000
+
+static int prefix_matches(const struct in6_addr *prefix, int len, const struct in6_addr *addr) {
+    uint64_t mask[2], a[2], p[2];
+    prefix_mask(len, mask);
+    memcpy(a, addr, sizeof(a));
+    memcpy(p, prefix, sizeof(p));
+    return ((a[0] ^ p[0]) & mask[0]) == 0 && ((a[1] ^ p[1]) & mask[1]) == 0;
+}
+
+static void mask_addr(struct in6_addr *addr, int len) {
+    uint64_t mask[2], a[2];
+    prefix_mask(len, mask);
+    memcpy(a, addr, sizeof(a));
+    a[0] &= mask[0];
+    a[1] &= mask[1];
+    memcpy(addr, a, sizeof(a));
+}
+
+/**
+ * First matching rule by checking each in turn, what acl_classify must agree with
+ */
+static int linear_classify(const struct acl_rule *rules, int num_rules,
+                           const struct acl_packet *pkt) {
+    for (int r = 0; r < num_rules; r++) {
+        const struct acl_rule *rule = &rules[r];
+        int any_ports = rule->sport_lo == 0 && rule->sport_hi == 65535 &&
+                        rule->dport_lo == 0 && rule->dport_hi == 65535;
+        if ((rule->iface < 0 || rule->iface == pkt->iface) &&
+            (rule->proto < 0 || rule->proto == pkt->proto) &&
+            prefix_matches(&rule->src, rule->src_len, &pkt->src) &&
+            prefix_matches(&rule->dst, rule->dst_len, &pkt->dst) &&
+            (any_ports || (pkt->has_ports &&
+                           pkt->sport >= rule->sport_lo && pkt->sport <= rule->sport_hi &&
+                           pkt->dport >= rule->dport_lo && pkt->dport <= rule->dport_hi))) {
+            return r;
+        }
+    }
+    return -1;
+}
+
+/**
+ * A port range, often one of the awkward ones that split into many blocks
+ */
+static void random_range(uint16_t *lo, uint16_t *hi) {
+    static const uint16_t edges[] = { 0, 1, 22, 1023, 1024, 1025, 32767, 32768, 65534, 65535 };
+    int kind = rand() % 4;
+    if (kind == 0) {
+        *lo = 0;
+        *hi = 65535;
+    } else if (kind == 1) {
+        *lo = *hi = edges[rand() % 10];
+    } else {
+        uint16_t a = rand() % 3 ? edges[rand() % 10] : (uint16_t)rand();
+        uint16_t b = rand() % 3 ? edges[rand() % 10] : (uint16_t)rand();
+        *lo = a < b ? a : b;
+        *hi = a < b ? b : a;
+    }
+}
+
+/**
+ * A port near an edge of some rule's range
+ */
+static uint16_t random_port(const struct acl_rule *rules, int num_rules) {
+    const struct acl_rule *rule = &rules[rand() % num_rules];
+    uint16_t edges[] = { rule->sport_lo, rule->sport_hi, rule->dport_lo, rule->dport_hi };
+    return edges[rand() % 4] + rand() % 3 - 1;
+}
+
+int main(void) {
+    // A deny of a port range ahead of a permit of everything
+    struct acl_rule rules[TEST_RULES];
+    memset(rules, 0, 2 * sizeof(rules[0]));
+    rules[0].action = ACL_DENY;
+    rules[0].iface = rules[1].iface = -1;
+    rules[0].proto = 6;
+    rules[1].proto = -1;
+    rules[0].sport_hi = rules[1].sport_hi = rules[1].dport_hi = 65535;
+    rules[0].dport_lo = 1000;
+    rules[0].dport_hi = 2000;
+    struct acl_set *set = acl_compile(rules, 2);
+    assert(set != NULL);
+    struct acl_packet pkt;
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.proto = 6;
+    pkt.has_ports = 1;
+    static const struct { uint16_t dport; int rule; } cases[] = {
+        { 999, 1 }, { 1000, 0 }, { 1500, 0 }, { 2000, 0 }, { 2001, 1 }
+    };
+    for (int i = 0; i < 5; i++) {
+        pkt.dport = cases[i].dport;
+        assert(acl_classify(set, &pkt) == cases[i].rule);
+    }
+    pkt.dport = 1500;
+    pkt.has_ports = 0;
+    assert(acl_classify(set, &pkt) == 1);  // Port rules never match a packet without ports
+    acl_free(set);
+
+    // Random rule sets of few shapes against checking every rule in turn
+    srand(1);
+    for (int s = 0; s < TEST_SETS; s++) {
+        for (int r = 0; r < TEST_RULES; r++) {
+            struct acl_rule *rule = &rules[r];
+            memset(rule, 0, sizeof(*rule));
+            rule->action = rand() % 2 ? ACL_PERMIT : ACL_DENY;
+            rule->iface = rand() % 4 ? -1 : rand() % 3;
+            rule->proto = rand() % 3 ? (rand() % 2 ? 6 : 17) : -1;
+            rule->src_len = (uint8_t[]){ 0, 32, 48, 64, 127 }[rand() % 5];
+            rule->dst_len = (uint8_t[]){ 0, 16, 64, 128 }[rand() % 4];
+            rule->src.s6_addr[0] = rule->dst.s6_addr[0] = 0xfd;
+            rule->src.s6_addr[rand() % 16] = rand() % 4;
+            rule->dst.s6_addr[15] = rand() % 4;
+            mask_addr(&rule->src, rule->src_len);
+            mask_addr(&rule->dst, rule->dst_len);
+            random_range(&rule->sport_lo, &rule->sport_hi);
+            random_range(&rule->dport_lo, &rule->dport_hi);
+        }
+        set = acl_compile(rules, TEST_RULES);
+        assert(set != NULL);
+        for (int p = 0; p < TEST_PACKETS; p++) {
+            memset(&pkt, 0, sizeof(pkt));
+            pkt.src = rules[rand() % TEST_RULES].src;
+            pkt.dst = rules[rand() % TEST_RULES].dst;
+            pkt.src.s6_addr[rand() % 16] ^= rand() % 2;
+            pkt.iface = rand() % 3;
+            pkt.proto = rand() % 4 ? (rand() % 2 ? 6 : 17) : 58;
+            pkt.has_ports = pkt.proto != 58;
+            if (pkt.has_ports) {
+                pkt.sport = random_port(rules, TEST_RULES);
+                pkt.dport = random_port(rules, TEST_RULES);
+            }
+            assert(acl_classify(set, &pkt) == linear_classify(rules, TEST_RULES, &pkt));
+        }
+        acl_free(set);
+    }
+    printf("ok\n");
+    return 0;
+}
+#endif /* RUN_ACL_TEST */
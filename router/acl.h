@@ -0,0 +1,68 @@
+/**
+ * acl.h
+ * Packet filter rule sets compiled into a classifier whose lookup cost
+ * depends on how many distinct rule shapes there are, not on how many
+ * rules. First matching rule wins.
+ *
+ * A compiled set is read only, so any number of threads can classify with
+ * it at once. Changing rules means compiling a new set and swapping it in.
+ */
+
+#ifndef ACL_H
+#define ACL_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define ACL_MAX_RULES 16384
+#define ACL_MAX_ENTRIES (1 << 20)    /* Rules after port ranges are split into blocks */
+
+enum acl_action {
+    ACL_PERMIT,
+    ACL_DENY
+};
+
+// A rule, fields left at their widest match anything
+struct acl_rule {
+    enum acl_action action;
+    int iface;                   /* Interface, -1 for any */
+    struct in6_addr src;         /* Source prefix, host bits zeroed */
+    struct in6_addr dst;         /* Destination prefix, host bits zeroed */
+    uint8_t src_len;             /* 0 for any source */
+    uint8_t dst_len;             /* 0 for any destination */
+    int proto;                   /* IPv6 next header, -1 for any */
+    uint16_t sport_lo, sport_hi; /* Source port range, 0-65535 for any */
+    uint16_t dport_lo, dport_hi; /* Destination port range, 0-65535 for any */
+};
+
+// The fields of a packet rules can match
+struct acl_packet {
+    struct in6_addr src;
+    struct in6_addr dst;
+    int iface;
+    uint8_t proto;
+    int has_ports;               /* TCP or UDP with ports, else rules on ports never match */
+    uint16_t sport, dport;
+};
+
+struct acl_set;
+
+/**
+ * Compile rules, in priority order, into a classifier
+ * Returns the set, or NULL if out of memory or over ACL_MAX_ENTRIES
+ */
+struct acl_set *acl_compile(const struct acl_rule *rules, int num_rules);
+
+void acl_free(struct acl_set *set);
+
+/**
+ * Index of the first rule matching pkt, or -1 if none does
+ */
+int acl_classify(const struct acl_set *set, const struct acl_packet *pkt);
+
+/**
+ * Number of rule shapes, each costing one hash probe at most per lookup
+ */
+int acl_num_tuples(const struct acl_set *set);
+
+#endif /* ACL_H */
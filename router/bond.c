@@ -0,0 +1,553 @@
+/**
+ * bond.c
+ * Link bonding, see bond.h.
+ *
+ * Round robin frames carry their sequence number without growing, so the
+ * link MTU is unchanged: a sequenced frame is an IPv6 packet whose version
+ * nibble is BOND_SEQUENCED and whose payload length field holds the
+ * sequence number. The receiver puts both back, the payload length from
+ * the frame's length. Anything else (hellos, and packets whose payload
+ * length does not match their size) goes unsequenced and is delivered as
+ * it arrives.
+ *
+ * Each member is a FIFO line, so once every live member has delivered a
+ * frame sequenced after a missing one, the missing one is lost, as in
+ * multilink PPP (RFC 1990). A member that has carried nothing yet or has
+ * gone quiet is covered by giving up after BOND_REORDER_MS.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "slipnet.h"
+#include "bond.h"
+
+#define BOND_SEQUENCED 0xf           /* Version nibble of a sequenced frame */
+#define BOND_WINDOW 64               /* Frames a round robin receiver holds, a power of 2 */
+#define BOND_REORDER_MS 2000         /* Wait for a missing frame, over a long frame at 9600 b/s */
+#define BOND_TX_QUEUE 2              /* Frames queued on each member */
+#define BOND_THREAD_STACK (256 * 1024)
+#define IPV6_HEADER_SIZE 40
+
+// A round robin frame held until the ones before it are delivered
+struct bond_frame {
+    int used;
+    uint16_t seq;
+    int numbytes;
+    char data[MAX_SLIP_SIZE];
+};
+
+// A frame put back in order, waiting to be handed to the handler
+struct bond_ready {
+    struct bond_ready *next;
+    int numbytes;
+    char data[];
+};
+
+struct bond_member {
+    int tty;
+    atomic_int live;             /* Bytes arrived within the detection time */
+    uint64_t last_rx_ms;         /* Last time bytes arrived, bond_check only */
+    unsigned long last_bytes;    /* Bytes received at the last check */
+    int seen_seq;                /* Has delivered a sequenced frame, under rx_lock */
+    uint16_t last_seq;           /* The latest one's sequence number, under rx_lock */
+    pthread_mutex_t tx_lock;     /* Protects the queue */
+    pthread_cond_t tx_ready;     /* Signalled when a frame is queued */
+    pthread_cond_t tx_space;     /* Signalled when a frame is taken */
+    char *queue[BOND_TX_QUEUE];  /* Frames for the member's send thread */
+    int sizes[BOND_TX_QUEUE];
+    int head, count;
+    unsigned long dropped;       /* Frames not queued for lack of memory, under tx_lock */
+};
+
+struct bond {
+    int first_tty;
+    int num_members;
+    enum bond_mode mode;
+    struct bond_member *members;
+    void (*handler)(int, const void *, int);
+    uint16_t tx_seq;             /* Next sequence number, only the sending thread */
+    int next_member;             /* Last member sent on, only the sending thread */
+    pthread_mutex_t rx_lock;     /* Protects the receive state below */
+    int rx_started;              /* A sequenced frame has arrived */
+    uint16_t rx_next;            /* Sequence number to deliver next */
+    int rx_buffered;             /* Frames held in window */
+    uint64_t gap_since_ms;       /* When rx_next was first waited on, 0 if it is not */
+    struct bond_frame *window;   /* BOND_WINDOW frames, NULL unless bonded round robin */
+    struct bond_ready *ready;    /* Frames to deliver, oldest first */
+    struct bond_ready **ready_tail;
+    int delivering;              /* A thread is handing ready frames to the handler */
+    unsigned long reordered, lost, late;
+};
+
+static struct bond *bonds = NULL;    /* Per interface, NULL before bond_configure */
+static int num_bonds;
+static int *tty_iface;               /* Interface of each tty */
+static int num_ttys;
+static uint64_t (*bond_clock_ms)(void);
+
+int bond_configure(int num_ifaces, const int *num_members, const enum bond_mode *modes,
+                   uint64_t (*clock_ms)(void)) {
+    num_ttys = 0;
+    for (int i = 0; i < num_ifaces; i++) {
+        num_ttys += num_members[i];
+    }
+    struct bond *table = calloc(num_ifaces, sizeof(struct bond));
+    tty_iface = malloc(num_ttys * sizeof(int));
+    if (table == NULL || tty_iface == NULL) {
+        goto fail;
+    }
+
+    int tty = 0;
+    for (int i = 0; i < num_ifaces; i++) {
+        struct bond *b = &table[i];
+        b->first_tty = tty;
+        b->num_members = num_members[i];
+        b->mode = modes[i];
+        b->members = calloc(b->num_members, sizeof(struct bond_member));
+        if (b->members == NULL) {
+            goto fail;
+        }
+        if (b->num_members > 1 && b->mode == BOND_ROUND_ROBIN) {
+            b->window = calloc(BOND_WINDOW, sizeof(struct bond_frame));
+            if (b->window == NULL) {
+                goto fail;
+            }
+        }
+        b->ready_tail = &b->ready;
+        pthread_mutex_init(&b->rx_lock, NULL);
+        for (int m = 0; m < b->num_members; m++) {
+            struct bond_member *member = &b->members[m];
+            member->tty = tty;
+            atomic_init(&member->live, 1);
+            pthread_mutex_init(&member->tx_lock, NULL);
+            pthread_cond_init(&member->tx_ready, NULL);
+            pthread_cond_init(&member->tx_space, NULL);
+            tty_iface[tty++] = i;
+        }
+    }
+    bond_clock_ms = clock_ms;
+    num_bonds = num_ifaces;
+    bonds = table;
+    return 0;
+
+fail:
+    for (int i = 0; table != NULL && i < num_ifaces; i++) {
+        free(table[i].members);
+        free(table[i].window);
+    }
+    free(table);
+    free(tty_iface);
+    tty_iface = NULL;
+    return -1;
+}
+
+int bond_num_ttys(void) {
+    return num_ttys;
+}
+
+int bond_iface(int tty) {
+    return bonds == NULL ? tty : tty_iface[tty];
+}
+
+int bond_members(int iface) {
+    return bonds == NULL ? 1 : bonds[iface].num_members;
+}
+
+// ============================================================================
+// RECEIVE
+// ============================================================================
+
+/**
+ * Copy a held frame to the end of the ready list and free its place, the
+ * handler gets it from deliver_ready
+ * Caller must hold rx_lock
+ */
+static void deliver_frame(struct bond *b, struct bond_frame *f) {
+    struct bond_ready *r = malloc(sizeof(struct bond_ready) + f->numbytes);
+    if (r == NULL) {
+        b->lost++;
+    } else {
+        r->next = NULL;
+        r->numbytes = f->numbytes;
+        memcpy(r->data, f->data, f->numbytes);
+        *b->ready_tail = r;
+        b->ready_tail = &r->next;
+    }
+    f->used = 0;
+    b->rx_buffered--;
+}
+
+/**
+ * Hand the ready frames to the interface's handler in order, with rx_lock
+ * released so the other members keep receiving meanwhile. One thread
+ * delivers at a time, one that finds another at it leaves it its frames.
+ * Caller must hold rx_lock, which is released
+ */
+static void deliver_ready(struct bond *b, int iface) {
+    if (b->delivering) {
+        pthread_mutex_unlock(&b->rx_lock);
+        return;
+    }
+    b->delivering = 1;
+    while (b->ready != NULL) {
+        struct bond_ready *r = b->ready;
+        b->ready = NULL;
+        b->ready_tail = &b->ready;
+        pthread_mutex_unlock(&b->rx_lock);
+        while (r != NULL) {
+            struct bond_ready *next = r->next;
+            b->handler(iface, r->data, r->numbytes);
+            free(r);
+            r = next;
+        }
+        pthread_mutex_lock(&b->rx_lock);
+    }
+    b->delivering = 0;
+    pthread_mutex_unlock(&b->rx_lock);
+}
+
+/**
+ * Ready held frames in order. A missing frame is given up on once every
+ * live member has delivered one sequenced after it, or when it is overdue,
+ * in which case the missing frames up to the next held one all go.
+ * Caller must hold rx_lock
+ */
+static void deliver_in_order(struct bond *b, uint64_t now) {
+    while (b->rx_buffered > 0) {
+        struct bond_frame *f = &b->window[b->rx_next & (BOND_WINDOW - 1)];
+        if (f->used && f->seq == b->rx_next) {
+            deliver_frame(b, f);
+            b->rx_next++;
+            b->gap_since_ms = 0;
+            continue;
+        }
+
+        int passed = 1;
+        for (int m = 0; m < b->num_members && passed; m++) {
+            const struct bond_member *member = &b->members[m];
+            if (atomic_load_explicit(&member->live, memory_order_relaxed) &&
+                (!member->seen_seq || (int16_t)(member->last_seq - b->rx_next) <= 0)) {
+                passed = 0;
+            }
+        }
+        if (b->gap_since_ms == 0) {
+            b->gap_since_ms = now;
+        }
+        if (!passed && now - b->gap_since_ms < BOND_REORDER_MS) {
+            break;
+        }
+        b->lost++;
+        b->rx_next++;
+    }
+}
+
+/**
+ * slipnet handler of every member tty that is not its interface's number,
+ * or is in a bond. Round robin frames are put back in order.
+ */
+static void bond_receive(int tty, const void *vdata, int numbytes) {
+    int iface = tty_iface[tty];
+    struct bond *b = &bonds[iface];
+    const uint8_t *data = vdata;
+    if (b->window == NULL || numbytes < IPV6_HEADER_SIZE || data[0] >> 4 != BOND_SEQUENCED) {
+        b->handler(iface, vdata, numbytes);
+        return;
+    }
+    uint16_t seq = data[4] << 8 | data[5];
+    uint64_t now = bond_clock_ms();
+
+    pthread_mutex_lock(&b->rx_lock);
+    struct bond_member *member = &b->members[tty - b->first_tty];
+    member->seen_seq = 1;
+    member->last_seq = seq;
+    int16_t ahead = seq - b->rx_next;
+    if (!b->rx_started || ahead < -BOND_WINDOW) {
+        // First frame, or the sender started over: deliver what is held
+        for (int k = 0; k < BOND_WINDOW && b->rx_buffered > 0; k++) {
+            struct bond_frame *f = &b->window[(b->rx_next + k) & (BOND_WINDOW - 1)];
+            if (f->used) {
+                deliver_frame(b, f);
+            }
+        }
+        b->rx_started = 1;
+        b->rx_next = seq;
+        b->gap_since_ms = 0;
+        ahead = 0;
+    }
+    if (ahead < 0 || b->window[seq & (BOND_WINDOW - 1)].used) {
+        // Its turn has passed, or it is a duplicate
+        b->late++;
+        deliver_ready(b, iface);
+        return;
+    }
+
+    // Too far ahead to hold: deliver or give up on the oldest to make room
+    while (ahead >= BOND_WINDOW) {
+        struct bond_frame *f = &b->window[b->rx_next & (BOND_WINDOW - 1)];
+        if (f->used) {
+            deliver_frame(b, f);
+        } else {
+            b->lost++;
+        }
+        b->rx_next++;
+        b->gap_since_ms = 0;
+        ahead--;
+    }
+
+    // Hold it as the IPv6 packet it was sent as
+    struct bond_frame *f = &b->window[seq & (BOND_WINDOW - 1)];
+    memcpy(f->data, data, numbytes);
+    f->data[0] = 0x60 | (data[0] & 0x0f);
+    f->data[4] = (numbytes - IPV6_HEADER_SIZE) >> 8;
+    f->data[5] = (numbytes - IPV6_HEADER_SIZE) & 0xff;
+    f->numbytes = numbytes;
+    f->seq = seq;
+    f->used = 1;
+    b->rx_buffered++;
+    if (ahead > 0) {
+        b->reordered++;
+    }
+    deliver_in_order(b, now);
+    deliver_ready(b, iface);
+}
+
+// ============================================================================
+// TRANSMIT
+// ============================================================================
+
+/**
+ * Member send thread - writes the member's queued frames to its tty
+ */
+static void *member_send_thread(void *arg) {
+    struct bond_member *member = arg;
+    while (1) {
+        pthread_mutex_lock(&member->tx_lock);
+        while (member->count == 0) {
+            pthread_cond_wait(&member->tx_ready, &member->tx_lock);
+        }
+        char *data = member->queue[member->head];
+        int numbytes = member->sizes[member->head];
+        member->head = (member->head + 1) % BOND_TX_QUEUE;
+        member->count--;
+        pthread_cond_signal(&member->tx_space);
+        pthread_mutex_unlock(&member->tx_lock);
+
+        write_slip_data(member->tty, data, numbytes);
+        free(data);
+    }
+    return NULL;
+}
+
+/**
+ * Queue a copy of a frame on a member, waiting for room if wait is set
+ * Returns 0, or -1 if the queue is full and wait is not set or there is
+ * no memory for the copy
+ */
+static int member_queue(struct bond_member *member, const char *data, int numbytes, int wait) {
+    pthread_mutex_lock(&member->tx_lock);
+    while (member->count == BOND_TX_QUEUE) {
+        if (!wait) {
+            pthread_mutex_unlock(&member->tx_lock);
+            return -1;
+        }
+        pthread_cond_wait(&member->tx_space, &member->tx_lock);
+    }
+    char *copy = malloc(numbytes);
+    if (copy == NULL) {
+        member->dropped++;
+        pthread_mutex_unlock(&member->tx_lock);
+        return -1;
+    }
+    memcpy(copy, data, numbytes);
+    int tail = (member->head + member->count) % BOND_TX_QUEUE;
+    member->queue[tail] = copy;
+    member->sizes[tail] = numbytes;
+    member->count++;
+    pthread_cond_signal(&member->tx_ready);
+    pthread_mutex_unlock(&member->tx_lock);
+    return 0;
+}
+
+/**
+ * Member a frame goes on: the hash's share of the live members, or the
+ * next live one after the last used. With none live, all of them are
+ * tried, so traffic resumes as soon as one comes back.
+ */
+static struct bond_member *pick_member(struct bond *b, uint32_t hash) {
+    int num_live = 0;
+    for (int m = 0; m < b->num_members; m++) {
+        num_live += atomic_load_explicit(&b->members[m].live, memory_order_relaxed);
+    }
+    int any = num_live == 0;
+    if (any) {
+        num_live = b->num_members;
+    }
+
+    if (b->mode == BOND_HASH) {
+        int pick = hash % num_live;
+        for (int m = 0; m < b->num_members; m++) {
+            if ((any || atomic_load_explicit(&b->members[m].live, memory_order_relaxed)) &&
+                pick-- == 0) {
+                return &b->members[m];
+            }
+        }
+    }
+    for (int k = 1; k <= b->num_members; k++) {
+        int m = (b->next_member + k) % b->num_members;
+        if (any || atomic_load_explicit(&b->members[m].live, memory_order_relaxed)) {
+            b->next_member = m;
+            return &b->members[m];
+        }
+    }
+    return &b->members[0];
+}
+
+int bond_write(int iface, char *data, int numbytes, uint32_t hash) {
+    if (bonds == NULL || bonds[iface].num_members == 1) {
+        return write_slip_data(bonds == NULL ? iface : bonds[iface].first_tty, data, numbytes);
+    }
+    if (numbytes <= 0 || numbytes > MAX_SLIP_SEND) {
+        printf("bond: bad size %d\n", numbytes);
+        return -1;
+    }
+    struct bond *b = &bonds[iface];
+    struct bond_member *member = pick_member(b, hash);
+
+    const uint8_t *bytes = (const uint8_t *)data;
+    if (b->window != NULL && numbytes >= IPV6_HEADER_SIZE && bytes[0] >> 4 == 6 &&
+        (bytes[4] << 8 | bytes[5]) == numbytes - IPV6_HEADER_SIZE) {
+        // Sequence it, see the top of this file
+        char frame[MAX_SLIP_SEND];
+        memcpy(frame, data, numbytes);
+        frame[0] = BOND_SEQUENCED << 4 | (bytes[0] & 0x0f);
+        frame[4] = b->tx_seq >> 8;
+        frame[5] = b->tx_seq & 0xff;
+        b->tx_seq++;  // Used up either way, the receiver gives up on it as on a lost frame
+        if (member_queue(member, frame, numbytes, 1) != 0) {
+            return -1;
+        }
+    } else if (member_queue(member, data, numbytes, 1) != 0) {
+        return -1;
+    }
+    return numbytes;
+}
+
+int bond_write_all(int iface, char *data, int numbytes) {
+    if (bonds == NULL || bonds[iface].num_members == 1) {
+        return write_slip_data(bonds == NULL ? iface : bonds[iface].first_tty, data, numbytes);
+    }
+    if (numbytes <= 0 || numbytes > MAX_SLIP_SEND) {
+        printf("bond: bad size %d\n", numbytes);
+        return -1;
+    }
+    // A member with a full queue is busy sending, which the neighbor sees
+    // as well as a hello, so it is skipped rather than waited on
+    for (int m = 0; m < bonds[iface].num_members; m++) {
+        member_queue(&bonds[iface].members[m], data, numbytes, 0);
+    }
+    return numbytes;
+}
+
+// ============================================================================
+// MEMBERS
+// ============================================================================
+
+int bond_install_handler(int iface, void (*handler)(int, const void *, int)) {
+    if (bonds == NULL) {
+        return install_slip_data_handler(iface, handler);
+    }
+    struct bond *b = &bonds[iface];
+    b->handler = handler;
+    if (b->num_members == 1 && b->first_tty == iface) {
+        return install_slip_data_handler(iface, handler);
+    }
+    for (int m = 0; m < b->num_members; m++) {
+        struct bond_member *member = &b->members[m];
+        if (install_slip_data_handler(member->tty, bond_receive) < 0) {
+            return -1;
+        }
+        if (b->num_members > 1) {
+            pthread_t tid;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setstacksize(&attr, BOND_THREAD_STACK);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            int failed = pthread_create(&tid, &attr, member_send_thread, member);
+            pthread_attr_destroy(&attr);
+            if (failed) {
+                return -1;
+            }
+        }
+    }
+    return iface;
+}
+
+unsigned long bond_bytes_received(int iface) {
+    if (bonds == NULL) {
+        return slip_bytes_received(iface);
+    }
+    unsigned long total = 0;
+    for (int m = 0; m < bonds[iface].num_members; m++) {
+        total += slip_bytes_received(bonds[iface].members[m].tty);
+    }
+    return total;
+}
+
+void bond_check(uint64_t now_ms, uint64_t detect_ms) {
+    if (bonds == NULL) {
+        return;
+    }
+    for (int i = 0; i < num_bonds; i++) {
+        struct bond *b = &bonds[i];
+        if (b->num_members == 1) {
+            continue;
+        }
+        for (int m = 0; m < b->num_members; m++) {
+            struct bond_member *member = &b->members[m];
+            unsigned long bytes = slip_bytes_received(member->tty);
+            if (bytes != member->last_bytes || member->last_rx_ms == 0) {
+                member->last_rx_ms = now_ms;
+                member->last_bytes = bytes;
+            }
+            int live = detect_ms == 0 || now_ms - member->last_rx_ms <= detect_ms;
+            if (live != atomic_load_explicit(&member->live, memory_order_relaxed)) {
+                atomic_store(&member->live, live);
+                printf("[Bond] Member tty %d of interface %d is %s\n",
+                       member->tty, i, live ? "up" : "down");
+            }
+        }
+        if (b->window != NULL) {
+            pthread_mutex_lock(&b->rx_lock);
+            deliver_in_order(b, now_ms);
+            deliver_ready(b, i);
+        }
+    }
+}
+
+int bond_get_stats(int iface, struct bond_stats *stats) {
+    if (bonds == NULL || bonds[iface].num_members == 1) {
+        return -1;
+    }
+    struct bond *b = &bonds[iface];
+    stats->mode = b->mode;
+    stats->members = b->num_members;
+    stats->live = 0;
+    stats->dropped = 0;
+    for (int m = 0; m < b->num_members; m++) {
+        struct bond_member *member = &b->members[m];
+        stats->live += atomic_load_explicit(&member->live, memory_order_relaxed);
+        pthread_mutex_lock(&member->tx_lock);
+        stats->dropped += member->dropped;
+        pthread_mutex_unlock(&member->tx_lock);
+    }
+    pthread_mutex_lock(&b->rx_lock);
+    stats->reordered = b->reordered;
+    stats->lost = b->lost;
+    stats->late = b->late;
+    pthread_mutex_unlock(&b->rx_lock);
+    return 0;
+}
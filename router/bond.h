@@ -0,0 +1,98 @@
+/**
+ * bond.h
+ * Link bonding between the router and slipnet. A bonded interface stripes
+ * its frames over several parallel ttys to the same neighbor, so the
+ * bandwidth between two routers grows with the number of lines. Frames go
+ * to members by flow hash, each flow staying on one member, or round robin
+ * with sequence numbers so the neighbor can put them back in order. A
+ * member that goes quiet is left out until bytes arrive on it again.
+ *
+ * Interfaces use consecutive ttys in interface order, so with interface 0
+ * bonded over three ttys, interface 1 is tty 3. Both ends of a bond must
+ * agree on its members and mode. Without bond_configure every interface
+ * is the tty of the same number, and calls go straight to slipnet.
+ */
+
+#ifndef BOND_H
+#define BOND_H
+
+#include <stdint.h>
+
+enum bond_mode { BOND_HASH, BOND_ROUND_ROBIN };
+
+// What a bonded interface has seen, see bond_get_stats
+struct bond_stats {
+    enum bond_mode mode;
+    int members;                 /* Member ttys */
+    int live;                    /* Members bytes arrived on lately */
+    unsigned long reordered;     /* Round robin frames held for an earlier one */
+    unsigned long lost;          /* Sequence numbers given up on */
+    unsigned long late;          /* Frames dropped, arriving after their turn */
+    unsigned long dropped;       /* Frames not queued to a member for lack of memory */
+};
+
+/**
+ * Give each of num_ifaces interfaces num_members[i] ttys in modes[i].
+ * clock_ms is the time reordering waits are measured by.
+ * Returns 0, or -1 if out of memory
+ */
+int bond_configure(int num_ifaces, const int *num_members, const enum bond_mode *modes,
+                   uint64_t (*clock_ms)(void));
+
+/**
+ * Total ttys the interfaces use
+ */
+int bond_num_ttys(void);
+
+/**
+ * Interface a tty belongs to
+ */
+int bond_iface(int tty);
+
+/**
+ * Number of ttys an interface is bonded over, 1 if it is not bonded
+ */
+int bond_members(int iface);
+
+/**
+ * Install a slipnet handler on every member of an interface, which is
+ * called with the interface number instead of the tty, frames of a round
+ * robin bond in the order they were sent, by one member's receive thread or
+ * bond_check's at a time. Starts the members' send threads.
+ * Returns iface, or -1 for errors
+ */
+int bond_install_handler(int iface, void (*handler)(int, const void *, int));
+
+/**
+ * Send a frame on the member its flow hash or the rotation picks. Frames
+ * of a bond are queued to its members' send threads, waiting for room, so
+ * only one thread may send on an interface at a time.
+ * Returns as write_slip_data does
+ */
+int bond_write(int iface, char *data, int numbytes, uint32_t hash);
+
+/**
+ * Send a frame on every member that has room for it, unsequenced (hellos).
+ * Never waits on a bond, so any thread may call it.
+ * Returns as write_slip_data does
+ */
+int bond_write_all(int iface, char *data, int numbytes);
+
+/**
+ * Bytes received on all members of an interface
+ */
+unsigned long bond_bytes_received(int iface);
+
+/**
+ * Mark members live or dead by whether bytes arrived within detect_ms, and
+ * give up on sequence numbers round robin bonds waited on too long
+ */
+void bond_check(uint64_t now_ms, uint64_t detect_ms);
+
+/**
+ * Fill in an interface's bond stats
+ * Returns 0, or -1 if it is not bonded
+ */
+int bond_get_stats(int iface, struct bond_stats *stats);
+
+#endif /* BOND_H */
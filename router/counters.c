@@ -0,0 +1,112 @@
+/**
+ * counters.c
+ * Per-interface packet counters in a memory-mapped file, see counters.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "counters.h"
+
+struct counters_header *counters_map = NULL;
+struct iface_counters *counters_shared = NULL;
+_Thread_local struct iface_counters *counters_local = NULL;
+
+// Thread blocks, handed out in order and recycled when a thread exits.
+// A recycled block keeps its counts, so totals never go backwards.
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key;
+static int *free_blocks;
+static int num_free = 0;
+static int next_block = 0;
+static int num_own_blocks;           /* Blocks before the shared one */
+
+/**
+ * Thread exit destructor, returns the thread's block to the free list
+ */
+static void release_block(void *arg) {
+    pthread_mutex_lock(&block_lock);
+    free_blocks[num_free++] = (int)(intptr_t)arg - 1;
+    pthread_mutex_unlock(&block_lock);
+}
+
+int counters_open(const char *path, int num_ifaces, int num_threads) {
+    // A block per thread as far as the budget goes, then the shared one
+    size_t most = COUNTERS_MAX_BYTES / ((size_t)num_ifaces * sizeof(struct iface_counters));
+    num_own_blocks = num_threads < 1 ? 1 : num_threads;
+    if ((size_t)num_own_blocks > most) {
+        num_own_blocks = most > 0 ? most : 1;
+        printf("Counting with %d thread blocks for up to %d threads, the rest share one\n",
+               num_own_blocks, num_threads);
+    }
+    free_blocks = malloc(num_own_blocks * sizeof(int));
+    if (free_blocks == NULL) {
+        return -1;
+    }
+    size_t size = COUNTERS_SIZE(num_own_blocks + 1, num_ifaces);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open counters file");
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0) {
+        perror("ftruncate counters file");
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap counters file");
+        return -1;
+    }
+    pthread_key_create(&block_key, release_block);
+
+    // The file starts zeroed, readers check the magic last
+    struct counters_header *header = map;
+    header->version = COUNTERS_VERSION;
+    header->num_ifaces = num_ifaces;
+    header->num_counters = NUM_COUNTERS;
+    header->num_threads = num_own_blocks + 1;
+    header->pid = getpid();
+    __atomic_store_n(&header->magic, COUNTERS_MAGIC, __ATOMIC_RELEASE);
+    counters_shared = counters_at(header, num_own_blocks, 0);
+    counters_map = header;
+    return 0;
+}
+
+struct iface_counters *counters_thread_block(void) {
+    int block = -1;
+
+    pthread_mutex_lock(&block_lock);
+    if (num_free > 0) {
+        block = free_blocks[--num_free];
+    } else if (next_block < num_own_blocks) {
+        block = next_block++;
+    } else {
+        __atomic_add_fetch(&counters_map->shared_threads, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&block_lock);
+    if (block < 0) {
+        counters_local = counters_shared;
+        return counters_local;
+    }
+
+    pthread_setspecific(block_key, (void *)(intptr_t)(block + 1));
+    counters_local = counters_at(counters_map, block, 0);
+    return counters_local;
+}
+
+uint64_t counters_total(int iface, enum counter_id id) {
+    uint64_t total = 0;
+    for (uint32_t t = 0; t < counters_map->num_threads; t++) {
+        total += atomic_load_explicit(&counters_at(counters_map, t, iface)->value[id],
+                                      memory_order_relaxed);
+    }
+    return total;
+}
@@ -0,0 +1,118 @@
+/**
+ * counters.h
+ * Per-interface packet counters, published in a memory-mapped file that
+ * routerstat (or anything else) can map read-only while the router runs.
+ *
+ * Every thread that counts owns one block of per-interface counters and is
+ * the only writer of it, so updates are plain relaxed loads and stores with
+ * no atomic read-modify-write and no cache line shared between threads.
+ * The file has a block for each thread the router expects, as far as
+ * COUNTERS_MAX_BYTES allows, and one shared block after them that threads
+ * finding none free add to atomically, so no count is lost. Readers sum the
+ * blocks of all threads.
+ */
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+
+#define COUNTERS_FILE "./router.counters"
+#define COUNTERS_MAGIC 0x31435452    /* "RTC1" */
+#define COUNTERS_VERSION 2
+#define COUNTERS_MAX_BYTES (16 << 20)    /* Most the threads' own blocks take */
+
+enum counter_id {
+    CTR_RX_PACKETS,
+    CTR_RX_BYTES,
+    CTR_TX_PACKETS,
+    CTR_TX_BYTES,
+    CTR_DROP_TOO_SHORT,              /* Shorter than an IPv6 header */
+    CTR_DROP_HOP_LIMIT,              /* Hop limit expired */
+    CTR_DROP_NO_ROUTE,               /* No route to the destination */
+    CTR_DROP_NO_INTERFACE,           /* No interface reaches the gateway */
+    CTR_DROP_QUEUE_FULL,             /* Worker or send queue full */
+    CTR_DROP_SLIP_FRAMING,           /* SLIP frame too long, lost END */
+    CTR_DROP_BAD_ESCAPE,             /* SLIP ESC followed by a bad byte */
+    CTR_DROP_FILTERED,               /* Denied by a packet filter rule */
+    CTR_DROP_POLICED,                /* Source over its policed rate */
+    NUM_COUNTERS
+};
+
+#define COUNTER_NAMES { \
+    "rx_packets", "rx_bytes", "tx_packets", "tx_bytes", \
+    "too_short", "hop_limit", "no_route", "no_interface", \
+    "queue_full", "slip_framing", "bad_escape", "filtered", "policed" }
+
+// Start of the file
+struct counters_header {
+    uint32_t magic;              /* COUNTERS_MAGIC */
+    uint32_t version;            /* COUNTERS_VERSION */
+    uint32_t num_ifaces;         /* Interfaces per thread block */
+    uint32_t num_counters;       /* NUM_COUNTERS */
+    uint32_t num_threads;        /* Thread blocks in the file, the last one shared */
+    uint32_t pid;                /* Router process */
+    uint32_t shared_threads;     /* Threads that found no free block of their own */
+    uint32_t reserved[9];        /* Pads the header to one cache line */
+};
+
+// One interface's counters in one thread's block, a whole number of lines
+struct iface_counters {
+    alignas(64) _Atomic uint64_t value[NUM_COUNTERS];
+};
+
+// The file is the header followed by num_threads blocks of num_ifaces
+#define COUNTERS_SIZE(num_threads, num_ifaces) (sizeof(struct counters_header) + \
+    (size_t)(num_threads) * (num_ifaces) * sizeof(struct iface_counters))
+
+static inline struct iface_counters *counters_at(struct counters_header *header,
+                                                 int thread, int iface) {
+    struct iface_counters *blocks = (struct iface_counters *)(header + 1);
+    return &blocks[(size_t)thread * header->num_ifaces + iface];
+}
+
+/**
+ * Create and map the counters file for num_ifaces interfaces counted by up
+ * to num_threads threads at a time
+ * Returns 0, or -1 if it could not be created
+ */
+int counters_open(const char *path, int num_ifaces, int num_threads);
+
+/**
+ * The calling thread's block, claimed on first use and handed to a later
+ * thread when this one exits, or the shared block if every one is in use
+ */
+struct iface_counters *counters_thread_block(void);
+
+/**
+ * Sum of one counter over all threads
+ */
+uint64_t counters_total(int iface, enum counter_id id);
+
+extern struct counters_header *counters_map;
+extern struct iface_counters *counters_shared;
+extern _Thread_local struct iface_counters *counters_local;
+
+/**
+ * Add n to a counter of the calling thread, a no-op before counters_open
+ */
+static inline void counter_add(int iface, enum counter_id id, uint64_t n) {
+    struct iface_counters *block = counters_local;
+    if (block == NULL) {
+        if (counters_map == NULL) {
+            return;
+        }
+        block = counters_thread_block();
+    }
+    _Atomic uint64_t *c = &block[iface].value[id];
+    if (block == counters_shared) {
+        atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+        return;
+    }
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+#endif /* COUNTERS_H */
@@ -0,0 +1,344 @@
+/**
+ * flows.c
+ * Sampled flow table and IPFIX exporter, see flows.h.
+ *
+ * The table is open addressing over a short probe window: a flow lives in
+ * one of the FLOW_PROBES slots after its hash, so lookups never chain and
+ * freeing a slot needs no tombstone. A new flow that finds the window full
+ * evicts the least recently seen flow in it, which is queued for export
+ * like any other finished flow.
+ *
+ * Every message carries the template ahead of its records, so a collector
+ * can decode any message on its own, as IPFIX over UDP needs.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "flows.h"
+
+struct flow_entry {
+    struct flow_key key;
+    int in_iface;                /* Ingress interface, -1 if the slot is empty */
+    int out_iface;               /* Egress interface of the latest packet */
+    uint64_t packets;            /* Sampled packets */
+    uint64_t bytes;              /* Sampled bytes */
+    uint64_t first_ms;           /* Monotonic time of the first sample */
+    uint64_t last_ms;            /* Monotonic time of the latest sample */
+};
+
+// IPFIX information elements of a record, in order
+#define IPFIX_VERSION 10
+#define IPFIX_TEMPLATE_SET 2
+#define IPFIX_TEMPLATE_ID 256
+#define IPFIX_HEADER_SIZE 16
+static const uint16_t template_fields[][2] = {
+    { 27, 16 },                  /* sourceIPv6Address */
+    { 28, 16 },                  /* destinationIPv6Address */
+    { 31, 4 },                   /* flowLabelIPv6 */
+    { 4, 1 },                    /* protocolIdentifier, the next header */
+    { 10, 4 },                   /* ingressInterface */
+    { 14, 4 },                   /* egressInterface */
+    { 2, 8 },                    /* packetDeltaCount, sampled */
+    { 1, 8 },                    /* octetDeltaCount, sampled */
+    { 152, 8 },                  /* flowStartMilliseconds */
+    { 153, 8 },                  /* flowEndMilliseconds */
+    { 34, 4 },                   /* samplingInterval */
+};
+#define NUM_TEMPLATE_FIELDS (int)(sizeof(template_fields) / sizeof(template_fields[0]))
+#define TEMPLATE_SET_SIZE (8 + 4 * NUM_TEMPLATE_FIELDS)
+#define RECORD_SIZE 81
+#define RECORDS_PER_MESSAGE \
+    ((FLOW_MAX_MESSAGE - IPFIX_HEADER_SIZE - TEMPLATE_SET_SIZE - 4) / RECORD_SIZE)
+
+_Atomic uint32_t flows_interval = 0;
+_Thread_local uint32_t flows_countdown = 0;
+
+// Table and export queue, guarded by flow_lock
+static pthread_mutex_t flow_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct flow_entry table[FLOW_TABLE_SIZE];
+static struct flow_entry queue[FLOW_EXPORT_QUEUE];
+static int queue_len = 0;
+static int num_active = 0;
+static uint64_t num_sampled, num_exported, num_messages, num_dropped;
+
+// Exporter, only touched by the thread calling flows_export
+static struct flow_entry pending[FLOW_EXPORT_QUEUE];
+static int export_fd = -1;
+static uint32_t sequence = 0;            /* Records sent before the next message */
+static int64_t wall_offset_ms = 0;       /* Wall clock minus monotonic clock */
+
+static uint8_t *put16(uint8_t *out, uint16_t value) {
+    out[0] = value >> 8;
+    out[1] = value;
+    return out + 2;
+}
+
+static uint8_t *put32(uint8_t *out, uint32_t value) {
+    out = put16(out, value >> 16);
+    return put16(out, value);
+}
+
+static uint8_t *put64(uint8_t *out, uint64_t value) {
+    out = put32(out, value >> 32);
+    return put32(out, value);
+}
+
+static int64_t clock_ms(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint32_t flow_key_hash(const struct flow_key *key) {
+    uint64_t words[4];
+    memcpy(words, &key->src, 16);
+    memcpy(words + 2, &key->dst, 16);
+    uint64_t h = words[0] ^ (words[1] * 0xff51afd7ed558ccdULL) ^
+                 (words[2] * 0xc4ceb9fe1a85ec53ULL) ^ (words[3] * 0x94d049bb133111ebULL) ^
+                 (((uint64_t)key->flow_label << 8 | key->next_header) * 0xbf58476d1ce4e5b9ULL);
+    h ^= h >> 32;
+    return (uint32_t)((h * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static int same_flow(const struct flow_key *a, const struct flow_key *b) {
+    return a->flow_label == b->flow_label && a->next_header == b->next_header &&
+           memcmp(&a->src, &b->src, 16) == 0 && memcmp(&a->dst, &b->dst, 16) == 0;
+}
+
+/**
+ * Queue a finished flow for export, counted as dropped if the queue is full
+ * Caller must hold flow_lock
+ */
+static void queue_flow(const struct flow_entry *entry) {
+    if (queue_len == FLOW_EXPORT_QUEUE) {
+        num_dropped++;
+        return;
+    }
+    queue[queue_len++] = *entry;
+}
+
+int flows_open(const char *target, uint32_t interval) {
+    if (strncmp(target, "udp:", 4) == 0) {
+        struct addrinfo hints, *addrs;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        int error = getaddrinfo("localhost", target + 4, &hints, &addrs);
+        if (error != 0) {
+            fprintf(stderr, "flow collector %s: %s\n", target, gai_strerror(error));
+            return -1;
+        }
+        export_fd = socket(addrs->ai_family, SOCK_DGRAM, 0);
+        if (export_fd >= 0 && connect(export_fd, addrs->ai_addr, addrs->ai_addrlen) != 0) {
+            close(export_fd);
+            export_fd = -1;
+        }
+        freeaddrinfo(addrs);
+    } else {
+        export_fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (export_fd < 0) {
+        perror(target);
+        return -1;
+    }
+
+    for (int i = 0; i < FLOW_TABLE_SIZE; i++) {
+        table[i].in_iface = -1;
+    }
+    wall_offset_ms = clock_ms(CLOCK_REALTIME) - clock_ms(CLOCK_MONOTONIC);
+    flows_set_interval(interval);
+    return 0;
+}
+
+void flows_set_interval(uint32_t interval) {
+    atomic_store(&flows_interval, interval);
+}
+
+uint32_t flows_next_gap(uint32_t interval) {
+    static _Thread_local uint64_t state = 0;
+    if (state == 0) {
+        state = (uint64_t)(uintptr_t)&state ^ (uint64_t)clock_ms(CLOCK_MONOTONIC) ^
+                0x9e3779b97f4a7c15ULL;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    // Uniform over 1 .. 2 * interval - 1, so the mean is interval and
+    // sampling does not lock onto periodic traffic
+    return 1 + (uint32_t)(state % (2 * (uint64_t)interval - 1));
+}
+
+void flows_record(const struct flow_key *key, int in_iface, int out_iface, int numbytes,
+                  uint64_t now_ms) {
+    uint32_t start = flow_key_hash(key);
+    struct flow_entry *free_slot = NULL, *oldest = NULL;
+
+    pthread_mutex_lock(&flow_lock);
+    num_sampled++;
+    for (int p = 0; p < FLOW_PROBES; p++) {
+        struct flow_entry *entry = &table[(start + p) & (FLOW_TABLE_SIZE - 1)];
+        if (entry->in_iface < 0) {
+            if (free_slot == NULL) {
+                free_slot = entry;
+            }
+            continue;
+        }
+        if (same_flow(&entry->key, key)) {
+            entry->out_iface = out_iface;
+            entry->packets++;
+            entry->bytes += numbytes;
+            entry->last_ms = now_ms;
+            pthread_mutex_unlock(&flow_lock);
+            return;
+        }
+        if (oldest == NULL || entry->last_ms < oldest->last_ms) {
+            oldest = entry;
+        }
+    }
+
+    if (free_slot == NULL) {
+        queue_flow(oldest);
+        free_slot = oldest;
+    } else {
+        num_active++;
+    }
+    free_slot->key = *key;
+    free_slot->in_iface = in_iface;
+    free_slot->out_iface = out_iface;
+    free_slot->packets = 1;
+    free_slot->bytes = numbytes;
+    free_slot->first_ms = now_ms;
+    free_slot->last_ms = now_ms;
+    pthread_mutex_unlock(&flow_lock);
+}
+
+/**
+ * Encode one record in template order
+ */
+static uint8_t *encode_flow(uint8_t *out, const struct flow_entry *entry, uint32_t interval) {
+    memcpy(out, &entry->key.src, 16);
+    memcpy(out + 16, &entry->key.dst, 16);
+    out = put32(out + 32, entry->key.flow_label);
+    *out++ = entry->key.next_header;
+    out = put32(out, entry->in_iface);
+    out = put32(out, entry->out_iface);
+    out = put64(out, entry->packets);
+    out = put64(out, entry->bytes);
+    out = put64(out, entry->first_ms + wall_offset_ms);
+    out = put64(out, entry->last_ms + wall_offset_ms);
+    return put32(out, interval);
+}
+
+/**
+ * Write count records as one message
+ * Returns 0, or -1 if the write failed
+ */
+static int write_message(const struct flow_entry *entries, int count, uint32_t interval) {
+    uint8_t message[FLOW_MAX_MESSAGE];
+    int length = IPFIX_HEADER_SIZE + TEMPLATE_SET_SIZE + 4 + count * RECORD_SIZE;
+
+    uint8_t *out = put16(message, IPFIX_VERSION);
+    out = put16(out, length);
+    out = put32(out, (uint32_t)(clock_ms(CLOCK_REALTIME) / 1000));
+    out = put32(out, sequence);
+    out = put32(out, 0);                           /* Observation domain */
+
+    out = put16(out, IPFIX_TEMPLATE_SET);
+    out = put16(out, TEMPLATE_SET_SIZE);
+    out = put16(out, IPFIX_TEMPLATE_ID);
+    out = put16(out, NUM_TEMPLATE_FIELDS);
+    for (int f = 0; f < NUM_TEMPLATE_FIELDS; f++) {
+        out = put16(out, template_fields[f][0]);
+        out = put16(out, template_fields[f][1]);
+    }
+
+    out = put16(out, IPFIX_TEMPLATE_ID);
+    out = put16(out, 4 + count * RECORD_SIZE);
+    for (int r = 0; r < count; r++) {
+        out = encode_flow(out, &entries[r], interval);
+    }
+
+    if (write(export_fd, message, length) != length) {
+        return -1;
+    }
+    sequence += count;
+    return 0;
+}
+
+/**
+ * Write count pending records, as many messages as they need
+ * Returns the number written
+ */
+static int write_pending(int count) {
+    uint32_t interval = atomic_load(&flows_interval);
+    int exported = 0, messages = 0;
+    for (int r = 0; r < count; r += RECORDS_PER_MESSAGE) {
+        int n = count - r < RECORDS_PER_MESSAGE ? count - r : RECORDS_PER_MESSAGE;
+        if (write_message(&pending[r], n, interval) == 0) {
+            exported += n;
+            messages++;
+        }
+    }
+
+    pthread_mutex_lock(&flow_lock);
+    num_exported += exported;
+    num_messages += messages;
+    num_dropped += count - exported;
+    pthread_mutex_unlock(&flow_lock);
+    return exported;
+}
+
+int flows_export(uint64_t now_ms, int flush) {
+    if (export_fd < 0) {
+        return 0;
+    }
+
+    // Queue flows that aged out, then take the whole queue and write it
+    // without the lock, so sampling carries on meanwhile. Flows that did
+    // not fit in the queue wait for the next round.
+    int exported = 0, more = 1;
+    while (more) {
+        more = 0;
+        pthread_mutex_lock(&flow_lock);
+        for (int i = 0; i < FLOW_TABLE_SIZE; i++) {
+            struct flow_entry *entry = &table[i];
+            if (entry->in_iface < 0 || (!flush && now_ms - entry->last_ms < FLOW_IDLE_MS &&
+                                        now_ms - entry->first_ms < FLOW_ACTIVE_MS)) {
+                continue;
+            }
+            if (queue_len == FLOW_EXPORT_QUEUE) {
+                more = 1;
+                break;
+            }
+            queue_flow(entry);
+            entry->in_iface = -1;
+            num_active--;
+        }
+        int count = queue_len;
+        memcpy(pending, queue, count * sizeof(struct flow_entry));
+        queue_len = 0;
+        pthread_mutex_unlock(&flow_lock);
+
+        exported += write_pending(count);
+    }
+    return exported;
+}
+
+void flows_get_stats(struct flow_stats *stats) {
+    stats->interval = atomic_load(&flows_interval);
+    pthread_mutex_lock(&flow_lock);
+    stats->active = num_active;
+    stats->sampled = num_sampled;
+    stats->exported = num_exported;
+    stats->messages = num_messages;
+    stats->dropped = num_dropped;
+    pthread_mutex_unlock(&flow_lock);
+}
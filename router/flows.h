@@ -0,0 +1,100 @@
+/**
+ * flows.h
+ * Sampled flow telemetry. One in every N forwarded packets, chosen at
+ * random, is counted in a fixed-size flow table keyed by source,
+ * destination, next header and flow label. Flows that go idle, stay active
+ * too long or are pushed out of a full table are exported as IPFIX
+ * (RFC 7011) messages, appended to a file or sent to a UDP collector on
+ * localhost.
+ *
+ * Deciding whether to sample is a thread-local countdown, so packets that
+ * are not sampled touch no shared memory.
+ */
+
+#ifndef FLOWS_H
+#define FLOWS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#define FLOW_TABLE_SIZE 16384        /* Flows tracked at once, a power of 2 */
+#define FLOW_PROBES 8                /* Slots searched before evicting one */
+#define FLOW_IDLE_MS 15000           /* Export a flow with no packets for this long */
+#define FLOW_ACTIVE_MS 60000         /* Export a long-lived flow this often */
+#define FLOW_EXPORT_QUEUE 4096       /* Records waiting for the exporter */
+#define FLOW_MAX_MESSAGE 1400        /* IPFIX message bytes, fits one UDP datagram */
+#define FLOW_DEFAULT_INTERVAL 1000   /* 1-in-N sampling when none is given */
+
+// What makes packets one flow
+struct flow_key {
+    struct in6_addr src;
+    struct in6_addr dst;
+    uint32_t flow_label;         /* 20 bits */
+    uint8_t next_header;
+};
+
+// Exporter totals since flows_open
+struct flow_stats {
+    uint32_t interval;           /* 1-in-N, 0 while sampling is off */
+    int active;                  /* Flows in the table */
+    uint64_t sampled;            /* Packets counted */
+    uint64_t exported;           /* Records written */
+    uint64_t messages;           /* IPFIX messages written */
+    uint64_t dropped;            /* Records lost to a full queue or failed write */
+};
+
+/**
+ * Open the exporter, target is a file path or udp:<port> for a collector
+ * on localhost, and start sampling 1 in interval packets
+ * Returns 0, or -1 if the target could not be opened
+ */
+int flows_open(const char *target, uint32_t interval);
+
+/**
+ * Change the sampling interval, 0 stops sampling. Flows already in the
+ * table age out as usual.
+ */
+void flows_set_interval(uint32_t interval);
+
+/**
+ * Count one sampled packet of numbytes in its flow
+ */
+void flows_record(const struct flow_key *key, int in_iface, int out_iface, int numbytes,
+                  uint64_t now_ms);
+
+/**
+ * Export flows that have aged out (all flows if flush), then everything
+ * queued for export. Call about once a second from one thread.
+ * Returns the number of records exported
+ */
+int flows_export(uint64_t now_ms, int flush);
+
+void flows_get_stats(struct flow_stats *stats);
+
+extern _Atomic uint32_t flows_interval;
+extern _Thread_local uint32_t flows_countdown;
+
+/**
+ * Packets the calling thread skips before its next sample, random with a
+ * mean of interval
+ */
+uint32_t flows_next_gap(uint32_t interval);
+
+/**
+ * Whether the calling thread should sample the packet at hand
+ */
+static inline int flows_should_sample(void) {
+    uint32_t interval = atomic_load_explicit(&flows_interval, memory_order_relaxed);
+    if (interval == 0) {
+        return 0;
+    }
+    if (flows_countdown > 1) {
+        flows_countdown--;
+        return 0;
+    }
+    flows_countdown = flows_next_gap(interval);
+    return 1;
+}
+
+#endif /* FLOWS_H */
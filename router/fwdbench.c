@@ -0,0 +1,385 @@
+/**
+ * fwdbench.c
+ * In-process forwarding benchmark. Builds router.c's forwarding path into
+ * this program, installs a synthetic FIB, and drives generated packets
+ * through process_batch (or data_handler with -b 0) with transmission
+ * stubbed out. Reports packets per second, per-packet latency percentiles
+ * and heap allocations per packet.
+ *
+ * to compile: gcc -O2 -Wall -Wextra fwdbench.c slipnet.c simnet.c timerwheel.c \
+ *             pktqueue.c counters.c acl.c flows.c bond.c -lpthread -lm -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc -o fwdbench
+ * usage: fwdbench [-r routes] [-d seq|random] [-f flows] [-z skew] [-u percent]
+ *                 [-i ifaces] [-n packets] [-s bytes] [-b batch] [-a rules] [-t 1_in_n]
+ *   -r  synthetic /64 routes installed as static routes (default 1000)
+ *   -d  prefixes numbered sequentially or drawn at random (default seq)
+ *   -f  distinct flows in the traffic, each to one route (default 1024)
+ *   -z  Zipf exponent of flow popularity, 0 is uniform (default 0)
+ *   -u  percent of flows to destinations with no route (default 0)
+ *   -i  router interfaces, routes are spread over them (default 4)
+ *   -n  packets per run (default 1000000)
+ *   -s  IPv6 packet size in bytes, up to MAX_SLIP_SEND (default 100)
+ *   -b  packets per process_batch call, 0 for data_handler (default WORKER_BATCH)
+ *   -a  ingress filter rules ahead of a rule every packet matches (default no filter)
+ *   -t  sample 1 in n packets into the flow table, exported to /dev/null
+ *       (default no sampling)
+ * Latency is the time of each call divided by its batch size, so it is only
+ * exact per packet with -b 0 or -b 1.
+ */
+
+#define FWD_BENCH
+#include "router.c"
+
+#include <math.h>
+
+// ============================================================================
+// ALLOCATION COUNTING AND TRANSMIT STUB
+// ============================================================================
+
+static atomic_ulong bench_allocs;   /* Heap allocations since the last reset */
+static uint64_t bench_tx_packets;   /* Packets handed to the transmit stub */
+static uint64_t bench_tx_bytes;     /* Bytes handed to the transmit stub */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+/**
+ * Transmit stub, counts what the router would have sent
+ */
+void bench_transmit(int fd, const char *data, int numbytes) {
+    (void)fd;
+    (void)data;
+    bench_tx_packets++;
+    bench_tx_bytes += numbytes;
+}
+
+// ============================================================================
+// SYNTHETIC FIB AND TRAFFIC
+// ============================================================================
+
+/**
+ * Small xorshift generator, so runs are repeatable
+ */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+uint64_t rng_next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/**
+ * Address of interface i, fd00:0:0:i::1, and its neighbor fd00:0:0:i::2
+ */
+void iface_addr(int i, int host, struct in6_addr *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->s6_addr[0] = 0xfd;
+    addr->s6_addr[6] = i >> 8;
+    addr->s6_addr[7] = i & 0xff;
+    addr->s6_addr[15] = host;
+}
+
+/**
+ * Prefix of route i, 2001:db8:hi:lo::/64 in order or random under 2001::/16
+ */
+void route_prefix(int i, int random_prefixes, struct in6_addr *prefix) {
+    memset(prefix, 0, sizeof(*prefix));
+    prefix->s6_addr[0] = 0x20;
+    prefix->s6_addr[1] = 0x01;
+    if (random_prefixes) {
+        uint64_t r = rng_next();
+        memcpy(&prefix->s6_addr[2], &r, 6);
+    } else {
+        prefix->s6_addr[2] = 0x0d;
+        prefix->s6_addr[3] = 0xb8;
+        prefix->s6_addr[4] = i >> 24;
+        prefix->s6_addr[5] = i >> 16;
+        prefix->s6_addr[6] = i >> 8;
+        prefix->s6_addr[7] = i;
+    }
+}
+
+/**
+ * Build one packet of a flow: a UDP header's worth of zeros after the IPv6
+ * header, addressed to host flow in prefix
+ */
+void build_packet(char *packet, int size, const struct in6_addr *prefix, int flow) {
+    memset(packet, 0, size);
+    struct ipv6_header *ip6 = (struct ipv6_header *)packet;
+    ip6->ver_class_hi = 0x60;
+    ip6->length = htons(size - sizeof(struct ipv6_header));
+    ip6->next_header = 17;
+    ip6->hop_limit = 64;
+    ip6->source[0] = 0xfd;
+    ip6->source[1] = 0x01;
+    memcpy(&ip6->source[12], &flow, 4);
+    memcpy(ip6->destination, prefix, 8);
+    memcpy(&ip6->destination[12], &flow, 4);
+}
+
+/**
+ * Draw flows for every packet, flow k with weight 1 / (k + 1)^skew
+ */
+void draw_flows(int *sequence, int num_packets, int num_flows, double skew) {
+    double *cdf = malloc(num_flows * sizeof(double));
+    double total = 0;
+    for (int k = 0; k < num_flows; k++) {
+        total += 1.0 / pow(k + 1, skew);
+        cdf[k] = total;
+    }
+    for (int n = 0; n < num_packets; n++) {
+        double u = (rng_next() >> 11) * (1.0 / 9007199254740992.0) * total;
+        int lo = 0, hi = num_flows - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        sequence[n] = lo;
+    }
+    free(cdf);
+}
+
+/**
+ * Install num_rules ingress deny rules in four shapes, none matching the
+ * generated traffic, then a permit rule that matches all of it, so every
+ * lookup probes every shape before finding its match
+ */
+void install_filter(int num_rules) {
+    for (int r = 0; r <= num_rules; r++) {
+        struct acl_rule *rule = &acl_rules[ACL_IN][r];
+        memset(rule, 0, sizeof(*rule));
+        rule->action = r < num_rules ? ACL_DENY : ACL_PERMIT;
+        rule->iface = -1;
+        rule->proto = -1;
+        rule->sport_hi = 65535;
+        rule->dport_hi = 65535;
+        acl_rule_hits[ACL_IN][r] = calloc(1, sizeof(_Atomic uint64_t));
+        if (r == num_rules) {
+            break;
+        }
+
+        // Sources under fd02::/16 and destinations under 2001:db9::/32, unused by the traffic
+        rule->src.s6_addr[0] = 0xfd;
+        rule->src.s6_addr[1] = 0x02;
+        memcpy(&rule->src.s6_addr[2], &r, 4);
+        rule->dst.s6_addr[0] = 0x20;
+        rule->dst.s6_addr[1] = 0x01;
+        rule->dst.s6_addr[2] = 0x0d;
+        rule->dst.s6_addr[3] = 0xb9;
+        memcpy(&rule->dst.s6_addr[4], &r, 4);
+        switch (r % 4) {
+        case 0: rule->src_len = 48; break;
+        case 1: rule->dst_len = 64; rule->proto = IPPROTO_UDP; break;
+        case 2: rule->src_len = 64; rule->dport_lo = rule->dport_hi = r % 1000 + 1; break;
+        default: rule->dst_len = 64; rule->sport_lo = 1024; rule->sport_hi = 2047; break;
+        }
+        mask_prefix(&rule->src, rule->src_len, &rule->src);
+        mask_prefix(&rule->dst, rule->dst_len, &rule->dst);
+    }
+    acl_num_rules[ACL_IN] = num_rules + 1;
+    publish_acl_table(ACL_IN);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+int main(int argc, char *argv[]) {
+    int num_routes_wanted = 1000;
+    int random_prefixes = 0;
+    int num_flows = 1024;
+    double skew = 0;
+    int unrouted_percent = 0;
+    int num_ifaces = 4;
+    int num_packets = 1000000;
+    int packet_size = 100;
+    int batch = WORKER_BATCH;
+    int num_filter_rules = -1;
+    int sample_interval = 0;
+
+    for (int argi = 1; argi < argc; argi += 2) {
+        if (argi + 1 >= argc || argv[argi][0] != '-' || strlen(argv[argi]) != 2) {
+            fprintf(stderr, "Usage: %s [-r routes] [-d seq|random] [-f flows] [-z skew] [-u percent]\n"
+                            "       [-i ifaces] [-n packets] [-s bytes] [-b batch] [-a rules]\n"
+                            "       [-t 1_in_n]\n", argv[0]);
+            return 1;
+        }
+        const char *value = argv[argi + 1];
+        switch (argv[argi][1]) {
+        case 'r': num_routes_wanted = atoi(value); break;
+        case 'd': random_prefixes = strcmp(value, "random") == 0; break;
+        case 'f': num_flows = atoi(value); break;
+        case 'z': skew = atof(value); break;
+        case 'u': unrouted_percent = atoi(value); break;
+        case 'i': num_ifaces = atoi(value); break;
+        case 'n': num_packets = atoi(value); break;
+        case 's': packet_size = atoi(value); break;
+        case 'b': batch = atoi(value); break;
+        case 'a': num_filter_rules = atoi(value); break;
+        case 't': sample_interval = atoi(value); break;
+        default:
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[argi]);
+            return 1;
+        }
+    }
+    if (num_ifaces < 1 || num_ifaces > 0xffff ||
+        num_routes_wanted < 1 || num_routes_wanted > MAX_ROUTES - num_ifaces ||
+        num_flows < 1 || num_packets < 1 || skew < 0 ||
+        unrouted_percent < 0 || unrouted_percent > 100 ||
+        packet_size < (int)sizeof(struct ipv6_header) + 8 || packet_size > MAX_SLIP_SEND ||
+        batch < 0 || batch > WORKER_BATCH || num_filter_rules >= ACL_MAX_RULES ||
+        sample_interval < 0) {
+        fprintf(stderr, "Error: Option out of range.\n");
+        return 1;
+    }
+
+    // Router state: interfaces, direct routes and the synthetic FIB
+    verbose = 0;
+    num_addrs = num_ifaces;
+    if (allocate_interfaces() != 0) {
+        fprintf(stderr, "Error: Out of memory for %d interfaces.\n", num_ifaces);
+        return 1;
+    }
+    for (int i = 0; i < num_addrs; i++) {
+        iface_addr(i, 1, &sim_addrs[i]);
+    }
+    tw_init(&route_wheel, expiry_ticks_now());
+    initialize_routing_table();
+    initialize_send_locks();
+
+    struct in6_addr *prefixes = malloc(num_routes_wanted * sizeof(struct in6_addr));
+    pthread_mutex_lock(&routing_lock);
+    for (int i = 0; i < num_routes_wanted; i++) {
+        struct in6_addr gateway;
+        iface_addr(i % num_ifaces, 2, &gateway);
+        route_prefix(i, random_prefixes, &prefixes[i]);
+        if (install_static_route(&prefixes[i], ROUTE_PREFIX_LEN, &gateway, 1) != 0) {
+            i--;  // Random prefix collided, draw another
+        }
+    }
+    pthread_mutex_unlock(&routing_lock);
+    if (num_filter_rules >= 0) {
+        install_filter(num_filter_rules);
+    }
+    if (sample_interval > 0 && flows_open("/dev/null", sample_interval) != 0) {
+        return 1;
+    }
+
+    // One packet template per flow, each to a random route or unrouted 3fff::/16
+    char *templates = malloc((size_t)num_flows * packet_size);
+    for (int k = 0; k < num_flows; k++) {
+        struct in6_addr prefix = prefixes[rng_next() % num_routes_wanted];
+        if ((int)(rng_next() % 100) < unrouted_percent) {
+            prefix.s6_addr[0] = 0x3f;
+            prefix.s6_addr[1] = 0xff;
+        }
+        build_packet(templates + (size_t)k * packet_size, packet_size, &prefix, k);
+    }
+    int *sequence = malloc(num_packets * sizeof(int));
+    draw_flows(sequence, num_packets, num_flows, skew);
+
+    int per_call = batch > 0 ? batch : 1;
+    int num_calls = (num_packets + per_call - 1) / per_call;
+    double *latency = malloc(num_calls * sizeof(double));
+    struct pkt_slot *slot_store = calloc(per_call, sizeof(struct pkt_slot));
+    struct pkt_slot *slots[WORKER_BATCH];
+    for (int k = 0; k < per_call; k++) {
+        slots[k] = &slot_store[k];
+    }
+
+    printf("fwdbench: %d routes (%s), %d flows (skew %.2f, %d%% unrouted), %d interfaces\n",
+           num_routes, random_prefixes ? "random" : "seq", num_flows, skew,
+           unrouted_percent, num_ifaces);
+    printf("fwdbench: %d packets of %d bytes, %s\n", num_packets, packet_size,
+           batch > 0 ? "process_batch" : "data_handler");
+    if (batch > 0) {
+        printf("fwdbench: batches of %d\n", batch);
+    }
+
+    // Two passes, the first warms caches and the FIB, the second is measured
+    for (int pass = 0; pass < 2; pass++) {
+        bench_tx_packets = 0;
+        bench_tx_bytes = 0;
+        atomic_store(&bench_allocs, 0);
+
+        struct timespec run_start, run_end;
+        clock_gettime(CLOCK_MONOTONIC, &run_start);
+        for (int c = 0; c < num_calls; c++) {
+            int first = c * per_call;
+            int count = num_packets - first < per_call ? num_packets - first : per_call;
+
+            // Copy each packet into its slot, as the receive path does
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int k = 0; k < count; k++) {
+                int flow = sequence[first + k];
+                slots[k]->tty = flow % num_ifaces;
+                slots[k]->numbytes = packet_size;
+                memcpy(slots[k]->data, templates + (size_t)flow * packet_size, packet_size);
+            }
+            if (batch > 0) {
+                process_batch(slots, count);
+            } else {
+                data_handler(slots[0]->tty, slots[0]->data, slots[0]->numbytes);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            latency[c] = elapsed_ns(&start, &end) / count;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &run_end);
+
+        if (pass == 0) {
+            continue;
+        }
+        double seconds = elapsed_ns(&run_start, &run_end) / 1e9;
+        uint64_t allocs = atomic_load(&bench_allocs);
+        qsort(latency, num_calls, sizeof(double), compare_double);
+
+        printf("throughput:  %.0f packets/s, %.1f MB/s forwarded\n",
+               num_packets / seconds, bench_tx_bytes / seconds / 1e6);
+        printf("forwarded:   %llu of %d packets\n",
+               (unsigned long long)bench_tx_packets, num_packets);
+        printf("latency ns:  p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n",
+               latency[num_calls / 2], latency[(int)(num_calls * 0.9)],
+               latency[(int)(num_calls * 0.99)], latency[(int)(num_calls * 0.999)],
+               latency[num_calls - 1]);
+        printf("allocations: %.3f per packet (%llu total)\n",
+               (double)allocs / num_packets, (unsigned long long)allocs);
+        if (sample_interval > 0) {
+            struct flow_stats stats;
+            flows_get_stats(&stats);
+            printf("flows:       %llu packets sampled over both passes, %d flows active\n",
+                   (unsigned long long)stats.sampled, stats.active);
+        }
+    }
+
+    return 0;
+}
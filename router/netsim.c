@@ -0,0 +1,710 @@
+/**
+ * netsim.c
+ * Deterministic discrete-event simulation of a whole topology in one
+ * process, for the same convergence and failure scenarios as topobench
+ * hundreds to thousands of times faster than real time. Every router is router.c built
+ * with -DROUTER_SIM as a shared object, loaded once per router from its own
+ * copy so each has its own globals. No router thread runs: from a single
+ * thread, on a virtual clock, this program calls into a router to boot it,
+ * deliver a frame, let an interface send its next frame, or run its timers,
+ * and gives it the slipnet calls it makes. A frame written on an interface
+ * arrives at the other end of the link once its SLIP-encoded bytes have
+ * crossed at the line rate, and the bytes of a frame still crossing count
+ * as received, as they do one at a time over simnet.
+ *
+ * Events due at the same virtual time run in the order they were
+ * scheduled, and the seed picks the random topology and the routers' boot
+ * times, so a seed always replays the same run, log included.
+ *
+ * to compile: gcc -O2 -Wall -Wextra -shared -fPIC -Wl,-Bsymbolic \
+ *             -DROUTER_SIM router.c timerwheel.c pktqueue.c counters.c acl.c flows.c bond.c \
+ *             -lpthread -o router-sim.so
+ *             gcc -O2 -Wall -Wextra -rdynamic netsim.c topology.c -ldl -o netsim
+ * usage: netsim [-t line|ring|grid|random] [-n routers] [-e extra_links] [-s seed]
+ *               [-f none|link|router] [-p packets] [-b bytes] [-T timeout]
+ *               [-i hello_ms] [-B bits_per_s] [-r router_so] [-d workdir] [-l logfile]
+ *   defaults: -t line -n 4 -e n/2 (random only) -s 1 -f link -p 20 -b 100
+ *             -T 600 (virtual seconds) -i 100 -B 9600 -r ./router-sim.so
+ *             -d ./netsim.d -l /dev/null
+ *   the routers' copies are workdir/rNN.so and all their output goes to logfile
+ */
+
+#define _GNU_SOURCE                  /* open_memstream */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "slipnet.h"
+#include "netsim.h"
+#include "topology.h"
+
+#define POLL_MS 100                  /* Virtual interval between routing table checks */
+#define BOOT_SPREAD_MS 20            /* Routers boot at random times within this, as topobench's do */
+#define QUIET_MS 5000                /* Traffic is over once nothing arrives for this long */
+
+// ============================================================================
+// EVENT QUEUE
+// ============================================================================
+
+enum event_type {
+    EVENT_BOOT,                      /* Bring up the router */
+    EVENT_TIMER,                     /* Run the router's timers */
+    EVENT_SEND,                      /* Interface may send its next frame */
+    EVENT_DELIVER,                   /* Last byte of a frame arrives */
+};
+
+struct event {
+    uint64_t time;                   /* Virtual ns */
+    uint64_t sequence;               /* Scheduling order, breaks ties */
+    enum event_type type;
+    int router, tty;                 /* Router -1 for a host, tty is then the host */
+    int from;                        /* Router that sent the frame, -1 for a host */
+    char *frame;
+    int numbytes;
+    int line_bytes;                  /* Frame bytes on the line, SLIP-encoded */
+};
+
+static struct event *events;         /* Binary heap by time, then sequence */
+static int num_events, events_capacity;
+static uint64_t next_sequence;
+static uint64_t now_ns;
+static uint64_t events_run;
+
+static int event_before(const struct event *a, const struct event *b) {
+    return a->time < b->time || (a->time == b->time && a->sequence < b->sequence);
+}
+
+void schedule(struct event ev) {
+    if (num_events == events_capacity) {
+        events_capacity = events_capacity ? 2 * events_capacity : 1024;
+        events = realloc(events, events_capacity * sizeof(struct event));
+        if (events == NULL) {
+            fprintf(stderr, "Error: Out of memory for events.\n");
+            exit(1);
+        }
+    }
+    ev.sequence = next_sequence++;
+    int i = num_events++;
+    while (i > 0 && event_before(&ev, &events[(i - 1) / 2])) {
+        events[i] = events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events[i] = ev;
+}
+
+struct event pop_event() {
+    struct event top = events[0];
+    struct event last = events[--num_events];
+    int i = 0;
+    while (2 * i + 1 < num_events) {
+        int child = 2 * i + 1;
+        if (child + 1 < num_events && event_before(&events[child + 1], &events[child])) {
+            child++;
+        }
+        if (!event_before(&events[child], &last)) {
+            break;
+        }
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return top;
+}
+
+// ============================================================================
+// LINES AND ROUTERS
+// ============================================================================
+
+// One end of a link, as the router or host attached to it sees it
+struct port {
+    int peer, peer_tty;              /* Other end, peer -1 for a host with peer_tty the host */
+    uint64_t line_free;              /* When the last frame written is through, ns */
+    int sending;                     /* A send event is pending */
+    unsigned long rx_bytes;          /* Bytes of frames fully received */
+    uint64_t rx_start, rx_end;       /* Frame being received, ns */
+};
+
+// A simulated router, its own copy of the router code and globals
+struct sim_router {
+    void *lib;
+    sim_router_init_fn init;
+    sim_run_timers_fn run_timers;
+    send_next_fn send_next;
+    control_command_fn command;
+    void (**handlers)(int, const void *, int);  /* By interface */
+    struct port *ports;                          /* By interface */
+};
+
+static struct sim_router routers[MAX_ROUTERS];
+static struct port host_ports[NUM_HOSTS];
+static int current = -1;             /* Router being called into */
+static uint64_t byte_ns;             /* Time a byte takes on the line */
+static char workdir[PATH_MAX];
+
+/**
+ * Port at the other end of a port's link, NULL for a host's end
+ */
+static struct port *peer_port(const struct port *port) {
+    return port->peer >= 0 ? &routers[port->peer].ports[port->peer_tty] : NULL;
+}
+
+/**
+ * Put a frame on the line of port, behind any frame still on it
+ */
+void transmit(struct port *port, int from, const char *data, int numbytes) {
+    int line_bytes = 2;              /* END before and after */
+    for (int i = 0; i < numbytes; i++) {
+        int c = data[i] & 0xff;
+        line_bytes += c == SLIP_END || c == SLIP_ESC ? 2 : 1;
+    }
+    uint64_t start = port->line_free > now_ns ? port->line_free : now_ns;
+    port->line_free = start + line_bytes * byte_ns;
+
+    char *frame = malloc(numbytes);
+    if (frame == NULL) {
+        fprintf(stderr, "Error: Out of memory for frames.\n");
+        exit(1);
+    }
+    memcpy(frame, data, numbytes);
+    struct port *rx = peer_port(port);
+    if (rx != NULL) {
+        rx->rx_start = start;
+        rx->rx_end = port->line_free;
+    }
+    struct event ev = { .time = port->line_free, .type = EVENT_DELIVER,
+                        .router = port->peer, .tty = port->peer_tty, .from = from,
+                        .frame = frame, .numbytes = numbytes,
+                        .line_bytes = line_bytes };
+    schedule(ev);
+}
+
+uint64_t sim_clock_ms(void) {
+    return now_ns / 1000000;
+}
+
+void sim_start_sender(int tty) {
+    struct port *port = &routers[current].ports[tty];
+    if (!port->sending) {
+        port->sending = 1;
+        struct event ev = { .time = port->line_free > now_ns ? port->line_free : now_ns,
+                            .type = EVENT_SEND, .router = current, .tty = tty };
+        schedule(ev);
+    }
+}
+
+int install_slip_data_handler(int tty, void (*handler)(int, const void *, int)) {
+    if (current < 0 || tty < 0 || tty >= num_ifaces[current]) {
+        return -1;
+    }
+    routers[current].handlers[tty] = handler;
+    return tty;
+}
+
+void install_slip_error_handler(void (*handler)(int, int)) {
+    (void)handler;                   /* The simulated line makes no errors */
+}
+
+int write_slip_data(int fd, char *data, int numbytes) {
+    if (numbytes <= 0 || numbytes > MAX_SLIP_SEND) {
+        printf("slip: bad size %d\n", numbytes);
+        return -1;
+    }
+    transmit(&routers[current].ports[fd], current, data, numbytes);
+    return numbytes;
+}
+
+unsigned long slip_bytes_received(int tty) {
+    const struct port *port = &routers[current].ports[tty];
+    unsigned long bytes = port->rx_bytes;
+    if (now_ns > port->rx_start && now_ns < port->rx_end) {
+        bytes += (now_ns - port->rx_start) / byte_ns;
+    }
+    return bytes;
+}
+
+void print_packet(char *string, const void *vdata, int numbytes) {
+    const unsigned char *data = vdata;
+    printf("%s (%d bytes):\n", string, numbytes);
+    for (int i = 0; i < numbytes; i++) {
+        printf("%02x%s", data[i], i == numbytes - 1 || i % 16 == 7 ? "\n" : " ");
+    }
+}
+
+/**
+ * Copy the router library to workdir/rNN.so and load the copy, which
+ * dlopen then cannot share with another router
+ * Returns 0, or -1 with the reason printed
+ */
+int load_router(int r, const char *library) {
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/r%02d.so", workdir, r);
+    int in = open(library, O_RDONLY);
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    char buf[1 << 16];
+    ssize_t n = 0;
+    while (in >= 0 && out >= 0 && (n = read(in, buf, sizeof(buf))) > 0 && write(out, buf, n) == n) {
+    }
+    if (in < 0 || out < 0 || n != 0) {
+        perror(in < 0 ? library : path);
+        n = -1;
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    if (n != 0) {
+        return -1;
+    }
+
+    struct sim_router *router = &routers[r];
+    router->lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (router->lib == NULL) {
+        fprintf(stderr, "Error: %s\n", dlerror());
+        return -1;
+    }
+    router->init = (sim_router_init_fn)dlsym(router->lib, "sim_router_init");
+    router->run_timers = (sim_run_timers_fn)dlsym(router->lib, "sim_run_timers");
+    router->send_next = (send_next_fn)dlsym(router->lib, "send_next");
+    router->command = (control_command_fn)dlsym(router->lib, "control_command");
+    if (router->init == NULL || router->run_timers == NULL || router->send_next == NULL ||
+        router->command == NULL) {
+        fprintf(stderr, "Error: %s was not built with -DROUTER_SIM\n", library);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Give every router its ports, and connect the ports at both ends of
+ * every link
+ */
+void wire_links() {
+    for (int r = 0; r < num_routers; r++) {
+        routers[r].handlers = calloc(num_ifaces[r], sizeof(*routers[r].handlers));
+        routers[r].ports = calloc(num_ifaces[r], sizeof(struct port));
+    }
+    for (int k = 0; k < num_links + NUM_HOSTS; k++) {
+        struct port *a = &routers[links[k].a].ports[links[k].iface_a];
+        if (links[k].b >= 0) {
+            struct port *b = &routers[links[k].b].ports[links[k].iface_b];
+            a->peer = links[k].b;
+            a->peer_tty = links[k].iface_b;
+            b->peer = links[k].a;
+            b->peer_tty = links[k].iface_a;
+        } else {
+            int h = k - num_links;
+            a->peer = -1;
+            a->peer_tty = h;
+            host_ports[h].peer = links[k].a;
+            host_ports[h].peer_tty = links[k].iface_a;
+        }
+    }
+}
+
+/**
+ * Run a router command, its reply going to out
+ */
+void router_command(int r, const char *command, FILE *out) {
+    char line[64];
+    snprintf(line, sizeof(line), "%s", command);
+    current = r;
+    routers[r].command(line, out);
+    current = -1;
+}
+
+// ============================================================================
+// HOST TRAFFIC
+// ============================================================================
+
+// Test packets carry their sequence number and send time after the header
+struct test_payload {
+    uint32_t sequence;
+    uint64_t sent;                   /* Virtual ns */
+};
+
+static int rx_count;
+static uint64_t rx_last;
+static uint64_t latency_sum, latency_min, latency_max;
+static long rx_bytes;
+
+/**
+ * A frame arrived at a host
+ */
+void host_receive(int h, const char *data, int numbytes) {
+    // Only the test packets, the router advertises routes to hosts too
+    if (h != 1 || numbytes < 40 + (int)sizeof(struct test_payload) || data[6] != 17) {
+        return;
+    }
+    struct test_payload payload;
+    memcpy(&payload, data + 40, sizeof(payload));
+    uint64_t latency = now_ns - payload.sent;
+    rx_last = now_ns;
+    rx_count++;
+    rx_bytes += numbytes;
+    latency_sum += latency;
+    if (rx_count == 1 || latency < latency_min) {
+        latency_min = latency;
+    }
+    if (latency > latency_max) {
+        latency_max = latency;
+    }
+}
+
+// ============================================================================
+// SIMULATION
+// ============================================================================
+
+static int hello_ms = 100;           /* Every simulated router speaks hellos */
+
+/**
+ * Run one event
+ */
+void run_event(struct event *ev) {
+    struct sim_router *router = ev->router >= 0 ? &routers[ev->router] : NULL;
+    if (router != NULL && !alive[ev->router]) {
+        free(ev->frame);
+        return;
+    }
+    current = ev->router;
+
+    switch (ev->type) {
+    case EVENT_BOOT: {
+        struct in6_addr addrs[num_ifaces[ev->router]];
+        for (int k = 0; k < num_links + NUM_HOSTS; k++) {
+            if (links[k].a == ev->router) {
+                link_addr(k, 1, &addrs[links[k].iface_a]);
+            } else if (links[k].b == ev->router) {
+                link_addr(k, 2, &addrs[links[k].iface_b]);
+            }
+        }
+        if (router->init(num_ifaces[ev->router], addrs, hello_ms) != 0) {
+            fprintf(stderr, "Error: Router r%02d did not start.\n", ev->router);
+            exit(1);
+        }
+        struct event timer = { .time = now_ns, .type = EVENT_TIMER, .router = ev->router };
+        schedule(timer);
+        break;
+    }
+    case EVENT_TIMER: {
+        struct event timer = { .time = router->run_timers() * 1000000, .type = EVENT_TIMER,
+                               .router = ev->router };
+        schedule(timer);
+        break;
+    }
+    case EVENT_SEND: {
+        struct port *port = &router->ports[ev->tty];
+        if (router->send_next(ev->tty)) {
+            struct event send = { .time = port->line_free, .type = EVENT_SEND,
+                                  .router = ev->router, .tty = ev->tty };
+            schedule(send);
+        } else {
+            port->sending = 0;
+        }
+        break;
+    }
+    case EVENT_DELIVER:
+        // A router that died mid-frame never finished sending it
+        if (ev->from >= 0 && !alive[ev->from]) {
+            break;
+        }
+        if (router == NULL) {
+            host_receive(ev->tty, ev->frame, ev->numbytes);
+        } else {
+            router->ports[ev->tty].rx_bytes += ev->line_bytes;
+            if (router->handlers[ev->tty] != NULL) {
+                router->handlers[ev->tty](ev->tty, ev->frame, ev->numbytes);
+            }
+        }
+        break;
+    }
+    current = -1;
+    free(ev->frame);
+}
+
+/**
+ * Run every event due up to virtual time until
+ */
+void run_until(uint64_t until) {
+    while (num_events > 0 && events[0].time <= until) {
+        struct event ev = pop_event();
+        now_ns = ev.time;
+        run_event(&ev);
+        events_run++;
+    }
+    now_ns = until;
+}
+
+/**
+ * Check every live router's table at each poll
+ * Returns virtual seconds since start, or -1 after timeout seconds
+ */
+double wait_converged(uint64_t start, int timeout) {
+    static int dist_to[MAX_ROUTERS][MAX_ROUTERS];
+    for (int r = 0; r < num_routers; r++) {
+        distances(r, dist_to[r]);
+    }
+
+    while (now_ns - start < (uint64_t)timeout * 1000000000) {
+        run_until(now_ns + POLL_MS * 1000000ULL);
+        int converged = 1;
+        for (int r = 0; r < num_routers && converged; r++) {
+            if (!alive[r]) {
+                continue;
+            }
+            char *reply = NULL;
+            size_t size = 0;
+            FILE *f = open_memstream(&reply, &size);
+            router_command(r, "dump", f);
+            fclose(f);
+            converged = table_converged(reply, dist_to[r]);
+            free(reply);
+        }
+        if (converged) {
+            return (now_ns - start) / 1e9;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Send a train of packets from host 0 to host 1 and report what arrived
+ */
+void measure_traffic(FILE *report, const char *label, int num_packets, int size) {
+    rx_count = 0;
+    rx_bytes = 0;
+    latency_sum = latency_max = 0;
+
+    char packet[MAX_SLIP_SEND];
+    memset(packet, 0, size);
+    packet[0] = 0x60;
+    packet[4] = (size - 40) >> 8;
+    packet[5] = (size - 40) & 0xff;
+    packet[6] = 17;                  /* UDP, routers only forward it */
+    packet[7] = 64;
+    struct in6_addr src, dst;
+    link_addr(num_links, 2, &src);
+    link_addr(num_links + 1, 2, &dst);
+    memcpy(packet + 8, &src, 16);
+    memcpy(packet + 24, &dst, 16);
+
+    // Back to back on host 0's line, each stamped when it starts out
+    uint64_t start = now_ns;
+    struct port *line = &host_ports[0];
+    for (int i = 0; i < num_packets; i++) {
+        struct test_payload payload;
+        memset(&payload, 0, sizeof(payload));
+        payload.sequence = i;
+        payload.sent = line->line_free > now_ns ? line->line_free : now_ns;
+        memcpy(packet + 40, &payload, sizeof(payload));
+        transmit(line, -1, packet, size);
+    }
+
+    // Run until everything arrived, or nothing has for a while
+    uint64_t quiet_since = now_ns;
+    int last_count = -1;
+    while (rx_count < num_packets && now_ns - quiet_since < QUIET_MS * 1000000ULL) {
+        run_until(now_ns + POLL_MS * 1000000ULL);
+        if (rx_count != last_count) {
+            last_count = rx_count;
+            quiet_since = now_ns;
+        }
+    }
+
+    fprintf(report, "%s: %d of %d packets of %d bytes arrived\n", label, rx_count, num_packets, size);
+    if (rx_count > 0) {
+        fprintf(report, "%s: throughput %.0f bytes/s, latency min %.3f avg %.3f max %.3f s\n",
+                label, rx_bytes / ((rx_last - start) / 1e9),
+                latency_min / 1e9, latency_sum / 1e9 / rx_count, latency_max / 1e9);
+    }
+}
+
+/**
+ * Next of a seeded xorshift sequence, so runs do not depend on the libc's
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+double wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+int main(int argc, char *argv[]) {
+    const char *type = "line";
+    const char *failure = "link";
+    const char *library = "./router-sim.so";
+    const char *dir = "./netsim.d";
+    const char *log = "/dev/null";
+    int extra = -1;
+    unsigned seed = 1;
+    int num_packets = 20;
+    int size = 100;
+    int timeout = 600;
+    long bits_per_s = 9600;
+    num_routers = 4;
+
+    for (int argi = 1; argi < argc; argi += 2) {
+        if (argi + 1 >= argc || argv[argi][0] != '-' || strlen(argv[argi]) != 2) {
+            fprintf(stderr, "Usage: %s [-t line|ring|grid|random] [-n routers] [-e extra_links] [-s seed]\n"
+                            "       [-f none|link|router] [-p packets] [-b bytes] [-T timeout]\n"
+                            "       [-i hello_ms] [-B bits_per_s] [-r router_so] [-d workdir] [-l logfile]\n",
+                    argv[0]);
+            return 1;
+        }
+        const char *value = argv[argi + 1];
+        switch (argv[argi][1]) {
+        case 't': type = value; break;
+        case 'n': num_routers = atoi(value); break;
+        case 'e': extra = atoi(value); break;
+        case 's': seed = atoi(value); break;
+        case 'f': failure = value; break;
+        case 'p': num_packets = atoi(value); break;
+        case 'b': size = atoi(value); break;
+        case 'T': timeout = atoi(value); break;
+        case 'i': hello_ms = atoi(value); break;
+        case 'B': bits_per_s = atol(value); break;
+        case 'r': library = value; break;
+        case 'd': dir = value; break;
+        case 'l': log = value; break;
+        default:
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[argi]);
+            return 1;
+        }
+    }
+    if (num_routers < 2 || num_routers > MAX_ROUTERS || num_packets < 0 ||
+        size < 40 + (int)sizeof(struct test_payload) || size > MAX_SLIP_SEND ||
+        timeout < 1 || hello_ms > 65535 || bits_per_s < 8 || bits_per_s > 8000000000L) {
+        fprintf(stderr, "Error: Option out of range.\n");
+        return 1;
+    }
+    if (strcmp(failure, "none") != 0 && strcmp(failure, "link") != 0 &&
+        strcmp(failure, "router") != 0) {
+        fprintf(stderr, "Error: Unknown failure '%s'.\n", failure);
+        return 1;
+    }
+    if (build_topology(type, extra < 0 ? num_routers / 2 : extra, seed) != 0) {
+        fprintf(stderr, "Error: Unknown topology '%s'.\n", type);
+        return 1;
+    }
+    byte_ns = 8000000000ULL / bits_per_s;
+
+    // Hosts hang off router 0 and the router farthest from it
+    int hops = attach_hosts();
+    wire_links();
+
+    mkdir(dir, 0755);
+    if (realpath(dir, workdir) == NULL) {
+        perror(dir);
+        return 1;
+    }
+    for (int r = 0; r < num_routers; r++) {
+        if (load_router(r, library) != 0) {
+            return 1;
+        }
+    }
+
+    // The routers print to stdout, so the report keeps its own copy of it
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (report == NULL || freopen(log, "w", stdout) == NULL) {
+        perror(log);
+        return 1;
+    }
+    setvbuf(report, NULL, _IOLBF, 0);
+    fprintf(report, "netsim: %s of %d routers, %d links, hosts on r%02d and r%02d (%d hops), seed %u\n",
+            type, num_routers, num_links, host_router[0], host_router[1], hops, seed);
+
+    // Boot every router at its own random time
+    double wall_start = wall_seconds();
+    uint64_t random_state = 0x9e3779b97f4a7c15ULL ^ seed;
+    for (int r = 0; r < num_routers; r++) {
+        struct event boot = { .time = next_random(&random_state) % (BOOT_SPREAD_MS * 1000000ULL),
+                              .type = EVENT_BOOT, .router = r };
+        schedule(boot);
+    }
+
+    int status = 0;
+    double converged = wait_converged(0, timeout);
+    if (converged < 0) {
+        fprintf(report, "initial convergence: not converged after %d s\n", timeout);
+        status = 1;
+        goto done;
+    }
+    fprintf(report, "initial convergence: %.1f s\n", converged);
+    measure_traffic(report, "before failure", num_packets, size);
+    if (strcmp(failure, "none") == 0) {
+        goto done;
+    }
+
+    // Fail the first link, or kill the middle router, of a shortest host path
+    int path[MAX_ROUTERS];
+    int path_len = host_path(path);
+    uint64_t start = now_ns;
+    if (strcmp(failure, "link") == 0) {
+        if (path_len < 2) {
+            fprintf(report, "failure: hosts share a router, no link to fail\n");
+            goto done;
+        }
+        for (int k = 0; k < num_links; k++) {
+            if ((links[k].a == path[0] && links[k].b == path[1]) ||
+                (links[k].a == path[1] && links[k].b == path[0])) {
+                char command[32];
+                snprintf(command, sizeof(command), "link %d down", links[k].iface_a);
+                router_command(links[k].a, command, stdout);
+                snprintf(command, sizeof(command), "link %d down", links[k].iface_b);
+                router_command(links[k].b, command, stdout);
+                links[k].up = 0;
+                fprintf(report, "failure: link r%02d-r%02d down\n", links[k].a, links[k].b);
+                break;
+            }
+        }
+    } else {
+        if (path_len < 3) {
+            fprintf(report, "failure: no router between the hosts' routers to kill\n");
+            goto done;
+        }
+        int victim = path[path_len / 2];
+        alive[victim] = 0;
+        fprintf(report, "failure: router r%02d killed\n", victim);
+    }
+
+    converged = wait_converged(start, timeout);
+    if (converged < 0) {
+        fprintf(report, "reconvergence: not converged after %d s\n", timeout);
+        status = 1;
+        goto done;
+    }
+    fprintf(report, "reconvergence: %.1f s\n", converged);
+    int dist[MAX_ROUTERS];
+    distances(host_router[0], dist);
+    if (dist[host_router[1]] >= 0) {
+        measure_traffic(report, "after failure", num_packets, size);
+    } else {
+        fprintf(report, "after failure: hosts are partitioned\n");
+    }
+
+done:;
+    double wall = wall_seconds() - wall_start;
+    fprintf(report, "netsim: %llu events, %.1f s simulated in %.2f s (%.0fx real time)\n",
+            (unsigned long long)events_run, now_ns / 1e9, wall, now_ns / 1e9 / (wall > 0 ? wall : 1e-9));
+    fflush(stdout);
+    return status;
+}
@@ -0,0 +1,35 @@
+/**
+ * netsim.h
+ * What netsim.c and a router built with -DROUTER_SIM provide each other.
+ * The router also gets the slipnet.h calls from netsim.c, and nothing from
+ * slipnet.c or simnet.c.
+ */
+
+#ifndef NETSIM_H
+#define NETSIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+// From netsim.c
+
+/**
+ * Virtual time in milliseconds, the clock of every simulated router
+ */
+uint64_t sim_clock_ms(void);
+
+/**
+ * Have the calling router's interface tty send its queued packets, one
+ * send_next call per frame once the line is free
+ */
+void sim_start_sender(int tty);
+
+// From the router, looked up in each router's copy with dlsym
+
+typedef int (*sim_router_init_fn)(int n, const struct in6_addr *addrs, int hello_ms);
+typedef uint64_t (*sim_run_timers_fn)(void);
+typedef int (*send_next_fn)(int fd);
+typedef void (*control_command_fn)(char *line, FILE *out);
+
+#endif /* NETSIM_H */
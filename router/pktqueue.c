@@ -0,0 +1,160 @@
+/**
+ * pktqueue.c
+ * Bounded lock-free packet queue with many producers and one consumer.
+ *
+ * This is Dmitry Vyukov's bounded queue with the consumer side reduced to
+ * a single thread. Each slot's sequence number says whose turn it is:
+ *   sequence == pos       free, the producer at position pos may fill it
+ *   sequence == pos + 1   filled, the consumer at position pos may read it
+ * A producer claims a position with a CAS on enqueue_pos, copies the packet
+ * in, then publishes it with a release store of pos + 1. The consumer hands
+ * the slot back one lap later by storing pos + capacity. Packets from one
+ * producer stay in order.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pktqueue.h"
+
+int pktq_init(struct pkt_queue *q, size_t capacity) {
+    q->slots = malloc(capacity * sizeof(struct pkt_slot));
+    if (q->slots == NULL) {
+        return -1;
+    }
+    q->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&q->slots[i].sequence, i);
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    q->dequeue_pos = 0;
+    return 0;
+}
+
+int pktq_push(struct pkt_queue *q, int tty, const void *data, int numbytes) {
+    if (numbytes < 0 || numbytes > MAX_SLIP_SIZE) {
+        return -1;
+    }
+
+    struct pkt_slot *slot;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (seq == pos) {
+            // Free, try to claim it; on failure pos is reloaded by the CAS
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (seq < pos) {
+            // Still holds the packet from one lap ago, queue is full
+            return -1;
+        } else {
+            // Another producer claimed it first
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->tty = tty;
+    slot->numbytes = numbytes;
+    memcpy(slot->data, data, numbytes);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+struct pkt_slot *pktq_peek(struct pkt_queue *q, size_t n) {
+    if (n > q->mask) {
+        return NULL;
+    }
+    size_t pos = q->dequeue_pos + n;
+    struct pkt_slot *slot = &q->slots[pos & q->mask];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != pos + 1) {
+        return NULL;
+    }
+    return slot;
+}
+
+void pktq_release(struct pkt_queue *q, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        size_t pos = q->dequeue_pos + i;
+        atomic_store_explicit(&q->slots[pos & q->mask].sequence, pos + q->mask + 1,
+                              memory_order_release);
+    }
+    q->dequeue_pos += count;
+}
+
+#ifdef RUN_PKTQUEUE_TEST
+/* to compile: gcc -Wall -Wextra -DRUN_PKTQUEUE_TEST pktqueue.c -lpthread -o pktqueue */
+
+#include <assert.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define TEST_PRODUCERS 4
+#define TEST_PACKETS 200000          /* From each producer */
+#define TEST_CAPACITY 64             /* Small, so producers keep finding it full */
+
+static struct pkt_queue queue;
+
+/**
+ * Push numbered packets whose length and bytes follow from the number,
+ * retrying while the queue is full
+ */
+static void *test_producer(void *arg) {
+    int id = (int)(long)arg;
+    char packet[MAX_SLIP_SIZE];
+    for (unsigned int n = 0; n < TEST_PACKETS; n++) {
+        int numbytes = sizeof(n) + n % (MAX_SLIP_SIZE - sizeof(n) + 1);
+        memcpy(packet, &n, sizeof(n));
+        memset(packet + sizeof(n), (char)(id + n), numbytes - sizeof(n));
+        while (pktq_push(&queue, id, packet, numbytes) != 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Consume in batches as the router's workers do, checking that every
+ * producer's packets arrive whole, once and in the order it pushed them
+ */
+int main(void) {
+    pthread_t producers[TEST_PRODUCERS];
+    unsigned int next[TEST_PRODUCERS] = { 0 };
+    assert(pktq_init(&queue, TEST_CAPACITY) == 0);
+    for (long i = 0; i < TEST_PRODUCERS; i++) {
+        assert(pthread_create(&producers[i], NULL, test_producer, (void *)i) == 0);
+    }
+
+    for (long total = 0; total < (long)TEST_PRODUCERS * TEST_PACKETS; ) {
+        size_t count = 0;
+        struct pkt_slot *slot;
+        while ((slot = pktq_peek(&queue, count)) != NULL) {
+            unsigned int n;
+            assert(slot->tty >= 0 && slot->tty < TEST_PRODUCERS);
+            memcpy(&n, slot->data, sizeof(n));
+            assert(n == next[slot->tty]++);
+            assert(slot->numbytes == (int)(sizeof(n) + n % (MAX_SLIP_SIZE - sizeof(n) + 1)));
+            for (int b = sizeof(n); b < slot->numbytes; b++) {
+                assert(slot->data[b] == (char)(slot->tty + n));
+            }
+            count++;
+        }
+        pktq_release(&queue, count);
+        total += count;
+        if (count == 0) {
+            sched_yield();
+        }
+    }
+    for (int i = 0; i < TEST_PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+        assert(next[i] == TEST_PACKETS);
+    }
+    assert(pktq_peek(&queue, 0) == NULL);
+    printf("ok\n");
+    return 0;
+}
+#endif /* RUN_PKTQUEUE_TEST */
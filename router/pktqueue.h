@@ -0,0 +1,53 @@
+/**
+ * pktqueue.h
+ * Bounded lock-free packet queue with many producers and one consumer.
+ * Packets are copied into the queue's own slots, so nothing is allocated.
+ */
+
+#ifndef PKTQUEUE_H
+#define PKTQUEUE_H
+
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stddef.h>
+
+#include "slipnet.h"
+
+struct pkt_slot {
+    atomic_size_t sequence;      /* Slot state, see pktqueue.c */
+    int tty;                     /* Interface the packet arrived on */
+    int numbytes;                /* Packet length */
+    char data[MAX_SLIP_SIZE];    /* Packet bytes */
+};
+
+struct pkt_queue {
+    size_t mask;                 /* Capacity - 1, capacity is a power of 2 */
+    struct pkt_slot *slots;
+    alignas(64) atomic_size_t enqueue_pos;  /* Shared by producers */
+    alignas(64) size_t dequeue_pos;         /* Owned by the consumer */
+};
+
+/**
+ * Allocate a queue, capacity must be a power of two
+ * Returns 0, or -1 if out of memory
+ */
+int pktq_init(struct pkt_queue *q, size_t capacity);
+
+/**
+ * Copy a packet into the queue, safe from any thread
+ * Returns 0, or -1 if the queue is full or the packet too big
+ */
+int pktq_push(struct pkt_queue *q, int tty, const void *data, int numbytes);
+
+/**
+ * Consumer only: the n-th oldest packet, or NULL if fewer than n + 1 are
+ * queued. Slots stay valid, in place, until released.
+ */
+struct pkt_slot *pktq_peek(struct pkt_queue *q, size_t n);
+
+/**
+ * Consumer only: give the count oldest (peeked) slots back to producers
+ */
+void pktq_release(struct pkt_queue *q, size_t count);
+
+#endif /* PKTQUEUE_H */
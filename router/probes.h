@@ -0,0 +1,47 @@
+/**
+ * probes.h
+ * Static tracepoints (USDT, the systemtap sys/sdt.h kind) along the packet
+ * path, so a live router can be traced with bpftrace or perf instead of
+ * being rebuilt with DEBUG. A probe is a single nop until a tracer attaches
+ * to it, so they are always compiled in; where sys/sdt.h is missing they
+ * compile to nothing. For example:
+ *
+ *   bpftrace -e 'usdt:./router:router:enqueue /arg3 >= 0/ { @drops[arg0] = count(); }'
+ *
+ * Probes of provider "router", and their arguments:
+ *   slip_rx_byte   tty, byte                      every byte off the line
+ *   slip_frame     tty, numbytes, data            frame complete
+ *   slip_tx_start  tty, numbytes, data            frame about to be written
+ *   slip_tx_done   tty, numbytes, result          numbytes, or -1 on error
+ *   classify       tty, numbytes, src, dst, result
+ *   fib_lookup     tty, numbytes, src, dst, route route index, -1 if none
+ *   enqueue        tty, numbytes, data, result    tty is the output interface
+ *   route_change   change, prefix, prefix_len, gateway, metric
+ *   route_expire   prefix, prefix_len, gateway
+ *
+ * Addresses are pointers to 16 bytes (bpftrace: ntop(buf(arg2, 16))), and
+ * data points at the packet. A result is one of the PROBE_ codes below or,
+ * for a dropped packet, the counter_id it was counted under. A route
+ * change is an enum route_change of router.c.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#define PROBE_LOCAL -1               /* Addressed to the router */
+#define PROBE_FORWARD -2             /* To be forwarded */
+#define PROBE_QUEUED -3              /* Queued on its output interface */
+#define PROBE_LINK_DOWN -4           /* Output link is down, discarded */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(router, name, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef PROBE
+#define PROBE(name, ...) do { } while (0)
+#endif
+
+#endif /* PROBES_H */
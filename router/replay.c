@@ -0,0 +1,641 @@
+/**
+ * replay.c
+ * Capture replay. Builds router.c's receive and forwarding path into this
+ * program like fwdbench, reads the IPv6 packets of a pcap or pcapng
+ * capture, and feeds each one as SLIP bytes through slipnet's receive
+ * handler for the interface it arrived on, with transmission stubbed out.
+ * Reports packets per second, per-packet latency percentiles, how far the
+ * replay fell behind the capture's timing, and the router's counters, so
+ * two builds can be compared on the same traffic.
+ *
+ * to compile: gcc -O2 -Wall -Wextra replay.c slipnet.c simnet.c timerwheel.c \
+ *             pktqueue.c counters.c acl.c flows.c bond.c -lpthread \
+ *             -Wl,--wrap=install_tty_data_handler,--wrap=write_tty_data -o replay
+ * usage: replay [-x speed] [-R routes_file] [-I iface] [-n passes] <capture> <IPv6_addr1> ... <IPv6_addrN>
+ *   -x  1 replays at the capture's timing, N at N times its speed and 0 as
+ *       fast as possible (default 1)
+ *   -R  routes to install first, "add <prefix>[/len] <gateway> [metric]"
+ *       lines as routerctl takes them
+ *   -I  feed every packet to this interface, instead of capture interface
+ *       k going to interface k modulo the number of interfaces
+ *   -n  passes over the capture, all but the last warm up (default 1)
+ * The addresses are the router's interfaces, as for router. Frames may be
+ * raw IPv6, Ethernet (VLAN tags skipped), BSD loopback or Linux cooked;
+ * anything else is skipped. Counters are published in ./replay.counters,
+ * which routerstat can watch during a long replay.
+ */
+
+#define FWD_BENCH
+#define FWD_REPLAY                   /* Packets come in through slipnet's receive path */
+#include "router.c"
+
+#define REPLAY_COUNTERS "./replay.counters"
+
+// ============================================================================
+// TTY LAYER WRAPS AND TRANSMIT STUB
+// ============================================================================
+
+static void (**tty_handlers)(int, char);    /* slipnet's receive handler per interface */
+static uint64_t *bench_tx_packets;          /* Per interface, handed to the transmit stub */
+static uint64_t *bench_tx_bytes;
+
+int __wrap_install_tty_data_handler(int tty, void (*handler)(int, char)) {
+    tty_handlers[tty] = handler;
+    return tty;
+}
+
+// Nothing reaches a tty, the router's sends go to bench_transmit
+int __wrap_write_tty_data(int tty, char data) {
+    (void)tty;
+    (void)data;
+    return 1;
+}
+
+/**
+ * Transmit stub, counts what the router would have sent as the send path does
+ */
+void bench_transmit(int fd, const char *data, int numbytes) {
+    (void)data;
+    bench_tx_packets[fd]++;
+    bench_tx_bytes[fd] += numbytes;
+    counter_add(fd, CTR_TX_PACKETS, 1);
+    counter_add(fd, CTR_TX_BYTES, numbytes);
+}
+
+// ============================================================================
+// CAPTURE FILES
+// ============================================================================
+
+#define PCAP_MAGIC 0xa1b2c3d4        /* Microsecond timestamps */
+#define PCAP_MAGIC_NS 0xa1b23c4d     /* Nanosecond timestamps */
+#define PCAPNG_SHB 0x0a0d0d0a        /* Section header block */
+#define PCAPNG_IDB 1                 /* Interface description block */
+#define PCAPNG_SPB 3                 /* Simple packet block */
+#define PCAPNG_EPB 6                 /* Enhanced packet block */
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+#define PCAPNG_TSRESOL 9             /* Interface option, timestamp resolution */
+#define PCAPNG_MAX_IFACES 256
+
+// Link types of the frames that can carry IPv6
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LOOP 108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+
+// One packet of the capture, SLIP encoded ready to feed
+struct replay_packet {
+    uint64_t time_ns;            /* Capture time since the first packet */
+    int tty;                     /* Interface it is fed to */
+    int numbytes;                /* IPv6 packet length */
+    int frame_len;               /* SLIP bytes, including both ENDs */
+    char *frame;
+};
+
+// What reading the capture found
+struct capture {
+    struct replay_packet *packets;
+    int num_packets;
+    int size;                    /* Packets allocated */
+    int not_ipv6;                /* Frames skipped, no IPv6 packet in them */
+    int too_large;               /* IPv6 packets over MAX_SLIP_SIZE */
+    int truncated;               /* Packets cut short by the capture's snap length */
+    const char *format;
+};
+
+/**
+ * Read an unsigned field of the capture, swapped if it was written with the
+ * other byte order
+ */
+uint32_t read_u32(const uint8_t *p, int swapped) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+uint16_t read_u16(const uint8_t *p, int swapped) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return swapped ? __builtin_bswap16(v) : v;
+}
+
+/**
+ * Find the IPv6 packet in a frame of the given link type
+ * Returns its offset, or -1 if the frame does not carry one
+ */
+int ipv6_offset(uint32_t linktype, const uint8_t *frame, uint32_t len) {
+    uint32_t offset;
+    switch (linktype) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV6:
+        offset = 0;
+        break;
+    case LINKTYPE_NULL:
+    case LINKTYPE_LOOP:
+        // The address family is in the capturing host's order and its value
+        // differs between systems, the version nibble is checked instead
+        offset = 4;
+        break;
+    case LINKTYPE_ETHERNET:
+        offset = 12;
+        while (offset + 2 <= len && (frame[offset] << 8 | frame[offset + 1]) != 0x86dd) {
+            uint16_t type = frame[offset] << 8 | frame[offset + 1];
+            if (type != 0x8100 && type != 0x88a8) {
+                return -1;
+            }
+            offset += 4;  // VLAN tag
+        }
+        offset += 2;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16 || (frame[14] << 8 | frame[15]) != 0x86dd) {
+            return -1;
+        }
+        offset = 16;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        if (len < 20 || (frame[0] << 8 | frame[1]) != 0x86dd) {
+            return -1;
+        }
+        offset = 20;
+        break;
+    default:
+        return -1;
+    }
+    if (offset >= len || frame[offset] >> 4 != 6) {
+        return -1;
+    }
+    return offset;
+}
+
+/**
+ * SLIP encode a packet as slipnet's write_slip_data does, END first and
+ * last. Done here because that refuses packets over MAX_SLIP_SEND, while
+ * receivers take up to MAX_SLIP_SIZE.
+ * Returns the encoded length, out must hold 2 * numbytes + 2 bytes
+ */
+int slip_encode(const uint8_t *packet, int numbytes, char *out) {
+    int len = 0;
+    out[len++] = (char)SLIP_END;
+    for (int k = 0; k < numbytes; k++) {
+        if (packet[k] == SLIP_END) {
+            out[len++] = (char)SLIP_ESC;
+            out[len++] = (char)SLIP_ESC_END;
+        } else if (packet[k] == SLIP_ESC) {
+            out[len++] = (char)SLIP_ESC;
+            out[len++] = (char)SLIP_ESC_ESC;
+        } else {
+            out[len++] = packet[k];
+        }
+    }
+    out[len++] = (char)SLIP_END;
+    return len;
+}
+
+/**
+ * Add one captured frame to the replay, SLIP encoded
+ * Returns 0, or -1 if out of memory
+ */
+int add_frame(struct capture *cap, uint32_t linktype, const uint8_t *frame, uint32_t caplen,
+               uint64_t time_ns, int capture_iface) {
+    int offset = ipv6_offset(linktype, frame, caplen);
+    if (offset < 0) {
+        cap->not_ipv6++;
+        return 0;
+    }
+    const uint8_t *packet = frame + offset;
+    uint32_t numbytes = caplen - offset;
+    if (numbytes >= sizeof(struct ipv6_header)) {
+        // Ethernet pads short frames, the payload length says where IPv6
+        // ends, and a snap length may have cut it short (0 is a jumbogram)
+        uint32_t payload_len = packet[4] << 8 | packet[5];
+        uint32_t ipv6_len = sizeof(struct ipv6_header) + payload_len;
+        if (payload_len > 0 && ipv6_len < numbytes) {
+            numbytes = ipv6_len;
+        } else if (ipv6_len > numbytes) {
+            cap->truncated++;
+        }
+    }
+    if (numbytes > MAX_SLIP_SIZE) {
+        cap->too_large++;
+        return 0;
+    }
+
+    if (cap->num_packets == cap->size) {
+        int size = cap->size ? 2 * cap->size : 1024;
+        struct replay_packet *packets = realloc(cap->packets, size * sizeof(struct replay_packet));
+        if (packets == NULL) {
+            return -1;
+        }
+        cap->packets = packets;
+        cap->size = size;
+    }
+    char *slip = malloc(2 * numbytes + 2);
+    if (slip == NULL) {
+        return -1;
+    }
+    struct replay_packet *p = &cap->packets[cap->num_packets++];
+    p->time_ns = time_ns;
+    p->tty = capture_iface;
+    p->numbytes = numbytes;
+    p->frame_len = slip_encode(packet, numbytes, slip);
+    p->frame = slip;
+    return 0;
+}
+
+/**
+ * Read a classic pcap file
+ * Returns 0, or -1 if it is malformed
+ */
+int read_pcap(struct capture *cap, const uint8_t *data, size_t size) {
+    uint32_t magic;
+    memcpy(&magic, data, 4);
+    int swapped = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS;
+    magic = read_u32(data, swapped);
+    uint64_t fraction_ns = magic == PCAP_MAGIC_NS ? 1 : 1000;
+    uint32_t linktype = read_u32(data + 20, swapped) & 0xffff;
+    cap->format = "pcap";
+
+    size_t pos = 24;
+    while (pos + 16 <= size) {
+        uint64_t time_ns = read_u32(data + pos, swapped) * 1000000000ULL +
+                           read_u32(data + pos + 4, swapped) * fraction_ns;
+        uint32_t caplen = read_u32(data + pos + 8, swapped);
+        pos += 16;
+        if (caplen > size - pos) {
+            fprintf(stderr, "Error: Packet record at byte %zu runs past the end of the capture.\n",
+                    pos - 16);
+            return -1;
+        }
+        if (add_frame(cap, linktype, data + pos, caplen, time_ns, 0) != 0) {
+            fprintf(stderr, "Error: Out of memory reading the capture.\n");
+            return -1;
+        }
+        pos += caplen;
+    }
+    return 0;
+}
+
+/**
+ * Read a pcapng file, every section of it
+ * Returns 0, or -1 if it is malformed
+ */
+int read_pcapng(struct capture *cap, const uint8_t *data, size_t size) {
+    uint32_t linktypes[PCAPNG_MAX_IFACES];
+    uint64_t units_per_s[PCAPNG_MAX_IFACES];
+    int num_ifaces = 0;
+    int swapped = 0;
+    uint64_t last_ns = 0;
+    cap->format = "pcapng";
+
+    size_t pos = 0;
+    while (pos + 12 <= size) {
+        uint32_t type = read_u32(data + pos, swapped);
+        if (type == PCAPNG_SHB) {
+            // Each section sets its own byte order and interfaces
+            if (pos + 16 > size) {
+                break;
+            }
+            swapped = read_u32(data + pos + 8, 0) != PCAPNG_BYTE_ORDER;
+            num_ifaces = 0;
+        }
+        uint32_t length = read_u32(data + pos + 4, swapped);
+        if (length < 12 || length % 4 != 0 || length > size - pos) {
+            fprintf(stderr, "Error: Bad pcapng block length %u at byte %zu.\n", length, pos);
+            return -1;
+        }
+        const uint8_t *body = data + pos + 8;
+        uint32_t body_len = length - 12;
+
+        if (type == PCAPNG_IDB && body_len >= 8 && num_ifaces < PCAPNG_MAX_IFACES) {
+            linktypes[num_ifaces] = read_u16(body, swapped);
+            units_per_s[num_ifaces] = 1000000;
+            for (uint32_t opt = 8; opt + 4 <= body_len; ) {
+                uint16_t code = read_u16(body + opt, swapped);
+                uint16_t opt_len = read_u16(body + opt + 2, swapped);
+                if (code == 0 || opt + 4 + opt_len > body_len) {
+                    break;
+                }
+                if (code == PCAPNG_TSRESOL && opt_len >= 1) {
+                    uint8_t resol = body[opt + 4];
+                    uint64_t units = 1;
+                    for (int k = 0; k < (resol & 0x7f) && units <= UINT64_MAX / 10; k++) {
+                        units *= resol & 0x80 ? 2 : 10;
+                    }
+                    units_per_s[num_ifaces] = units;
+                }
+                opt += 4 + ((opt_len + 3) & ~3u);
+            }
+            num_ifaces++;
+        } else if (type == PCAPNG_EPB && body_len >= 20) {
+            uint32_t iface = read_u32(body, swapped);
+            uint32_t caplen = read_u32(body + 12, swapped);
+            if ((int)iface >= num_ifaces || caplen > body_len - 20) {
+                fprintf(stderr, "Error: Bad enhanced packet block at byte %zu.\n", pos);
+                return -1;
+            }
+            uint64_t ts = (uint64_t)read_u32(body + 4, swapped) << 32 | read_u32(body + 8, swapped);
+            last_ns = (unsigned __int128)ts * 1000000000 / units_per_s[iface];
+            if (add_frame(cap, linktypes[iface], body + 20, caplen, last_ns, iface) != 0) {
+                fprintf(stderr, "Error: Out of memory reading the capture.\n");
+                return -1;
+            }
+        } else if (type == PCAPNG_SPB && body_len >= 4 && num_ifaces > 0) {
+            // No timestamp, it is taken to arrive with the packet before it
+            uint32_t origlen = read_u32(body, swapped);
+            uint32_t caplen = origlen < body_len - 4 ? origlen : body_len - 4;
+            if (add_frame(cap, linktypes[0], body + 4, caplen, last_ns, 0) != 0) {
+                fprintf(stderr, "Error: Out of memory reading the capture.\n");
+                return -1;
+            }
+        }
+        pos += length;
+    }
+    return 0;
+}
+
+/**
+ * Read every IPv6 packet of a pcap or pcapng capture
+ * Returns 0, or -1 if it cannot be read
+ */
+int read_capture(const char *path, struct capture *cap) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    if (st.st_size < 24) {
+        fprintf(stderr, "Error: %s is too short to be a capture.\n", path);
+        close(fd);
+        return -1;
+    }
+    const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, data, 4);
+    int result;
+    if (magic == PCAPNG_SHB) {
+        result = read_pcapng(cap, data, st.st_size);
+    } else if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS ||
+               __builtin_bswap32(magic) == PCAP_MAGIC || __builtin_bswap32(magic) == PCAP_MAGIC_NS) {
+        result = read_pcap(cap, data, st.st_size);
+    } else {
+        fprintf(stderr, "Error: %s is not a pcap or pcapng capture.\n", path);
+        result = -1;
+    }
+    munmap((void *)data, st.st_size);
+
+    // Times from the first packet, captures are not always in order
+    if (result == 0 && cap->num_packets > 0) {
+        uint64_t first = cap->packets[0].time_ns;
+        for (int k = 1; k < cap->num_packets; k++) {
+            if (cap->packets[k].time_ns < first) {
+                first = cap->packets[k].time_ns;
+            }
+        }
+        for (int k = 0; k < cap->num_packets; k++) {
+            cap->packets[k].time_ns -= first;
+        }
+    }
+    return result;
+}
+
+/**
+ * Install the static routes of a file of routerctl "add" lines
+ * Returns the number installed, or -1 on the first bad line
+ */
+int load_routes(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    int line_num = 0, installed = 0;
+    pthread_mutex_lock(&routing_lock);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_num++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *start = line + strspn(line, " \t");
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        int is_add, prefix_len;
+        struct in6_addr prefix, gateway;
+        uint32_t metric;
+        const char *error = NULL;
+        if (strncmp(start, "add ", 4) != 0) {
+            error = "only add lines are taken";
+        } else if (parse_route_command(start, &is_add, &prefix, &prefix_len,
+                                       &gateway, &metric, &error) == 0 &&
+                   install_static_route(&prefix, prefix_len, &gateway, metric) != 0) {
+            error = "directly connected or table full";
+        }
+        if (error != NULL) {
+            fprintf(stderr, "Error: %s line %d: %s\n", path, line_num, error);
+            installed = -1;
+            break;
+        }
+        installed++;
+    }
+    pthread_mutex_unlock(&routing_lock);
+    fclose(f);
+    return installed;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+int main(int argc, char *argv[]) {
+    double speed = 1;
+    const char *routes_file = NULL;
+    int fixed_iface = -1;
+    int passes = 1;
+
+    int argi = 1;
+    while (argi + 1 < argc && argv[argi][0] == '-' && strlen(argv[argi]) == 2) {
+        const char *value = argv[argi + 1];
+        switch (argv[argi][1]) {
+        case 'x': speed = atof(value); break;
+        case 'R': routes_file = value; break;
+        case 'I': fixed_iface = atoi(value); break;
+        case 'n': passes = atoi(value); break;
+        default:
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[argi]);
+            return 1;
+        }
+        argi += 2;
+    }
+    if (argc - argi < 2) {
+        fprintf(stderr, "Usage: %s [-x speed] [-R routes_file] [-I iface] [-n passes] "
+                        "<capture> <IPv6_addr1> ... <IPv6_addrN>\n", argv[0]);
+        return 1;
+    }
+    const char *capture_path = argv[argi++];
+    num_addrs = argc - argi;
+    if (speed < 0 || passes < 1 || fixed_iface >= num_addrs) {
+        fprintf(stderr, "Error: Option out of range.\n");
+        return 1;
+    }
+
+    // Router state, as main sets it up but with packets handled inline
+    verbose = 0;
+    num_workers = 0;
+    if (allocate_interfaces() != 0) {
+        fprintf(stderr, "Error: Out of memory for %d interfaces.\n", num_addrs);
+        return 1;
+    }
+    for (int i = 0; i < num_addrs; i++) {
+        if (inet_pton(AF_INET6, argv[argi + i], &sim_addrs[i]) != 1) {
+            fprintf(stderr, "Error: Invalid IPv6 address '%s'.\n", argv[argi + i]);
+            return 1;
+        }
+    }
+    initialize_policers();
+    tw_init(&route_wheel, expiry_ticks_now());
+    initialize_routing_table();
+    initialize_send_locks();
+    if (routes_file != NULL && load_routes(routes_file) < 0) {
+        return 1;
+    }
+    if (counters_open(REPLAY_COUNTERS, num_addrs, num_addrs + SERVICE_THREADS) != 0) {
+        fprintf(stderr, "Warning: Could not create %s, counters disabled\n", REPLAY_COUNTERS);
+    }
+    install_slip_error_handler(count_slip_error);
+
+    tty_handlers = calloc(num_addrs, sizeof(*tty_handlers));
+    bench_tx_packets = calloc(num_addrs, sizeof(uint64_t));
+    bench_tx_bytes = calloc(num_addrs, sizeof(uint64_t));
+    for (int i = 0; i < num_addrs; i++) {
+        install_slip_data_handler(i, steer_packet);
+    }
+
+    struct capture cap = { 0 };
+    if (read_capture(capture_path, &cap) != 0) {
+        return 1;
+    }
+    if (cap.num_packets == 0) {
+        fprintf(stderr, "Error: No IPv6 packets in %s.\n", capture_path);
+        return 1;
+    }
+    for (int k = 0; k < cap.num_packets; k++) {
+        cap.packets[k].tty = fixed_iface >= 0 ? fixed_iface : cap.packets[k].tty % num_addrs;
+    }
+    uint64_t capture_ns = cap.packets[cap.num_packets - 1].time_ns;
+
+    printf("replay: %d IPv6 packets from %s (%s), %.3f s of traffic\n",
+           cap.num_packets, capture_path, cap.format, capture_ns / 1e9);
+    printf("replay: skipped %d frames without IPv6 and %d packets over %d bytes, "
+           "%d packets truncated\n", cap.not_ipv6, cap.too_large, MAX_SLIP_SIZE, cap.truncated);
+    if (speed > 0) {
+        printf("replay: %d routes, %d interfaces, %g times the capture's speed\n",
+               num_routes, num_addrs, speed);
+    } else {
+        printf("replay: %d routes, %d interfaces, as fast as possible\n", num_routes, num_addrs);
+    }
+
+    double *latency = malloc(cap.num_packets * sizeof(double));
+    for (int pass = 0; pass < passes; pass++) {
+        // Counters start over with the measured pass
+        if (pass == passes - 1) {
+            for (int i = 0; i < num_addrs; i++) {
+                bench_tx_packets[i] = 0;
+                bench_tx_bytes[i] = 0;
+                for (int id = 0; id < NUM_COUNTERS; id++) {
+                    counter_baseline[i][id] = counters_map ? counters_total(i, id) : 0;
+                }
+            }
+        }
+
+        double busy_ns = 0, max_behind_ns = 0;
+        int behind = 0;
+        struct timespec run_start, run_end;
+        clock_gettime(CLOCK_MONOTONIC, &run_start);
+        for (int k = 0; k < cap.num_packets; k++) {
+            const struct replay_packet *p = &cap.packets[k];
+            struct timespec start, end;
+            if (speed > 0) {
+                // Wait for the packet's time, or note how late it is
+                double due_ns = p->time_ns / speed;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                double late_ns = elapsed_ns(&run_start, &start) - due_ns;
+                if (late_ns < 0) {
+                    uint64_t at_ns = run_start.tv_sec * 1000000000ULL + run_start.tv_nsec +
+                                     (uint64_t)due_ns;
+                    struct timespec at = { at_ns / 1000000000, at_ns % 1000000000 };
+                    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+                } else if (late_ns > 1e6) {
+                    behind++;
+                    max_behind_ns = late_ns > max_behind_ns ? late_ns : max_behind_ns;
+                }
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int b = 0; b < p->frame_len; b++) {
+                tty_handlers[p->tty](p->tty, p->frame[b]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            latency[k] = elapsed_ns(&start, &end);
+            busy_ns += latency[k];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &run_end);
+
+        if (pass < passes - 1) {
+            continue;
+        }
+        double seconds = elapsed_ns(&run_start, &run_end) / 1e9;
+        qsort(latency, cap.num_packets, sizeof(double), compare_double);
+        uint64_t tx_packets = 0, tx_bytes = 0;
+        for (int i = 0; i < num_addrs; i++) {
+            tx_packets += bench_tx_packets[i];
+            tx_bytes += bench_tx_bytes[i];
+        }
+
+        printf("throughput:  %.0f packets/s while busy, %.0f packets/s over %.3f s of replay\n",
+               cap.num_packets / (busy_ns / 1e9), cap.num_packets / seconds, seconds);
+        printf("forwarded:   %llu of %d packets, %llu bytes\n", (unsigned long long)tx_packets,
+               cap.num_packets, (unsigned long long)tx_bytes);
+        printf("latency ns:  p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n",
+               latency[cap.num_packets / 2], latency[(int)(cap.num_packets * 0.9)],
+               latency[(int)(cap.num_packets * 0.99)], latency[(int)(cap.num_packets * 0.999)],
+               latency[cap.num_packets - 1]);
+        if (speed > 0) {
+            printf("behind:      %d packets over 1 ms late, at most %.3f ms\n",
+                   behind, max_behind_ns / 1e6);
+        }
+    }
+
+    // Drop reasons summed over the interfaces, then each interface's counters
+    if (counters_map != NULL) {
+        static const char *names[NUM_COUNTERS] = COUNTER_NAMES;
+        printf("drops:      ");
+        for (int id = CTR_DROP_TOO_SHORT; id < NUM_COUNTERS; id++) {
+            uint64_t total = 0;
+            for (int i = 0; i < num_addrs; i++) {
+                total += counters_total(i, id) - counter_baseline[i][id];
+            }
+            printf(" %s %llu", names[id], (unsigned long long)total);
+        }
+        printf("\n");
+        control_counters(stdout);
+    }
+    return 0;
+}
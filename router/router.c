@@ -3,23 +3,48 @@
  * @date 2025 09 16
  * ICS 651 Project 1
  * IPv6 Distance Vector Router Implementation
+ *
+ * to compile: gcc -Wall -Wextra router.c slipnet.c simnet.c timerwheel.c pktqueue.c counters.c acl.c flows.c bond.c -lpthread -o router
+ * to test: the same with -DRUN_ROUTER_TEST, and the program runs its self test instead
  */
 
 // ============================================================================
 // INCLUDES AND HEADERS
 // ============================================================================
 
+#define _GNU_SOURCE                  /* pthread_setaffinity_np on Linux */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "slipnet.h"
 #include "simnet.h"
+#include "timerwheel.h"
+#include "pktqueue.h"
+#include "counters.h"
+#include "acl.h"
+#include "flows.h"
+#include "bond.h"
+#include "probes.h"
+#ifdef ROUTER_SIM
+#include "netsim.h"
+#endif
 
 // ============================================================================
 // DATA STRUCTURES
@@ -38,21 +63,93 @@ struct ipv6_header {
 };
 
 // Routing table entry structure
+#define MAX_PATHS 4                  /* Equal-cost next hops kept per route */
 struct route_entry {
-    struct in6_addr destination; /* Network address (first 64 bits matter) */
-    struct in6_addr gateway;     /* Next hop IP address */
+    struct in6_addr destination; /* Network address, host bits zeroed */
+    uint8_t prefix_len;          /* Significant leading bits of destination */
+    struct in6_addr gateways[MAX_PATHS]; /* Equal-cost next hop IP addresses */
+    int ifaces[MAX_PATHS];       /* Interface each gateway is on, -1 if none */
+    int num_gateways;            /* Number of valid gateways, at least 1 */
     uint32_t metric;             /* Distance/cost */
     time_t timestamp;            /* When route was added */
     int is_direct;               /* 1 for direct routes, 0 for learned */
+    int is_static;               /* 1 for routes injected over the control socket */
 };
 
-// Routing protocol packet structure
+#define ROUTING_PROTOCOL 2           /* IPv6 next header for routing packets */
+#define ROUTING_VERSION 1            /* Current wire format version */
+#define ROUTE_PREFIX_LEN 64          /* Connected networks, and routes given without one */
+#define ROUTE_WIRE_MAX (1 + 16 + 5)  /* Longest encoded route */
+#define MAX_ROUTING_PAYLOAD ((int)(MAX_SLIP_SEND - sizeof(struct ipv6_header) \
+                                   - sizeof(struct routing_packet_header)))
+#define MAX_ADVERT_SEGMENTS 255
+
+// Routing protocol packet structure (wire format, version 1)
 struct routing_packet_header {
-    struct in6_addr sender;      /* Sender's IP address */
-    uint32_t num_routes;         /* Number of routes following */
-    /* followed by routing table entries */
+    uint8_t version;             /* ROUTING_VERSION */
+    uint8_t flags;               /* Reserved, sent as 0 */
+    uint8_t segment;             /* Index of this segment in the advertisement */
+    uint8_t num_segments;        /* Total segments in the advertisement */
+    uint16_t sequence;           /* Per interface, one more per new advertisement */
+    uint16_t num_routes;         /* Number of routes in this segment */
+    /* followed by num_routes encoded routes, each:
+     *   uint8_t prefix_len, ceil(prefix_len / 8) prefix bytes,
+     *   metric as an unsigned LEB128 varint */
+};
+
+// ICMPv6 message header
+#define ICMPV6_PROTOCOL 58           /* IPv6 next header for ICMPv6 */
+#define ICMPV6_DEST_UNREACHABLE 1
+#define ICMPV6_TIME_EXCEEDED 3
+#define ICMPV6_ECHO_REQUEST 128      /* Types below this are errors */
+#define ICMPV6_ECHO_REPLY 129
+#define ICMPV6_HOP_LIMIT 64          /* Hop limit of packets we originate */
+struct icmpv6_header {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+    uint32_t data;               /* Type specific, e.g. echo identifier/sequence */
 };
 
+// ICMPv6 token bucket, one per interface
+#define ICMP_RATE 10                 /* Messages per second */
+#define ICMP_BURST 10                /* Messages sent back to back at most */
+typedef struct {
+    uint64_t tokens;             /* Thousandths of a message */
+    uint64_t last_ms;            /* Time of the last refill */
+} icmp_bucket_t;
+
+// Source policers: each ingress interface can give every source prefix of
+// a set length its own token bucket, kept in a hash table of fixed size
+#define POLICER_TABLE_SIZE 8192      /* Buckets, a power of 2 */
+#define POLICER_PROBES 16            /* Slots searched before reclaiming one */
+typedef struct {
+    int prefix_len;              /* Source bits keying a bucket, -1 if not policed */
+    uint32_t rate;               /* Bytes per second per bucket */
+    uint32_t burst;              /* Bucket depth in bytes */
+} policer_config_t;
+typedef struct {
+    struct in6_addr source;      /* Source prefix the bucket belongs to */
+    int tty;                     /* Ingress interface, -1 if the slot is empty */
+    int prefix_len;              /* Length of source */
+    uint64_t tokens;             /* Thousandths of a byte */
+    uint64_t last_ms;            /* Time of the last refill */
+} policer_t;
+
+// Forwarding worker, fed by the receive threads through its own queue
+#define MAX_WORKERS 64
+#define SERVICE_THREADS 8            /* Timer, expiry, checkpoint, flows, liveness, control, spare */
+#define WORKER_QUEUE_LEN 256         /* Packets, must be a power of 2 */
+#define WORKER_SPINS 1000            /* Empty polls before sleeping */
+#define WORKER_BATCH 256             /* Packets handled per pass, <= queue length */
+typedef struct {
+    struct pkt_queue queue;      /* Packets steered to this worker */
+    int cpu;                     /* Core the worker is pinned to */
+    atomic_int sleeping;         /* Worker is (about to be) waiting on wakeup */
+    pthread_mutex_t lock;        /* Protects the wakeup wait */
+    pthread_cond_t wakeup;       /* Signalled when a sleeping worker gets work */
+} fwd_worker_t;
+
 // Send thread arguments
 typedef struct {
     int fd;                      /* File descriptor */
@@ -60,28 +157,203 @@ typedef struct {
     int numbytes;                /* Data length */
 } send_arg_t;
 
-// Send lock structure for interface management
+// Send lock structure for interface management, one cache line or more
+// each so interfaces sending from their own threads do not share lines
+#define SEND_QUEUE_LEN 32
+#define SEND_THREAD_STACK (256 * 1024)  /* Send threads only write frames */
 typedef struct {
-    pthread_mutex_t lock;        /* Interface lock */
-    int in_use;                  /* Interface busy flag */
+    alignas(64) pthread_mutex_t lock;  /* Interface lock */
+    int in_use;                  /* Send thread running on this interface */
+    send_arg_t *queue[SEND_QUEUE_LEN]; /* Packets waiting to be sent */
+    int head;                    /* Index of the oldest queued packet */
+    int count;                   /* Number of queued packets */
 } send_lock_t;
 
+// Serialized advertisement for one interface, reused until the table changes
+typedef struct {
+    uint64_t generation;         /* Routing table generation it encodes */
+    uint16_t sequence;           /* Sent in its segments, one more per encoding */
+    int num_packets;             /* Number of segments, 0 if never built */
+    char *packets[MAX_ADVERT_SEGMENTS]; /* Encoded segments */
+    int sizes[MAX_ADVERT_SEGMENTS];     /* Size of each segment */
+} advert_cache_t;
+
+// Newest advertisement heard on an interface, so a delayed segment of an
+// older one cannot overwrite what a newer one installed
+typedef struct {
+    int heard;                   /* A segment has been accepted */
+    uint16_t sequence;           /* Its sequence number */
+    uint64_t heard_ms;           /* When it was accepted */
+} advert_seen_t;
+
+// Neighbor liveness hello, a tiny frame that is not IPv6 (BFD-like)
+#define HELLO_TYPE 0x01              /* First byte, IPv6 packets start with 0x6_ */
+#define HELLO_INTERVAL_MS 100        /* Suggested time between hellos, off unless -i */
+#define HELLO_MULTIPLIER 3           /* Default missed intervals before down */
+#define LIVENESS_TICK_MS 10          /* Liveness thread resolution */
+struct hello_frame {
+    uint8_t type;                /* HELLO_TYPE */
+    uint8_t state;               /* Sender's session state, NEIGHBOR_* */
+    uint8_t multiplier;          /* Sender's intervals without data before down */
+    uint8_t reserved;            /* Zero */
+    uint16_t interval_ms;        /* Sender's hello interval, network order */
+    /* The rest is only sent with link costs on, see HELLO_SHORT_SIZE */
+    uint16_t tx_ms;              /* Sender's clock when sent, network order */
+    uint16_t echo_ms;            /* tx_ms of the last hello the sender heard */
+    uint16_t echo_hold_ms;       /* How long the sender held it, HELLO_NO_ECHO if none */
+};
+#define HELLO_SHORT_SIZE offsetof(struct hello_frame, tx_ms)
+#define HELLO_NO_ECHO 0xffff
+enum neighbor_state { NEIGHBOR_DOWN, NEIGHBOR_INIT, NEIGHBOR_UP };
+typedef struct {
+    enum neighbor_state state;   /* Up once both sides hear each other */
+    uint64_t detect_ms;          /* Neighbor's interval times multiplier */
+    uint64_t last_rx_ms;         /* Last time any byte arrived */
+    unsigned long last_bytes;    /* Bytes received at the last check */
+    uint64_t next_tx_ms;         /* When our next hello is due */
+    uint16_t peer_tx_ms;         /* tx_ms of the neighbor's last hello */
+    uint64_t peer_rx_at_ms;      /* When it arrived, 0 if none has */
+    uint32_t srtt_us;            /* Smoothed round trip time, 0 before a sample */
+    uint64_t busy_since_ms;      /* Start of the run of ticks with bytes arriving */
+    unsigned long busy_bytes;    /* Bytes received during that run */
+    uint32_t rate_bps;           /* Highest rate seen over a busy run, 0 if none */
+    uint32_t cost;               /* Metric added to routes learned over the link */
+    uint64_t cost_changed_ms;    /* When cost last changed */
+} neighbor_t;
+
+// Link costs, which replace the hop count metric when enabled. A link
+// costs its one-way delay plus the time to send a COST_REF_BYTES packet at
+// its line rate, in COST_UNIT_MS units. Delay comes from the hellos' round
+// trip, rate from bytes arriving back to back, so queueing and slow lines
+// both make a link more expensive.
+#define COST_UNIT_MS 10              /* Delay worth one unit of metric */
+#define COST_REF_BYTES 128           /* Packet size the line rate is charged for */
+#define COST_RATE_WINDOW_MS 1000     /* Busy time needed for a rate sample */
+#define COST_CHANGE_PERCENT 25       /* Change ignored unless it is larger than this */
+#define COST_HOLD_MS 5000            /* Time a new cost is kept before the next change */
+#define COST_MAX 0xffff              /* Highest cost of a single link */
+
+// Route checkpoint file, rewritten in place so a restart can reload it
+#define CHECKPOINT_FILE "./router.routes"
+#define CHECKPOINT_MAGIC 0x31505452  /* "RTP1" little-endian */
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_INTERVAL_MS 5000
+struct checkpoint_header {
+    uint32_t magic;              /* CHECKPOINT_MAGIC */
+    uint32_t version;            /* CHECKPOINT_VERSION */
+    uint32_t max_routes;         /* MAX_ROUTES of the writer */
+    uint32_t num_routes;         /* Routes saved */
+    uint32_t complete;           /* 0 while a checkpoint is being written */
+    uint32_t reserved;
+    uint64_t saved_ms;           /* Wall clock time of the checkpoint */
+};
+struct checkpoint_route {
+    struct in6_addr destination;
+    struct in6_addr gateways[MAX_PATHS];
+    uint32_t remaining_ms[MAX_PATHS]; /* Lifetime left on each path */
+    uint32_t metric;
+    uint8_t num_gateways;
+    uint8_t is_static;
+    uint8_t prefix_len;
+    uint8_t reserved;
+    int64_t timestamp;           /* When the route was learned */
+};
+struct checkpoint_file {
+    struct checkpoint_header header;
+    struct checkpoint_route routes[];  /* MAX_ROUTES of them */
+};
+#define CHECKPOINT_SIZE (sizeof(struct checkpoint_file) + \
+                         MAX_ROUTES * sizeof(struct checkpoint_route))
+
+// Packet filters, one rule list per direction
+enum acl_direction { ACL_IN, ACL_OUT, ACL_DIRECTIONS };
+typedef struct {
+    struct acl_set *set;         /* Compiled rules, NULL if there are none */
+    enum acl_action *actions;    /* Action of each rule */
+    _Atomic uint64_t **hits;     /* Hit counter of each rule, owned by the rule list */
+} acl_table_t;
+
+// Control socket, a text protocol of one command per line
+#define CONTROL_SOCKET "./router.ctl"
+#define CONTROL_BUF_SIZE 65536       /* Bytes of commands read at once */
+
 // ============================================================================
 // GLOBAL VARIABLES
 // ============================================================================
 
 // Configuration
-static struct in6_addr sim_addrs[MAX_TTYS];  /* Local interface addresses */
+static struct in6_addr *sim_addrs;          /* Local interface addresses */
 static int num_addrs = 0;                    /* Number of interfaces */
+static int verbose = 1;                      /* Log every packet, cleared by -q */
+static int aggregate_adverts = 0;            /* Summarize advertisements, set by -a */
+static const char *flow_target = NULL;       /* Flow exporter file or udp:<port>, set by -e */
+
+// Per-packet logging, too slow to leave on when measuring throughput
+#define PKT_LOG(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
 
 // Routing table
-#define MAX_ROUTES 29
+#define MAX_ROUTES 16384
 static struct route_entry routing_table[MAX_ROUTES];
 static int num_routes = 0;
+static uint64_t routing_generation = 1;      /* Bumped on every table change */
 pthread_mutex_t routing_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// Interface management
-send_lock_t send_slots[MAX_TTYS];
+// Hash index of routing_table by prefix and length, guarded by routing_lock
+#define FIB_HASH_SIZE (2 * MAX_ROUTES)             /* Power of 2, half full at most */
+static int fib_hash[FIB_HASH_SIZE];              /* Route index + 1, 0 if empty */
+static int fib_length_routes[129];               /* Routes of each prefix length */
+static uint8_t fib_lengths[129];                 /* Lengths in use, longest first */
+static int num_fib_lengths = 0;
+
+// Route expiry, guarded by routing_lock
+#define ROUTE_LIFETIME_MS 100000                 /* Learned route lifetime */
+#define EXPIRY_TICK_MS 100                       /* Expiry timer resolution */
+static struct timer_wheel route_wheel;
+static struct tw_timer route_timers[MAX_ROUTES][MAX_PATHS]; /* One per gateway */
+
+// Interface management, arrays of num_addrs allocated at startup
+send_lock_t *send_slots;
+static atomic_int *link_down;                /* Set to simulate a failed link */
+
+// Active packet filters, swapped under acl_lock. Writers are preferred so
+// a rule change is not starved by workers taking the lock for every batch.
+static acl_table_t acl_tables[ACL_DIRECTIONS];
+static atomic_int acl_active_rules[ACL_DIRECTIONS];  /* Rules in each active table */
+static pthread_rwlock_t acl_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+// Source policers, guarded by policer_lock
+static policer_config_t *policer_config;      /* Per interface */
+static policer_t policers[POLICER_TABLE_SIZE];
+static atomic_int policed_ifaces;            /* Interfaces with a policer */
+static pthread_mutex_t policer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Advertisements, only touched by the timer thread
+#define ADVERT_INTERVAL_MS 30000                 /* Between routing announcements */
+static advert_cache_t *advert_cache;         /* Per interface */
+static uint64_t encoded_generation = 0;      /* Table generation the caches hold */
+
+// Advertisements heard, guarded by routing_lock. An older sequence is only
+// stale for a while, so a neighbor that restarts its count is heard again
+#define ADVERT_STALE_MS ADVERT_INTERVAL_MS
+static advert_seen_t *advert_seen;           /* Per interface */
+
+// Forwarding workers, 0 means receive threads forward packets themselves
+static fwd_worker_t workers[MAX_WORKERS];
+static int num_workers = 0;
+
+// Route checkpoint, NULL if it could not be mapped
+static struct checkpoint_file *checkpoint_map = NULL;
+
+// Neighbor liveness, 0 interval disables it
+static neighbor_t *neighbors;                /* Per interface */
+static pthread_mutex_t liveness_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hello_interval_ms = 0;           /* -i, a neighbor may not speak hellos */
+static int hello_multiplier = HELLO_MULTIPLIER;
+static uint32_t link_rate_bps = 0;           /* Configured line rate, 0 uses hop count */
+
+// ICMPv6 rate limiting
+static icmp_bucket_t *icmp_buckets;          /* Per interface */
+static pthread_mutex_t icmp_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // ============================================================================
 // UTILITY FUNCTIONS
@@ -98,6 +370,70 @@ void get_network_prefix(const struct in6_addr *addr, struct in6_addr *prefix) {
     }
 }
 
+/**
+ * Copy the first len bits of addr into prefix, zeroing the rest
+ */
+void mask_prefix(const struct in6_addr *addr, int len, struct in6_addr *prefix) {
+    memset(prefix, 0, sizeof(*prefix));
+    memcpy(prefix->s6_addr, addr->s6_addr, len / 8);
+    if (len % 8 != 0) {
+        prefix->s6_addr[len / 8] = addr->s6_addr[len / 8] & (uint8_t)(0xff << (8 - len % 8));
+    }
+}
+
+/**
+ * Current monotonic time in milliseconds
+ */
+uint64_t monotonic_ms() {
+#ifdef ROUTER_SIM
+    return sim_clock_ms();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+/**
+ * Current time in seconds, for route timestamps and ages
+ */
+time_t wall_seconds() {
+#ifdef ROUTER_SIM
+    return (time_t)(sim_clock_ms() / 1000);
+#else
+    return time(NULL);
+#endif
+}
+
+/**
+ * Current time in expiry timer ticks
+ */
+uint64_t expiry_ticks_now() {
+    return monotonic_ms() / EXPIRY_TICK_MS;
+}
+
+/**
+ * Hash a packet's flow label and addresses, so every packet of a flow
+ * hashes to the same value
+ */
+uint32_t flow_hash(const struct ipv6_header *ip6) {
+    uint32_t h = ((ip6->class_lo_flow_hi & 0x0f) << 16) | ntohs(ip6->flow_lo);
+    for (int i = 0; i < 16; i += 4) {
+        uint32_t src_word, dst_word;
+        memcpy(&src_word, ip6->source + i, 4);
+        memcpy(&dst_word, ip6->destination + i, 4);
+        h = (h ^ src_word) * 0x01000193;
+        h = (h ^ dst_word) * 0x01000193;
+    }
+    // Final avalanche so every input bit affects the low bits
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
 /**
  * Check if packet destination matches any local interface or broadcast
  */
@@ -110,9 +446,8 @@ int is_packet_for_router(const struct ipv6_header *ip6) {
     }
     
     // Check against link-local broadcast address ff02::1
-    struct in6_addr broadcast_addr;
-    inet_pton(AF_INET6, "ff02::1", &broadcast_addr);
-    if (memcmp(ip6->destination, &broadcast_addr, 16) == 0) {
+    static const uint8_t broadcast_addr[16] = { 0xff, 0x02, [15] = 0x01 };
+    if (memcmp(ip6->destination, broadcast_addr, 16) == 0) {
         return 1;
     }
     
@@ -141,18 +476,26 @@ void print_routing_table() {
                "-------------------------", "-------------------------", 
                "--------", "------", "----------");
 
-        time_t current_time = time(NULL);
+        time_t current_time = wall_seconds();
         for (int i = 0; i < num_routes; i++) {
-            char dest_str[INET6_ADDRSTRLEN];
+            char dest_str[INET6_ADDRSTRLEN + 4];
             char gateway_str[INET6_ADDRSTRLEN];
             
-            inet_ntop(AF_INET6, &routing_table[i].destination, dest_str, sizeof(dest_str));
-            inet_ntop(AF_INET6, &routing_table[i].gateway, gateway_str, sizeof(gateway_str));
+            inet_ntop(AF_INET6, &routing_table[i].destination, dest_str, INET6_ADDRSTRLEN);
+            sprintf(dest_str + strlen(dest_str), "/%u", routing_table[i].prefix_len);
+            inet_ntop(AF_INET6, &routing_table[i].gateways[0], gateway_str, sizeof(gateway_str));
             
             long age = current_time - routing_table[i].timestamp;
             printf("%-25s %-25s %-8u %-6s %-10lds\n", 
                    dest_str, gateway_str, routing_table[i].metric,
-                   routing_table[i].is_direct ? "Direct" : "Learn", age);
+                   routing_table[i].is_direct ? "Direct" :
+                   routing_table[i].is_static ? "Static" : "Learn", age);
+
+            // Further equal-cost gateways go on their own lines
+            for (int p = 1; p < routing_table[i].num_gateways; p++) {
+                inet_ntop(AF_INET6, &routing_table[i].gateways[p], gateway_str, sizeof(gateway_str));
+                printf("%-25s %-25s\n", "", gateway_str);
+            }
         }
     }
     printf("====================\n\n");
@@ -161,127 +504,142 @@ void print_routing_table() {
 }
 
 /**
- * Add or update a route in the routing table
+ * Home bucket of a prefix and length in fib_hash
  */
-void update_routing_table(const struct in6_addr *dest, const struct in6_addr *gateway, 
-                         uint32_t metric, int is_direct) {
-    pthread_mutex_lock(&routing_lock);
-    
-    // Get network prefix (first 64 bits) of destination
-    struct in6_addr dest_prefix;
-    get_network_prefix(dest, &dest_prefix);
-    
-    char dest_str[INET6_ADDRSTRLEN];
-    char gateway_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &dest_prefix, dest_str, sizeof(dest_str));
-    inet_ntop(AF_INET6, gateway, gateway_str, sizeof(gateway_str));
-    
-    // Search for existing route to same network (compare first 64 bits)
-    for (int i = 0; i < num_routes; i++) {
-        if (memcmp(&routing_table[i].destination, &dest_prefix, 8) == 0) {
-            // Found matching network route
-            if (metric < routing_table[i].metric) {
-                // New route is better, replace it and reset timestamp
-                uint32_t old_metric = routing_table[i].metric;
-                routing_table[i].destination = dest_prefix;
-                routing_table[i].gateway = *gateway;
-                routing_table[i].metric = metric;
-                routing_table[i].timestamp = time(NULL);
-                routing_table[i].is_direct = is_direct;
-                printf("Updated route to %s via %s with better metric %u (was %u)\n",
-                       dest_str, gateway_str, metric, old_metric);
-            } else if (metric == routing_table[i].metric) {
-                // Same metric, refresh the route but keep timestamp for age tracking
-                routing_table[i].destination = dest_prefix;
-                routing_table[i].gateway = *gateway;
-                routing_table[i].metric = metric;
-                routing_table[i].is_direct = is_direct;
-                printf("Refreshed route to %s via %s with same metric %u\n",
-                       dest_str, gateway_str, metric);
-            } else {
-                printf("Not updating route to %s - existing metric %u is better than %u\n",
-                       dest_str, routing_table[i].metric, metric);
-            }
-            pthread_mutex_unlock(&routing_lock);
-            return;
+uint32_t fib_bucket(const struct in6_addr *prefix, int len) {
+    uint64_t high, low;
+    memcpy(&high, prefix->s6_addr, 8);
+    memcpy(&low, prefix->s6_addr + 8, 8);
+    uint64_t key = high ^ (low * 0xff51afd7ed558ccdULL) ^ (uint64_t)len;
+    key ^= key >> 32;  // Fold the last bytes down, the multiply only carries upward
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (FIB_HASH_SIZE - 1);
+}
+
+/**
+ * Find the route for an exact prefix and length starting at its home bucket
+ * Returns the route index, or -1 if there is none
+ * Caller must hold routing_lock
+ */
+int fib_find(const struct in6_addr *prefix, int len, uint32_t bucket) {
+    while (fib_hash[bucket] != 0) {
+        int i = fib_hash[bucket] - 1;
+        if (routing_table[i].prefix_len == len &&
+            memcmp(&routing_table[i].destination, prefix, sizeof(*prefix)) == 0) {
+            return i;
         }
+        bucket = (bucket + 1) & (FIB_HASH_SIZE - 1);
     }
-    
-    // No existing route found, add new route if space available
-    if (num_routes < MAX_ROUTES) {
-        routing_table[num_routes].destination = dest_prefix;
-        routing_table[num_routes].gateway = *gateway;
-        routing_table[num_routes].metric = metric;
-        routing_table[num_routes].timestamp = time(NULL);
-        routing_table[num_routes].is_direct = is_direct;
-        num_routes++;
-        printf("Added new route to %s via %s with metric %u\n", 
-               dest_str, gateway_str, metric);
-    } else {
-        printf("Routing table full, cannot add route to %s\n", dest_str);
-    }
-    
-    pthread_mutex_unlock(&routing_lock);
+    return -1;
 }
 
 /**
- * Remove expired routes (older than 100 seconds)
+ * Longest prefix match for addr, probing each prefix length in use from
+ * fib_lengths[first] down
+ * Returns the route index, or -1 if no route covers addr
+ * Caller must hold routing_lock
  */
-void remove_expired_routes() {
-    pthread_mutex_lock(&routing_lock);
-    
-    time_t current_time = time(NULL);
-    int i = 0;
-    
-    while (i < num_routes) {
-        // Don't remove direct routes
-        if (!routing_table[i].is_direct && 
-            (current_time - routing_table[i].timestamp) > 100) {
-            
-            char dest_str[INET6_ADDRSTRLEN];
-            inet_ntop(AF_INET6, &routing_table[i].destination, dest_str, sizeof(dest_str));
-            printf("Removing expired route to %s (age: %ld seconds)\n", 
-                   dest_str, current_time - routing_table[i].timestamp);
-            
-            // Shift remaining routes down
-            for (int j = i; j < num_routes - 1; j++) {
-                routing_table[j] = routing_table[j + 1];
-            }
-            num_routes--;
-        } else {
-            i++;
+int fib_lookup(const struct in6_addr *addr, int first) {
+    for (int l = first; l < num_fib_lengths; l++) {
+        struct in6_addr prefix;
+        mask_prefix(addr, fib_lengths[l], &prefix);
+        int i = fib_find(&prefix, fib_lengths[l], fib_bucket(&prefix, fib_lengths[l]));
+        if (i >= 0) {
+            return i;
         }
     }
-    
-    pthread_mutex_unlock(&routing_lock);
+    return -1;
 }
 
+/**
+ * Count a route of length len in or out of fib_lengths
+ */
+void fib_count_length(int len, int delta) {
+    fib_length_routes[len] += delta;
+    if (fib_length_routes[len] != (delta > 0 ? 1 : 0)) {
+        return;
+    }
+    // A length came into or went out of use, rebuild the list
+    num_fib_lengths = 0;
+    for (int l = 128; l >= 0; l--) {
+        if (fib_length_routes[l] > 0) {
+            fib_lengths[num_fib_lengths++] = l;
+        }
+    }
+}
 
 /**
- * Look up route in routing table for a destination address
- * Returns the index of the matching route, or -1 if not found
+ * Bucket in fib_hash holding route i
  */
-int lookup_route(const struct in6_addr *dest_addr, struct in6_addr *next_hop) {
-    pthread_mutex_lock(&routing_lock);
+uint32_t fib_slot_of(int i) {
+    uint32_t bucket = fib_bucket(&routing_table[i].destination, routing_table[i].prefix_len);
+    while (fib_hash[bucket] != i + 1) {
+        bucket = (bucket + 1) & (FIB_HASH_SIZE - 1);
+    }
+    return bucket;
+}
 
-    // Get network prefix of destination (first 64 bits)
-    struct in6_addr dest_prefix;
-    get_network_prefix(dest_addr, &dest_prefix);
+/**
+ * Index route i by its destination and prefix length
+ * Caller must hold routing_lock
+ */
+void fib_insert(int i) {
+    uint32_t bucket = fib_bucket(&routing_table[i].destination, routing_table[i].prefix_len);
+    while (fib_hash[bucket] != 0) {
+        bucket = (bucket + 1) & (FIB_HASH_SIZE - 1);
+    }
+    fib_hash[bucket] = i + 1;
+    fib_count_length(routing_table[i].prefix_len, 1);
+}
 
-    // Search for matching route
-    int route_index = -1;
-    for (int i = 0; i < num_routes; i++) {
-        // Compare first 64 bits (8 bytes) of destination
-        if (memcmp(&routing_table[i].destination, &dest_prefix, 8) == 0) {
-            // Found a matching route
-            *next_hop = routing_table[i].gateway;
-            route_index = i;
+/**
+ * Drop route i from the index, shifting later entries of its probe run back
+ * so lookups never stop early at the hole
+ * Caller must hold routing_lock
+ */
+void fib_remove(int i) {
+    uint32_t hole = fib_slot_of(i);
+    uint32_t bucket = hole;
+    while (1) {
+        bucket = (bucket + 1) & (FIB_HASH_SIZE - 1);
+        if (fib_hash[bucket] == 0) {
             break;
         }
+        // Move the entry into the hole unless its home lies after the hole
+        const struct route_entry *moved = &routing_table[fib_hash[bucket] - 1];
+        uint32_t home = fib_bucket(&moved->destination, moved->prefix_len);
+        if (((bucket - home) & (FIB_HASH_SIZE - 1)) >= ((bucket - hole) & (FIB_HASH_SIZE - 1))) {
+            fib_hash[hole] = fib_hash[bucket];
+            hole = bucket;
+        }
+    }
+    fib_hash[hole] = 0;
+    fib_count_length(routing_table[i].prefix_len, -1);
+}
+
+/**
+ * (Re)start the lifetime of gateway p of route i, direct and static routes
+ * never expire
+ * Caller must hold routing_lock
+ */
+void schedule_path_expiry(int i, int p) {
+    if (routing_table[i].is_direct || routing_table[i].is_static) {
+        tw_cancel(&route_timers[i][p]);
+    } else {
+        tw_schedule(&route_wheel, &route_timers[i][p],
+                    expiry_ticks_now() + ROUTE_LIFETIME_MS / EXPIRY_TICK_MS);
     }
+}
 
-    pthread_mutex_unlock(&routing_lock);
-    return route_index;
+/**
+ * Move a pending expiry timer to another slot, keeping its expiry time
+ */
+void move_timer(struct tw_timer *from, struct tw_timer *to) {
+    tw_cancel(to);
+    if (tw_pending(from)) {
+        uint64_t expires = from->expires;
+        tw_cancel(from);
+        tw_schedule(&route_wheel, to, expires);
+    }
 }
 
 /**
@@ -306,266 +664,3210 @@ int find_output_interface(const struct in6_addr *gateway) {
     return -1;
 }
 
-// ============================================================================
-// NETWORK PACKET HANDLING
-// ============================================================================
-
 /**
- * Send thread function - writes data to SLIP interface
+ * Set path p of route i to gateway, resolving the interface it is reached
+ * on once here rather than on every walk of the table
+ * Caller must hold routing_lock
  */
-void *send_thread(void *arg) {
-    send_arg_t *s = arg;
-    printf("[Send] Sending packet on interface %d\n", s->fd);
-    write_slip_data(s->fd, s->data, s->numbytes);
+void set_path(int i, int p, const struct in6_addr *gateway) {
+    routing_table[i].gateways[p] = *gateway;
+    routing_table[i].ifaces[p] = find_output_interface(gateway);
+}
 
-    // Release interface slot
-    pthread_mutex_lock(&send_slots[s->fd].lock);
-    send_slots[s->fd].in_use = 0;
-    pthread_mutex_unlock(&send_slots[s->fd].lock);
+/**
+ * Find gateway among the paths of route i
+ * Returns the path index, or -1 if it is not one of them
+ */
+int find_path(int i, const struct in6_addr *gateway) {
+    for (int p = 0; p < routing_table[i].num_gateways; p++) {
+        if (memcmp(&routing_table[i].gateways[p], gateway, sizeof(*gateway)) == 0) {
+            return p;
+        }
+    }
+    return -1;
+}
 
-    free(s->data);
-    free(s);
-    return NULL;
+/**
+ * Remove the route at index i, moving the last route into its slot
+ * Caller must hold routing_lock
+ */
+void remove_route(int i) {
+    for (int p = 0; p < MAX_PATHS; p++) {
+        tw_cancel(&route_timers[i][p]);
+    }
+    fib_remove(i);
+    int last = num_routes - 1;
+    if (i != last) {
+        fib_hash[fib_slot_of(last)] = i + 1;
+        routing_table[i] = routing_table[last];
+        for (int p = 0; p < MAX_PATHS; p++) {
+            move_timer(&route_timers[last][p], &route_timers[i][p]);
+        }
+    }
+    num_routes--;
+    routing_generation++;
 }
 
 /**
- * Queue a send operation on an interface
+ * Remove gateway p from route i, removing the route if it was the last one
+ * Caller must hold routing_lock
  */
-void queue_send(int fd, const char *data, int numbytes) {
-    // Check if interface is busy
-    pthread_mutex_lock(&send_slots[fd].lock);
-    if (send_slots[fd].in_use) {
-        printf("[Send] Dropping packet on interface %d (busy)\n", fd);
-        pthread_mutex_unlock(&send_slots[fd].lock);
+void remove_path(int i, int p) {
+    if (routing_table[i].num_gateways == 1) {
+        remove_route(i);
         return;
     }
-    send_slots[fd].in_use = 1;
-    pthread_mutex_unlock(&send_slots[fd].lock);
+    tw_cancel(&route_timers[i][p]);
+    int last = routing_table[i].num_gateways - 1;
+    if (p != last) {
+        routing_table[i].gateways[p] = routing_table[i].gateways[last];
+        routing_table[i].ifaces[p] = routing_table[i].ifaces[last];
+        move_timer(&route_timers[i][last], &route_timers[i][p]);
+    }
+    routing_table[i].num_gateways--;
+    routing_generation++;
+}
 
-    // Prepare send thread arguments
-    send_arg_t *arg = malloc(sizeof(send_arg_t));
-    arg->fd = fd;
-    arg->data = malloc(numbytes);
-    memcpy(arg->data, data, numbytes);
-    arg->numbytes = numbytes;
+// Outcome of applying one advertised route, see update_routing_table
+enum route_change {
+    ROUTE_UNCHANGED,             /* Refreshed, or not better than what we have */
+    ROUTE_ADDED,                 /* New destination */
+    ROUTE_IMPROVED,              /* Better metric, replaced every path */
+    ROUTE_PATH_ADDED,            /* New equal-cost path */
+    ROUTE_PATH_REMOVED,          /* One of several paths got worse */
+    ROUTE_TABLE_FULL             /* New destination but no room for it */
+};
 
-    // Spawn send thread
-    pthread_t send_tid;
-    pthread_create(&send_tid, NULL, send_thread, arg);
-    pthread_detach(send_tid);
-}
+// One advertised route and what applying it did
+struct route_update {
+    struct in6_addr prefix;
+    uint8_t prefix_len;
+    uint32_t metric;
+    enum route_change change;
+    uint32_t old_metric;         /* Metric before ROUTE_IMPROVED or after ROUTE_PATH_REMOVED */
+    int num_paths;               /* Paths after ROUTE_PATH_ADDED */
+};
 
 /**
- * Process received routing protocol packet
+ * Add or update the route to update->prefix via gateway in the routing
+ * table, recording the outcome in update->change. Nothing is logged so a
+ * whole advertisement can be applied under one lock, see report_route_update.
+ * Caller must hold routing_lock
  */
-void process_routing_packet(const char *data, int numbytes, const struct in6_addr *src_addr) {
-    char src_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, src_addr, src_str, sizeof(src_str));
+void update_routing_table(struct route_update *update, const struct in6_addr *gateway,
+                          int is_direct) {
+    const struct in6_addr *dest_prefix = &update->prefix;
+    int prefix_len = update->prefix_len;
+    uint32_t metric = update->metric;
+    update->change = ROUTE_UNCHANGED;
 
-    printf("[Recv] Received a routing protocol packet from %s\n", src_str);
-
-    // Validate packet size
-    size_t min_size = sizeof(struct ipv6_header) + sizeof(struct routing_packet_header) + sizeof(struct route_entry);
-    if (numbytes < (int)min_size) {
-        printf("[Recv] Routing packet too short, dropping packet from %s\n", src_str);
+    // Search for existing route to same network
+    int i = fib_find(dest_prefix, prefix_len, fib_bucket(dest_prefix, prefix_len));
+    if (i >= 0 && routing_table[i].is_static) {
+        // Static routes are only changed over the control socket
+        return;
+    } else if (i >= 0) {
+        // Found matching network route
+        int p = find_path(i, gateway);
+        if (metric < routing_table[i].metric) {
+            // New route is better, it replaces every path and resets timestamp
+            update->old_metric = routing_table[i].metric;
+            update->change = ROUTE_IMPROVED;
+            for (int q = 1; q < MAX_PATHS; q++) {
+                tw_cancel(&route_timers[i][q]);
+            }
+            set_path(i, 0, gateway);
+            routing_table[i].num_gateways = 1;
+            routing_table[i].metric = metric;
+            routing_table[i].timestamp = wall_seconds();
+            routing_table[i].is_direct = is_direct;
+            routing_table[i].is_static = 0;
+            routing_generation++;
+            schedule_path_expiry(i, 0);
+        } else if (metric == routing_table[i].metric && p >= 0) {
+            // Same metric from a known gateway, restart its lifetime
+            // but keep timestamp for age tracking
+            schedule_path_expiry(i, p);
+        } else if (metric == routing_table[i].metric &&
+                   routing_table[i].num_gateways < MAX_PATHS) {
+            // Same metric from a new gateway, add it as an equal-cost path
+            p = routing_table[i].num_gateways++;
+            set_path(i, p, gateway);
+            routing_generation++;
+            schedule_path_expiry(i, p);
+            update->num_paths = routing_table[i].num_gateways;
+            update->change = ROUTE_PATH_ADDED;
+        } else if (metric > routing_table[i].metric && p >= 0 &&
+                   routing_table[i].num_gateways > 1) {
+            // One of several paths got worse, keep using the others
+            remove_path(i, p);
+            update->old_metric = routing_table[i].metric;
+            update->change = ROUTE_PATH_REMOVED;
+        }
         return;
     }
-
-    // Parse routing packet header
-    struct routing_packet_header *rp_hdr = (struct routing_packet_header *)(data + sizeof(struct ipv6_header));
-    uint32_t num_advertised = ntohl(rp_hdr->num_routes);
     
-    // Parse advertised routes
-    struct route_entry *advertised_routes = (struct route_entry *)(rp_hdr + 1);
-
-    printf("[Recv] Processing %u advertised routes from %s\n", num_advertised, src_str);
-
-    // Process each advertised route
-    size_t max_routes = (numbytes - sizeof(struct ipv6_header) - sizeof(struct routing_packet_header)) / sizeof(struct route_entry);
-    for (uint32_t i = 0; i < num_advertised && i < max_routes; i++) {
-        uint32_t new_metric = ntohl(advertised_routes[i].metric) + 1; // Increment metric
-        update_routing_table(&advertised_routes[i].destination, src_addr, new_metric, 0);
+    // No existing route found, add new route if space available
+    if (num_routes < MAX_ROUTES) {
+        routing_table[num_routes].destination = *dest_prefix;
+        routing_table[num_routes].prefix_len = prefix_len;
+        set_path(num_routes, 0, gateway);
+        routing_table[num_routes].num_gateways = 1;
+        routing_table[num_routes].metric = metric;
+        routing_table[num_routes].timestamp = wall_seconds();
+        routing_table[num_routes].is_direct = is_direct;
+        routing_table[num_routes].is_static = 0;
+        schedule_path_expiry(num_routes, 0);
+        fib_insert(num_routes);
+        num_routes++;
+        routing_generation++;
+        update->change = ROUTE_ADDED;
+    } else {
+        update->change = ROUTE_TABLE_FULL;
     }
 }
 
 /**
- * Forward packet to next hop
+ * Log what update_routing_table did, if it changed anything
  */
-void forward_packet(const char *data, int numbytes, int tty, const struct ipv6_header *ip6) {
-    char src_str[INET6_ADDRSTRLEN];
-    char dst_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, ip6->source, src_str, sizeof(src_str));
-    inet_ntop(AF_INET6, ip6->destination, dst_str, sizeof(dst_str));
-
-    printf("[Iface %d] Received packet not for this router, attempting to forward\n", tty);
-
-    // Check hop limit
-    if (ip6->hop_limit <= 1) {
-        printf("[Iface %d] Hop limit reached 0, dropping packet from %s\n", tty, src_str);
+void report_route_update(const struct route_update *update, const char *gateway_str) {
+    if (update->change == ROUTE_UNCHANGED) {
         return;
     }
+    char dest_str[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &update->prefix, dest_str, sizeof(dest_str));
 
-    // Look up route in routing table
-    struct in6_addr dst_addr, next_hop;
-    memcpy(&dst_addr, ip6->destination, sizeof(dst_addr));
-
-    int route_idx = lookup_route(&dst_addr, &next_hop);
-    if (route_idx == -1) {
-        printf("[Iface %d] No route found for destination %s, dropping packet\n", tty, dst_str);
-        return;
+    switch (update->change) {
+    case ROUTE_ADDED:
+        printf("Added new route to %s/%u via %s with metric %u\n",
+               dest_str, update->prefix_len, gateway_str, update->metric);
+        break;
+    case ROUTE_IMPROVED:
+        printf("Updated route to %s/%u via %s with better metric %u (was %u)\n",
+               dest_str, update->prefix_len, gateway_str, update->metric, update->old_metric);
+        break;
+    case ROUTE_PATH_ADDED:
+        printf("Added equal-cost path to %s/%u via %s with metric %u (%d paths)\n",
+               dest_str, update->prefix_len, gateway_str, update->metric, update->num_paths);
+        break;
+    case ROUTE_PATH_REMOVED:
+        printf("Removed path to %s/%u via %s - metric %u is worse than %u\n",
+               dest_str, update->prefix_len, gateway_str, update->metric, update->old_metric);
+        break;
+    case ROUTE_TABLE_FULL:
+        printf("Routing table full, cannot add route to %s/%u\n", dest_str, update->prefix_len);
+        break;
+    default:
+        break;
     }
+}
 
-    char nexthop_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &next_hop, nexthop_str, sizeof(nexthop_str));
-    printf("[Iface %d] Found route to %s via gateway %s\n", tty, dst_str, nexthop_str);
-
-    // Find which interface can reach the next hop
-    int output_interface = find_output_interface(&next_hop);
-    if (output_interface == -1) {
-        printf("[Iface %d] Cannot find output interface for gateway %s, dropping packet\n", tty, nexthop_str);
-        return;
-    }
+/**
+ * Expiry timer callback - removes the gateway whose timer fired
+ * Called with routing_lock held
+ */
+void expire_route(struct tw_timer *timer, void *arg) {
+    (void)arg;
+    int i = (timer - &route_timers[0][0]) / MAX_PATHS;
+    int p = (timer - &route_timers[0][0]) % MAX_PATHS;
 
-    printf("[Iface %d] Forwarding out interface %d\n", tty, output_interface);
+    char dest_str[INET6_ADDRSTRLEN];
+    char gateway_str[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &routing_table[i].destination, dest_str, sizeof(dest_str));
+    inet_ntop(AF_INET6, &routing_table[i].gateways[p], gateway_str, sizeof(gateway_str));
+    printf("Removing expired route to %s via %s (age: %ld seconds)\n",
+           dest_str, gateway_str, (long)(wall_seconds() - routing_table[i].timestamp));
+    PROBE(route_expire, &routing_table[i].destination, routing_table[i].prefix_len,
+          &routing_table[i].gateways[p]);
 
-    // Make a copy of the packet for forwarding
-    char *packet_copy = malloc(numbytes);
-    if (packet_copy == NULL) {
-        printf("[Iface %d] Error: Failed to allocate memory for packet copy\n", tty);
-        return;
-    }
-    memcpy(packet_copy, data, numbytes);
+    remove_path(i, p);
+}
 
-    // Modify hop limit in the copy
-    struct ipv6_header *ip6_copy = (struct ipv6_header *) packet_copy;
-    ip6_copy->hop_limit = ip6->hop_limit - 1;
+/**
+ * Expire the learned routes whose time is up
+ */
+void expire_routes() {
+    pthread_mutex_lock(&routing_lock);
+    tw_advance(&route_wheel, expiry_ticks_now(), expire_route, NULL);
+    pthread_mutex_unlock(&routing_lock);
+}
 
-    printf("[Iface %d] Forwarding packet with decremented hop limit %d\n", tty, ip6_copy->hop_limit);
-    print_packet("Forwarding packet", packet_copy, numbytes);
+/**
+ * Expiry thread - advances the route timer wheel every tick
+ */
+void *expiry_thread(void *arg) {
+    (void)arg;
+    struct timespec tick = { 0, EXPIRY_TICK_MS * 1000000L };
 
-    // Send packet out the correct interface
-    queue_send(output_interface, packet_copy, numbytes);
-    free(packet_copy);
+    while (1) {
+        nanosleep(&tick, NULL);
+        expire_routes();
+    }
+    return NULL;
 }
 
 /**
- * Main packet processing function - handles all incoming packets
+ * Look up route in routing table for a destination address, choosing
+ * among equal-cost gateways by the packet's flow hash
+ * Returns the index of the matching route, or -1 if not found
  */
-static void data_handler(int tty, const void *vdata, int numbytes) {
-    const char *data = (const char *)vdata;
+int lookup_route(const struct in6_addr *dest_addr, uint32_t hash, struct in6_addr *next_hop) {
+    pthread_mutex_lock(&routing_lock);
 
-    // Validate IPv6 header size
-    if (numbytes < (int)sizeof(struct ipv6_header)) {
-        printf("[Iface %d] Received packet too short for IPv6 header, dropping packet\n", tty);
-        return;
+    // Search for the longest matching route
+    int route_index = fib_lookup(dest_addr, 0);
+    if (route_index >= 0) {
+        struct route_entry *route = &routing_table[route_index];
+        *next_hop = route->gateways[hash % route->num_gateways];
     }
 
-    struct ipv6_header *ip6 = (struct ipv6_header *)data;
+    pthread_mutex_unlock(&routing_lock);
+    return route_index;
+}
 
-    // Extract source and destination addresses
-    struct in6_addr src_addr, dst_addr;
-    memcpy(&src_addr, ip6->source, sizeof(src_addr));
-    memcpy(&dst_addr, ip6->destination, sizeof(dst_addr));
+// ============================================================================
+// ROUTING PROTOCOL WIRE FORMAT
+// ============================================================================
 
-    // Print packet information
-    char src_str[INET6_ADDRSTRLEN];
-    char dst_str[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &src_addr, src_str, sizeof(src_str));
-    inet_ntop(AF_INET6, &dst_addr, dst_str, sizeof(dst_str));
-    printf("[Iface %d] Parsed IPv6 packet - src=%s, dst=%s\n", src_str, dst_str);
+/**
+ * Encode value as an unsigned LEB128 varint
+ * Returns the number of bytes written (at most 5)
+ */
+int encode_varint(uint8_t *out, uint32_t value) {
+    int len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
 
-    // Check if packet is for this router
-    if (is_packet_for_router(ip6)) {
-        printf("[Iface %d] Packet is for this router, processing locally\n", tty);
-        
-        if (ip6->next_header == 2) {
-            // Routing protocol packet
-            process_routing_packet(data, numbytes, &src_addr);
+/**
+ * Decode an unsigned LEB128 varint from [in, end)
+ * Returns the number of bytes consumed, or -1 if truncated, too long or
+ * over 32 bits
+ */
+int decode_varint(const uint8_t *in, const uint8_t *end, uint32_t *value) {
+    uint32_t result = 0;
+    for (int i = 0; i < 5 && in + i < end; i++) {
+        if (i == 4 && in[i] > 0x0f) {
+            return -1;  // The fifth byte holds the top 4 bits and ends the varint
+        }
+        result |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Number of bytes a route occupies on the wire
+ */
+int route_wire_size(const struct route_entry *route) {
+    uint8_t scratch[5];
+    return 1 + (route->prefix_len + 7) / 8 + encode_varint(scratch, route->metric);
+}
+
+/**
+ * Encode one route, returns the number of bytes written
+ */
+int encode_route(uint8_t *out, const struct route_entry *route) {
+    int prefix_bytes = (route->prefix_len + 7) / 8;
+    out[0] = route->prefix_len;
+    memcpy(out + 1, route->destination.s6_addr, prefix_bytes);
+    return 1 + prefix_bytes + encode_varint(out + 1 + prefix_bytes, route->metric);
+}
+
+/**
+ * Decode one route from [in, end), host bits of the prefix are zeroed
+ * Returns the number of bytes consumed, or -1 if the route is malformed
+ */
+int decode_route(const uint8_t *in, const uint8_t *end, struct in6_addr *prefix,
+                 uint8_t *prefix_len, uint32_t *metric) {
+    if (in >= end || in[0] > 128) {
+        return -1;
+    }
+    int prefix_bytes = (in[0] + 7) / 8;
+    if (end - in < 1 + prefix_bytes) {
+        return -1;
+    }
+    memset(prefix, 0, sizeof(*prefix));
+    memcpy(prefix->s6_addr, in + 1, prefix_bytes);
+    if (in[0] % 8 != 0) {
+        prefix->s6_addr[prefix_bytes - 1] &= (uint8_t)(0xff << (8 - in[0] % 8));
+    }
+    *prefix_len = in[0];
+
+    int varint_len = decode_varint(in + 1 + prefix_bytes, end, metric);
+    if (varint_len < 0) {
+        return -1;
+    }
+    return 1 + prefix_bytes + varint_len;
+}
+
+/**
+ * Build the advertisement of entries sent from src, segmented so each
+ * packet fits in MAX_SLIP_SEND. Packets are malloc'd into packets[] with
+ * their sizes in sizes[]. Returns the number of packets built, or -1 with
+ * none left allocated if out of memory.
+ */
+int build_advertisement(const struct route_entry *entries, int count,
+                        const struct in6_addr *src, uint16_t sequence,
+                        char **packets, int *sizes) {
+    // First pass: split the routes into segments that fit in one packet
+    int segment_start[MAX_ADVERT_SEGMENTS + 1];
+    int segment_bytes[MAX_ADVERT_SEGMENTS];
+    int num_segments = 0;
+    int used = MAX_ROUTING_PAYLOAD;
+    for (int i = 0; i < count; i++) {
+        int size = route_wire_size(&entries[i]);
+        if (used + size > MAX_ROUTING_PAYLOAD) {
+            if (num_segments == MAX_ADVERT_SEGMENTS) {
+                printf("[Timer] Advertisement exceeds %d segments, omitting %d routes\n",
+                       MAX_ADVERT_SEGMENTS, count - i);
+                count = i;
+                break;
+            }
+            segment_start[num_segments] = i;
+            segment_bytes[num_segments] = 0;
+            num_segments++;
+            used = 0;
+        }
+        used += size;
+        segment_bytes[num_segments - 1] += size;
+    }
+    segment_start[num_segments] = count;
+
+    // Build IPv6 header, sent to link-local broadcast ff02::1
+    struct ipv6_header ip6_hdr;
+    memset(&ip6_hdr, 0, sizeof(ip6_hdr));
+    ip6_hdr.ver_class_hi = 0x60;
+    ip6_hdr.next_header = ROUTING_PROTOCOL;
+    ip6_hdr.hop_limit = 1;    // Send only to neighbors
+    memcpy(ip6_hdr.source, src->s6_addr, 16);
+    struct in6_addr dest_addr;
+    inet_pton(AF_INET6, "ff02::1", &dest_addr);
+    memcpy(ip6_hdr.destination, dest_addr.s6_addr, 16);
+
+    // Second pass: encode each segment into its own packet
+    for (int seg = 0; seg < num_segments; seg++) {
+        int payload_size = sizeof(struct routing_packet_header) + segment_bytes[seg];
+        int packet_size = sizeof(ip6_hdr) + payload_size;
+        char *packet = malloc(packet_size);
+        if (packet == NULL) {
+            for (int j = 0; j < seg; j++) {
+                free(packets[j]);
+            }
+            return -1;
+        }
+
+        ip6_hdr.length = htons(payload_size);
+        memcpy(packet, &ip6_hdr, sizeof(ip6_hdr));
+
+        struct routing_packet_header routing_hdr;
+        routing_hdr.version = ROUTING_VERSION;
+        routing_hdr.flags = 0;
+        routing_hdr.segment = seg;
+        routing_hdr.num_segments = num_segments;
+        routing_hdr.sequence = htons(sequence);
+        routing_hdr.num_routes = htons(segment_start[seg + 1] - segment_start[seg]);
+        memcpy(packet + sizeof(ip6_hdr), &routing_hdr, sizeof(routing_hdr));
+
+        uint8_t *out = (uint8_t *)packet + sizeof(ip6_hdr) + sizeof(routing_hdr);
+        for (int i = segment_start[seg]; i < segment_start[seg + 1]; i++) {
+            out += encode_route(out, &entries[i]);
+        }
+
+        packets[seg] = packet;
+        sizes[seg] = packet_size;
+    }
+    return num_segments;
+}
+
+// ============================================================================
+// INTERFACE SEND QUEUES
+// ============================================================================
+
+/**
+ * Send the oldest packet queued on an interface, or release the interface
+ * when its queue is empty
+ * Returns 1 if a packet was sent, 0 once the interface is released
+ */
+int send_next(int fd) {
+    pthread_mutex_lock(&send_slots[fd].lock);
+    if (send_slots[fd].count == 0) {
+        send_slots[fd].in_use = 0;
+        pthread_mutex_unlock(&send_slots[fd].lock);
+        return 0;
+    }
+    send_arg_t *s = send_slots[fd].queue[send_slots[fd].head];
+    send_slots[fd].head = (send_slots[fd].head + 1) % SEND_QUEUE_LEN;
+    send_slots[fd].count--;
+    pthread_mutex_unlock(&send_slots[fd].lock);
+
+    PKT_LOG("[Send] Sending packet on interface %d\n", s->fd);
+    // A bond keeps each flow on one member by its hash
+    uint32_t hash = 0;
+    if (s->numbytes >= (int)sizeof(struct ipv6_header) && bond_members(s->fd) > 1) {
+        hash = flow_hash((const struct ipv6_header *)s->data);
+    }
+    if (bond_write(s->fd, s->data, s->numbytes, hash) > 0) {
+        counter_add(s->fd, CTR_TX_PACKETS, 1);
+        counter_add(s->fd, CTR_TX_BYTES, s->numbytes);
+    }
+
+    free(s->data);
+    free(s);
+    return 1;
+}
+
+/**
+ * Send thread function - drains the interface's queue to its SLIP interface
+ */
+void *send_thread(void *arg) {
+    int fd = *(int *)arg;
+    free(arg);
+
+    while (send_next(fd)) {
+    }
+    return NULL;
+}
+
+/**
+ * Queue a send operation on an interface, urgent packets go to the front
+ * of the queue and make room by dropping the newest queued packet
+ */
+void enqueue_send(int fd, const char *data, int numbytes, int urgent) {
+    // Nothing leaves an interface whose link is down
+    if (atomic_load_explicit(&link_down[fd], memory_order_relaxed)) {
+        PROBE(enqueue, fd, numbytes, data, PROBE_LINK_DOWN);
+        return;
+    }
+
+    // Prepare send arguments
+    send_arg_t *arg = malloc(sizeof(send_arg_t));
+    arg->fd = fd;
+    arg->data = malloc(numbytes);
+    memcpy(arg->data, data, numbytes);
+    arg->numbytes = numbytes;
+
+    // Add to the interface queue, dropping if it is full
+    send_arg_t *dropped = NULL;
+    pthread_mutex_lock(&send_slots[fd].lock);
+    if (send_slots[fd].count == SEND_QUEUE_LEN) {
+        if (!urgent) {
+            dropped = arg;
+        } else {
+            int newest = (send_slots[fd].head + SEND_QUEUE_LEN - 1) % SEND_QUEUE_LEN;
+            dropped = send_slots[fd].queue[newest];
+            send_slots[fd].count--;
+        }
+        PKT_LOG("[Send] Dropping packet on interface %d (queue full)\n", fd);
+        counter_add(fd, CTR_DROP_QUEUE_FULL, 1);
+        PROBE(enqueue, fd, dropped->numbytes, dropped->data, CTR_DROP_QUEUE_FULL);
+        if (dropped == arg) {
+            pthread_mutex_unlock(&send_slots[fd].lock);
+            free(arg->data);
+            free(arg);
+            return;
+        }
+    }
+    if (urgent) {
+        send_slots[fd].head = (send_slots[fd].head + SEND_QUEUE_LEN - 1) % SEND_QUEUE_LEN;
+        send_slots[fd].queue[send_slots[fd].head] = arg;
+    } else {
+        int tail = (send_slots[fd].head + send_slots[fd].count) % SEND_QUEUE_LEN;
+        send_slots[fd].queue[tail] = arg;
+    }
+    send_slots[fd].count++;
+    PROBE(enqueue, fd, numbytes, data, PROBE_QUEUED);
+    int start_thread = !send_slots[fd].in_use;
+    send_slots[fd].in_use = 1;
+    pthread_mutex_unlock(&send_slots[fd].lock);
+    if (dropped != NULL) {
+        free(dropped->data);
+        free(dropped);
+    }
+
+    // Spawn a send thread if none is draining this interface
+#ifdef ROUTER_SIM
+    if (start_thread) {
+        sim_start_sender(fd);
+    }
+#else
+    if (start_thread) {
+        int *thread_fd = malloc(sizeof(int));
+        *thread_fd = fd;
+        pthread_t send_tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, SEND_THREAD_STACK);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_create(&send_tid, &attr, send_thread, thread_fd);
+        pthread_attr_destroy(&attr);
+    }
+#endif
+}
+
+/**
+ * Queue a packet behind those already waiting on an interface
+ */
+void queue_send(int fd, const char *data, int numbytes) {
+    enqueue_send(fd, data, numbytes, 0);
+}
+
+#ifdef FWD_BENCH
+// fwdbench.c includes this file and replaces transmission with a stub
+void bench_transmit(int fd, const char *data, int numbytes);
+#define queue_send bench_transmit
+#endif
+
+// ============================================================================
+// ICMPV6
+// ============================================================================
+
+/**
+ * Add data to a 64-bit one's complement accumulator, four bytes at a time
+ * The sum is byte-order independent, so words are added in host order
+ */
+uint64_t checksum_add(uint64_t sum, const void *data, int len) {
+    const uint8_t *p = data;
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        sum += word;
+        p += 4;
+        len -= 4;
+    }
+    if (len > 0) {
+        uint8_t tail[4] = { 0, 0, 0, 0 };  // Odd tail is padded with zeros
+        memcpy(tail, p, len);
+        uint32_t word;
+        memcpy(&word, tail, 4);
+        sum += word;
+    }
+    return sum;
+}
+
+/**
+ * Fold a one's complement accumulator to 16 bits and complement it
+ */
+uint16_t checksum_finish(uint64_t sum) {
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/**
+ * Checksum after one 16-bit word it covers changed, without summing the
+ * rest again (RFC 1624, eqn. 3)
+ */
+uint16_t checksum_update(uint16_t checksum, uint16_t old_word, uint16_t new_word) {
+    uint64_t sum = (uint16_t)~checksum;
+    sum += (uint16_t)~old_word;
+    sum += new_word;
+    return checksum_finish(sum);
+}
+
+/**
+ * ICMPv6 checksum of message over the pseudo-header of ip6
+ */
+uint16_t icmpv6_checksum(const struct ipv6_header *ip6, const void *message, int len) {
+    uint32_t pseudo[2] = { htonl(len), htonl(ICMPV6_PROTOCOL) };
+    uint64_t sum = checksum_add(0, ip6->source, 32);  // Source and destination
+    sum = checksum_add(sum, pseudo, sizeof(pseudo));
+    return checksum_finish(checksum_add(sum, message, len));
+}
+
+/**
+ * Take a token from the ICMPv6 bucket of an interface
+ * Returns 1 if a message may be sent, 0 if the interface is over its rate
+ */
+int icmp_rate_allow(int tty) {
+    uint64_t now = monotonic_ms();
+    int allowed = 0;
+
+    pthread_mutex_lock(&icmp_lock);
+    icmp_bucket_t *bucket = &icmp_buckets[tty];
+    // Refill at ICMP_RATE tokens per second, up to ICMP_BURST
+    bucket->tokens += (now - bucket->last_ms) * ICMP_RATE;
+    if (bucket->tokens > ICMP_BURST * 1000) {
+        bucket->tokens = ICMP_BURST * 1000;
+    }
+    bucket->last_ms = now;
+    if (bucket->tokens >= 1000) {
+        bucket->tokens -= 1000;
+        allowed = 1;
+    }
+    pthread_mutex_unlock(&icmp_lock);
+    return allowed;
+}
+
+/**
+ * Route a packet originated by this router and queue it on its interface
+ * Returns the output interface, or -1 if there is no way to send it
+ */
+int send_local_packet(const char *packet, int numbytes) {
+    const struct ipv6_header *ip6 = (const struct ipv6_header *)packet;
+    struct in6_addr dst_addr, next_hop;
+    memcpy(&dst_addr, ip6->destination, sizeof(dst_addr));
+
+    if (lookup_route(&dst_addr, flow_hash(ip6), &next_hop) == -1) {
+        return -1;
+    }
+    int output_interface = find_output_interface(&next_hop);
+    if (output_interface == -1) {
+        return -1;
+    }
+    queue_send(output_interface, packet, numbytes);
+    return output_interface;
+}
+
+/**
+ * Send an ICMPv6 error about the packet that arrived on tty
+ * Errors are never sent about ICMPv6 errors or multicast packets
+ */
+void send_icmp_error(int tty, const char *data, int numbytes, uint8_t type, uint8_t code) {
+    const struct ipv6_header *ip6 = (const struct ipv6_header *)data;
+
+    if (ip6->destination[0] == 0xff || ip6->source[0] == 0xff) {
+        return;
+    }
+    if (ip6->next_header == ICMPV6_PROTOCOL &&
+        numbytes > (int)sizeof(struct ipv6_header) &&
+        (uint8_t)data[sizeof(struct ipv6_header)] < ICMPV6_ECHO_REQUEST) {
+        return;
+    }
+    if (!icmp_rate_allow(tty)) {
+        printf("[Iface %d] ICMPv6 rate limit reached, not sending type %u\n", tty, type);
+        return;
+    }
+
+    // Quote as much of the offending packet as fits in one SLIP packet
+    int quoted = numbytes;
+    int max_quoted = MAX_SLIP_SEND - sizeof(struct ipv6_header) - sizeof(struct icmpv6_header);
+    if (quoted > max_quoted) {
+        quoted = max_quoted;
+    }
+    int message_len = sizeof(struct icmpv6_header) + quoted;
+    char packet[MAX_SLIP_SEND];
+
+    struct ipv6_header reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.ver_class_hi = 0x60;
+    reply.length = htons(message_len);
+    reply.next_header = ICMPV6_PROTOCOL;
+    reply.hop_limit = ICMPV6_HOP_LIMIT;
+    memcpy(reply.source, sim_addrs[tty].s6_addr, 16);
+    memcpy(reply.destination, ip6->source, 16);
+
+    struct icmpv6_header icmp;
+    icmp.type = type;
+    icmp.code = code;
+    icmp.checksum = 0;
+    icmp.data = 0;  // Unused for Destination Unreachable and Time Exceeded
+
+    memcpy(packet, &reply, sizeof(reply));
+    memcpy(packet + sizeof(reply), &icmp, sizeof(icmp));
+    memcpy(packet + sizeof(reply) + sizeof(icmp), data, quoted);
+    icmp.checksum = icmpv6_checksum(&reply, packet + sizeof(reply), message_len);
+    memcpy(packet + sizeof(reply), &icmp, sizeof(icmp));
+
+    int output_interface = send_local_packet(packet, sizeof(reply) + message_len);
+    if (output_interface < 0) {
+        printf("[Iface %d] No route back to the source, could not send ICMPv6 type %u code %u\n",
+               tty, type, code);
+        return;
+    }
+    printf("[Iface %d] Sent ICMPv6 type %u code %u out interface %d\n",
+           tty, type, code, output_interface);
+}
+
+/**
+ * Answer an ICMPv6 Echo Request addressed to this router
+ * Swapping the addresses leaves the checksum unchanged, so only the type
+ * change is applied to it (RFC 1624)
+ */
+void process_icmp_packet(int tty, const char *data, int numbytes) {
+    int message_len = numbytes - sizeof(struct ipv6_header);
+    if (message_len < (int)sizeof(struct icmpv6_header)) {
+        printf("[Iface %d] ICMPv6 packet too short, dropping packet\n", tty);
+        return;
+    }
+    const struct ipv6_header *ip6 = (const struct ipv6_header *)data;
+    const char *message = data + sizeof(struct ipv6_header);
+    if (icmpv6_checksum(ip6, message, message_len) != 0) {
+        printf("[Iface %d] ICMPv6 checksum error, dropping packet\n", tty);
+        return;
+    }
+    if ((uint8_t)message[0] != ICMPV6_ECHO_REQUEST) {
+        printf("[Iface %d] Ignoring ICMPv6 type %u\n", tty, (uint8_t)message[0]);
+        return;
+    }
+    // Requests up to MAX_SLIP_SIZE arrive, but no interface sends more than MAX_SLIP_SEND
+    if (numbytes > MAX_SLIP_SEND) {
+        printf("[Iface %d] ICMPv6 Echo Request of %d bytes too large to answer, dropping packet\n",
+               tty, numbytes);
+        return;
+    }
+    if (!icmp_rate_allow(tty)) {
+        printf("[Iface %d] ICMPv6 rate limit reached, not sending Echo Reply\n", tty);
+        return;
+    }
+
+    char packet[MAX_SLIP_SEND];
+    memcpy(packet, data, numbytes);
+    struct ipv6_header *reply = (struct ipv6_header *)packet;
+    // Reply from the address that was pinged, unless it was multicast
+    if (ip6->destination[0] == 0xff) {
+        memcpy(reply->source, sim_addrs[tty].s6_addr, 16);
+    } else {
+        memcpy(reply->source, ip6->destination, 16);
+    }
+    memcpy(reply->destination, ip6->source, 16);
+    reply->hop_limit = ICMPV6_HOP_LIMIT;
+
+    struct icmpv6_header icmp;
+    memcpy(&icmp, packet + sizeof(*reply), sizeof(icmp));
+    uint16_t old_word, new_word;
+    memcpy(&old_word, &icmp, 2);
+    icmp.type = ICMPV6_ECHO_REPLY;
+    memcpy(&new_word, &icmp, 2);
+    icmp.checksum = checksum_update(icmp.checksum, old_word, new_word);
+    // A new source different from the pinged multicast group changes the sum
+    if (ip6->destination[0] == 0xff) {
+        icmp.checksum = 0;
+        memcpy(packet + sizeof(*reply), &icmp, sizeof(icmp));
+        icmp.checksum = icmpv6_checksum(reply, packet + sizeof(*reply), message_len);
+    }
+    memcpy(packet + sizeof(*reply), &icmp, sizeof(icmp));
+
+    int output_interface = send_local_packet(packet, numbytes);
+    if (output_interface < 0) {
+        printf("[Iface %d] No route back to the source, could not send Echo Reply\n", tty);
+        return;
+    }
+    printf("[Iface %d] Sent ICMPv6 Echo Reply out interface %d\n", tty, output_interface);
+}
+
+// ============================================================================
+// NEIGHBOR LIVENESS
+// ============================================================================
+
+static const char *neighbor_state_names[] = { "down", "init", "up" };
+
+/**
+ * Queue a hello ahead of everything on an interface. A bonded interface's
+ * sending thread can be blocked for a whole frame time on one busy member,
+ * so its hellos go straight to every member with room instead, keeping
+ * idle members live.
+ */
+static void queue_hello(int iface, const struct hello_frame *hello, int numbytes) {
+    if (bond_members(iface) == 1 ||
+        atomic_load_explicit(&link_down[iface], memory_order_relaxed)) {
+        enqueue_send(iface, (const char *)hello, numbytes, 1);
+        return;
+    }
+    if (bond_write_all(iface, (char *)hello, numbytes) > 0) {
+        counter_add(iface, CTR_TX_PACKETS, 1);
+        counter_add(iface, CTR_TX_BYTES, numbytes);
+    }
+}
+
+/**
+ * Send a hello ahead of everything queued on an interface, with timestamps
+ * for the neighbor's round trip samples when link costs are on
+ */
+void send_hello(int iface, enum neighbor_state state) {
+    struct hello_frame hello;
+    hello.type = HELLO_TYPE;
+    hello.state = state;
+    hello.multiplier = hello_multiplier;
+    hello.reserved = 0;
+    hello.interval_ms = htons(hello_interval_ms);
+    if (link_rate_bps == 0) {
+        queue_hello(iface, &hello, HELLO_SHORT_SIZE);
+        return;
+    }
+
+    uint64_t now = monotonic_ms();
+    pthread_mutex_lock(&liveness_lock);
+    const neighbor_t *n = &neighbors[iface];
+    uint64_t held_ms = now - n->peer_rx_at_ms;
+    hello.tx_ms = htons((uint16_t)now);
+    hello.echo_ms = htons(n->peer_tx_ms);
+    hello.echo_hold_ms = htons(n->peer_rx_at_ms == 0 || held_ms >= HELLO_NO_ECHO ?
+                               HELLO_NO_ECHO : (uint16_t)held_ms);
+    pthread_mutex_unlock(&liveness_lock);
+    queue_hello(iface, &hello, sizeof(hello));
+}
+
+/**
+ * Take a round trip sample from the echo in a neighbor's hello, and keep
+ * the neighbor's own timestamp to echo back. Each side only compares its
+ * own clock readings, so the clocks need not agree.
+ * Caller must hold liveness_lock
+ */
+void sample_round_trip(neighbor_t *n, const struct hello_frame *hello, uint64_t now) {
+    n->peer_tx_ms = ntohs(hello->tx_ms);
+    n->peer_rx_at_ms = now;
+    uint16_t hold_ms = ntohs(hello->echo_hold_ms);
+    uint16_t elapsed_ms = (uint16_t)now - ntohs(hello->echo_ms);
+    if (hold_ms == HELLO_NO_ECHO || hold_ms > elapsed_ms) {
+        return;
+    }
+    // Smoothed with a gain of 1/8, as TCP does its round trip time
+    uint32_t sample_us = (uint32_t)(elapsed_ms - hold_ms) * 1000;
+    n->srtt_us = n->srtt_us == 0 ? sample_us : n->srtt_us - n->srtt_us / 8 + sample_us / 8;
+}
+
+/**
+ * Track runs of liveness ticks in which bytes kept arriving, and take the
+ * line rate from each run long enough. Only a saturated line sends back to
+ * back, so the highest rate seen is kept. This is the rate towards us,
+ * taken as the rate of the link both ways.
+ * Caller must hold liveness_lock
+ */
+void sample_line_rate(neighbor_t *n, unsigned long new_bytes, uint64_t now) {
+    if (new_bytes == 0) {
+        n->busy_since_ms = 0;
+        return;
+    }
+    if (n->busy_since_ms == 0) {
+        // The bytes may have started arriving anywhere in the last tick
+        n->busy_since_ms = now;
+        n->busy_bytes = 0;
+        return;
+    }
+    n->busy_bytes += new_bytes;
+    uint64_t busy_ms = now - n->busy_since_ms;
+    if (busy_ms >= COST_RATE_WINDOW_MS) {
+        uint64_t rate = (uint64_t)n->busy_bytes * 8 * 1000 / busy_ms;
+        if (rate > n->rate_bps) {
+            n->rate_bps = rate > UINT32_MAX ? UINT32_MAX : rate;
+        }
+        n->busy_since_ms = now;
+        n->busy_bytes = 0;
+    }
+}
+
+/**
+ * Cost of the link to a neighbor from what has been measured so far, the
+ * configured line rate standing in until a rate is seen
+ */
+uint32_t measure_link_cost(const neighbor_t *n) {
+    uint64_t rate = n->rate_bps > 0 ? n->rate_bps : link_rate_bps;
+    uint64_t delay_us = n->srtt_us / 2 + (uint64_t)COST_REF_BYTES * 8 * 1000000 / rate;
+    uint64_t cost = (delay_us + COST_UNIT_MS * 500) / (COST_UNIT_MS * 1000);
+    return cost < 1 ? 1 : cost > COST_MAX ? COST_MAX : (uint32_t)cost;
+}
+
+/**
+ * Metric added to routes learned over an interface, 1 without link costs
+ */
+uint32_t link_cost(int iface) {
+    if (link_rate_bps == 0) {
+        return 1;
+    }
+    pthread_mutex_lock(&liveness_lock);
+    uint32_t cost = neighbors[iface].cost;
+    pthread_mutex_unlock(&liveness_lock);
+    return cost;
+}
+
+/**
+ * Apply a link's new cost to the routes learned over it, as its next
+ * advertisement would: a route only through the link moves by the change,
+ * and a route with other paths drops the link's paths if it got dearer or
+ * keeps only them if it got cheaper
+ */
+void reprice_link_routes(int iface, uint32_t old_cost, uint32_t new_cost) {
+    int changed = 0;
+    pthread_mutex_lock(&routing_lock);
+    for (int i = num_routes - 1; i >= 0; i--) {
+        struct route_entry *route = &routing_table[i];
+        if (route->is_direct || route->is_static) {
+            continue;
+        }
+        int via[MAX_PATHS];
+        int num_via = 0;
+        for (int p = 0; p < route->num_gateways; p++) {
+            via[p] = route->ifaces[p] == iface;
+            num_via += via[p];
+        }
+        if (num_via == 0) {
+            continue;
+        }
+        int cheaper = new_cost < old_cost;
+        int repriced = 0;
+        int num_paths = route->num_gateways;  // Before removal lowers it
+        if (num_via < num_paths) {
+            // Removal moves the last path into the hole, so walk backwards
+            // (remove_path bumps the generation itself)
+            for (int p = num_paths - 1; p >= 0; p--) {
+                if (via[p] != cheaper) {
+                    remove_path(i, p);
+                    repriced = 1;
+                }
+            }
+        }
+        if (num_via == num_paths || cheaper) {
+            uint64_t metric = (uint64_t)route->metric + new_cost;
+            metric = metric >= (uint64_t)old_cost + new_cost ? metric - old_cost : new_cost;
+            metric = metric > UINT32_MAX ? UINT32_MAX : metric;
+            if (metric != route->metric) {
+                route->metric = (uint32_t)metric;
+                routing_generation++;
+                repriced = 1;
+            }
+        }
+        changed += repriced;
+    }
+    pthread_mutex_unlock(&routing_lock);
+    printf("[Liveness] Link cost on interface %d is now %u (was %u), repriced %d route(s)\n",
+           iface, new_cost, old_cost, changed);
+}
+
+/**
+ * Remove every learned path through the neighbor on an interface, so traffic
+ * moves to other paths or is refused instead of being blackholed
+ */
+void invalidate_neighbor_routes(int iface) {
+    int removed = 0;
+    pthread_mutex_lock(&routing_lock);
+    advert_seen[iface].heard = 0;  // It may come back restarted, sequence and all
+    // Removal moves the last route or path into the hole, so walk backwards
+    for (int i = num_routes - 1; i >= 0; i--) {
+        if (routing_table[i].is_direct || routing_table[i].is_static) {
+            continue;
+        }
+        for (int p = routing_table[i].num_gateways - 1; p >= 0; p--) {
+            if (routing_table[i].ifaces[p] == iface) {
+                int last_path = routing_table[i].num_gateways == 1;
+                remove_path(i, p);
+                removed++;
+                if (last_path) {
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&routing_lock);
+    printf("[Liveness] Neighbor on interface %d is down, removed %d path(s)\n", iface, removed);
+}
+
+/**
+ * Handle a neighbor's hello, moving the session towards up once each side
+ * has seen the other's hellos (three-way, as in BFD)
+ */
+void handle_hello(int tty, const void *vdata, int numbytes) {
+    if (hello_interval_ms == 0 ||
+        (numbytes != (int)HELLO_SHORT_SIZE && numbytes != (int)sizeof(struct hello_frame))) {
+        return;
+    }
+    struct hello_frame hello;
+    memcpy(&hello, vdata, numbytes);
+    uint64_t now = monotonic_ms();
+
+    pthread_mutex_lock(&liveness_lock);
+    neighbor_t *n = &neighbors[tty];
+    enum neighbor_state old_state = n->state;
+    n->detect_ms = (uint64_t)ntohs(hello.interval_ms) * (hello.multiplier ? hello.multiplier : 1);
+    n->last_rx_ms = now;
+    if (link_rate_bps > 0 && numbytes == (int)sizeof(hello)) {
+        sample_round_trip(n, &hello, now);
+    }
+    if (hello.state == NEIGHBOR_DOWN) {
+        n->state = n->state == NEIGHBOR_UP ? NEIGHBOR_DOWN : NEIGHBOR_INIT;
+    } else if (n->state != NEIGHBOR_UP) {
+        n->state = hello.state == NEIGHBOR_INIT || n->state == NEIGHBOR_INIT ?
+                   NEIGHBOR_UP : NEIGHBOR_INIT;
+    }
+    enum neighbor_state new_state = n->state;
+    pthread_mutex_unlock(&liveness_lock);
+
+    if (new_state != old_state) {
+        printf("[Liveness] Neighbor on interface %d is %s\n", tty, neighbor_state_names[new_state]);
+        if (old_state == NEIGHBOR_UP) {
+            invalidate_neighbor_routes(tty);
+        }
+    }
+}
+
+/**
+ * Send the hellos that are due and declare a neighbor down when nothing at
+ * all has arrived from it for its detection time. Any received byte
+ * counts, so a long frame on a slow link does not look like silence.
+ * With link costs on, also move each link's cost to what was measured once
+ * that differs by more than COST_CHANGE_PERCENT and the last change has
+ * been held for COST_HOLD_MS, so metrics do not flap with every sample.
+ */
+void check_neighbors(uint64_t now) {
+    for (int i = 0; i < num_addrs; i++) {
+        // Read before locking, slipnet holds its lock while handing us hellos
+        unsigned long bytes = bond_bytes_received(i);
+        int down = atomic_load_explicit(&link_down[i], memory_order_relaxed);
+
+        pthread_mutex_lock(&liveness_lock);
+        neighbor_t *n = &neighbors[i];
+        if (bytes != n->last_bytes && !down) {
+            n->last_rx_ms = now;
+        }
+        uint32_t old_cost = n->cost;
+        if (link_rate_bps > 0 && !down) {
+            sample_line_rate(n, bytes - n->last_bytes, now);
+            uint32_t cost = measure_link_cost(n);
+            uint32_t change = cost > n->cost ? cost - n->cost : n->cost - cost;
+            if ((uint64_t)change * 100 > (uint64_t)n->cost * COST_CHANGE_PERCENT &&
+                now - n->cost_changed_ms >= COST_HOLD_MS) {
+                n->cost = cost;
+                n->cost_changed_ms = now;
+            }
+        }
+        uint32_t new_cost = n->cost;
+        n->last_bytes = bytes;
+        int timed_out = n->state != NEIGHBOR_DOWN && now - n->last_rx_ms > n->detect_ms;
+        int was_up = n->state == NEIGHBOR_UP;
+        if (timed_out) {
+            n->state = NEIGHBOR_DOWN;
+        }
+        int send = now >= n->next_tx_ms;
+        if (send) {
+            n->next_tx_ms = now + hello_interval_ms;
+        }
+        enum neighbor_state state = n->state;
+        pthread_mutex_unlock(&liveness_lock);
+
+        if (timed_out) {
+            printf("[Liveness] Neighbor on interface %d timed out\n", i);
+            if (was_up) {
+                invalidate_neighbor_routes(i);
+            }
+        }
+        if (new_cost != old_cost) {
+            reprice_link_routes(i, old_cost, new_cost);
+        }
+        if (send) {
+            send_hello(i, state);
+        }
+    }
+}
+
+/**
+ * Liveness thread - checks neighbors and bond members every tick
+ */
+void *liveness_thread(void *arg) {
+    (void)arg;
+    struct timespec tick = { 0, LIVENESS_TICK_MS * 1000000L };
+
+    while (1) {
+        nanosleep(&tick, NULL);
+        uint64_t now = monotonic_ms();
+        if (hello_interval_ms > 0) {
+            check_neighbors(now);
+        }
+        bond_check(now, (uint64_t)hello_interval_ms * hello_multiplier);
+    }
+    return NULL;
+}
+
+// ============================================================================
+// PACKET FILTERS
+// ============================================================================
+
+/**
+ * Whether any rules filter packets in direction dir, checked without the
+ * lock so unfiltered traffic never takes it
+ */
+int acl_in_use(enum acl_direction dir) {
+    return atomic_load_explicit(&acl_active_rules[dir], memory_order_relaxed) > 0;
+}
+
+/**
+ * Whether the active filter for dir denies a packet on iface, counting a hit
+ * on the rule that matched. Packets no rule matches are permitted.
+ * Caller must hold acl_lock for reading
+ */
+int acl_denies(enum acl_direction dir, const char *data, int numbytes, int iface) {
+    const acl_table_t *table = &acl_tables[dir];
+    if (table->set == NULL) {
+        return 0;
+    }
+
+    const struct ipv6_header *ip6 = (const struct ipv6_header *)data;
+    struct acl_packet pkt;
+    memcpy(&pkt.src, ip6->source, sizeof(pkt.src));
+    memcpy(&pkt.dst, ip6->destination, sizeof(pkt.dst));
+    pkt.iface = iface;
+    pkt.proto = ip6->next_header;
+    pkt.has_ports = (ip6->next_header == IPPROTO_TCP || ip6->next_header == IPPROTO_UDP) &&
+                    numbytes >= (int)sizeof(struct ipv6_header) + 4;
+    pkt.sport = 0;
+    pkt.dport = 0;
+    if (pkt.has_ports) {
+        const uint8_t *ports = (const uint8_t *)data + sizeof(struct ipv6_header);
+        pkt.sport = (uint16_t)(ports[0] << 8 | ports[1]);
+        pkt.dport = (uint16_t)(ports[2] << 8 | ports[3]);
+    }
+
+    int rule = acl_classify(table->set, &pkt);
+    if (rule < 0) {
+        return 0;
+    }
+    atomic_fetch_add_explicit(table->hits[rule], 1, memory_order_relaxed);
+    return table->actions[rule] == ACL_DENY;
+}
+
+/**
+ * Drop a packet a filter denied, counted on the interface it arrived on
+ */
+void drop_filtered(int tty, const char *data, int numbytes, enum acl_direction dir) {
+    PKT_LOG("[Iface %d] Denied by %s filter, dropping packet\n", tty,
+            dir == ACL_IN ? "ingress" : "egress");
+    counter_add(tty, CTR_DROP_FILTERED, 1);
+    if (dir == ACL_IN) {
+        PROBE(classify, tty, numbytes, ((const struct ipv6_header *)data)->source,
+              ((const struct ipv6_header *)data)->destination, CTR_DROP_FILTERED);
+    }
+    send_icmp_error(tty, data, numbytes, ICMPV6_DEST_UNREACHABLE, 1);  // Administratively prohibited
+}
+
+/**
+ * Check one packet against the filter for dir, dropping it if denied
+ * Returns 1 if the packet was dropped
+ */
+int filter_packet(enum acl_direction dir, int tty, const char *data, int numbytes, int iface) {
+    if (!acl_in_use(dir)) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&acl_lock);
+    int denied = acl_denies(dir, data, numbytes, iface);
+    pthread_rwlock_unlock(&acl_lock);
+    if (denied) {
+        drop_filtered(tty, data, numbytes, dir);
+    }
+    return denied;
+}
+
+/**
+ * Check a batch against the filter for dir under one acl_lock acquisition,
+ * dropping denied packets. pick[n] is the slot of the n-th packet and
+ * ifaces[n] the interface it is filtered on; both are compacted in order.
+ * Returns the number of packets kept
+ */
+int filter_batch(enum acl_direction dir, struct pkt_slot **slots, int *pick, int *ifaces,
+                 int count) {
+    if (!acl_in_use(dir)) {
+        return count;
+    }
+    int denied[WORKER_BATCH];
+    int num_denied = 0;
+    int kept = 0;
+    pthread_rwlock_rdlock(&acl_lock);
+    for (int n = 0; n < count; n++) {
+        struct pkt_slot *slot = slots[pick[n]];
+        if (acl_denies(dir, slot->data, slot->numbytes, ifaces[n])) {
+            denied[num_denied++] = pick[n];
+        } else {
+            pick[kept] = pick[n];
+            ifaces[kept] = ifaces[n];
+            kept++;
+        }
+    }
+    pthread_rwlock_unlock(&acl_lock);
+
+    for (int n = 0; n < num_denied; n++) {
+        struct pkt_slot *slot = slots[denied[n]];
+        drop_filtered(slot->tty, slot->data, slot->numbytes, dir);
+    }
+    return kept;
+}
+
+// ============================================================================
+// SOURCE POLICERS
+// ============================================================================
+
+/**
+ * Home slot of a source prefix on an ingress interface in policers
+ */
+uint32_t policer_hash(int tty, const struct in6_addr *source, int prefix_len) {
+    uint64_t high, low;
+    memcpy(&high, source->s6_addr, 8);
+    memcpy(&low, source->s6_addr + 8, 8);
+    uint64_t key = high ^ (low * 0xff51afd7ed558ccdULL) ^ ((uint64_t)tty << 8 | prefix_len);
+    key ^= key >> 32;  // Fold the last bytes down, the multiply only carries upward
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (POLICER_TABLE_SIZE - 1);
+}
+
+/**
+ * Find or claim the bucket of a source prefix on an ingress interface.
+ * Slots are never emptied, so a lookup stops at the key, an empty slot, or
+ * after POLICER_PROBES slots. If none of those is free the least recently
+ * used is reclaimed: a bucket idle that long has usually refilled anyway.
+ * New buckets start full.
+ * Caller must hold policer_lock
+ */
+policer_t *policer_bucket(int tty, const struct in6_addr *source, int prefix_len, uint64_t now) {
+    uint32_t slot = policer_hash(tty, source, prefix_len);
+    policer_t *oldest = NULL;
+    for (int probe = 0; probe < POLICER_PROBES; probe++) {
+        policer_t *bucket = &policers[(slot + probe) & (POLICER_TABLE_SIZE - 1)];
+        if (bucket->tty == tty && bucket->prefix_len == prefix_len &&
+            memcmp(&bucket->source, source, sizeof(*source)) == 0) {
+            return bucket;
+        }
+        if (bucket->tty < 0) {
+            oldest = bucket;
+            break;
+        }
+        if (oldest == NULL || bucket->last_ms < oldest->last_ms) {
+            oldest = bucket;
+        }
+    }
+    oldest->source = *source;
+    oldest->tty = tty;
+    oldest->prefix_len = prefix_len;
+    oldest->tokens = (uint64_t)policer_config[tty].burst * 1000;
+    oldest->last_ms = now;
+    return oldest;
+}
+
+/**
+ * Charge a packet that arrived on tty to its source's bucket
+ * Returns 1 if it conforms, 0 if it is over its rate
+ * Caller must hold policer_lock
+ */
+int policer_conforms(int tty, const char *data, int numbytes, uint64_t now) {
+    const policer_config_t *config = &policer_config[tty];
+    if (config->prefix_len < 0) {
+        return 1;
+    }
+    struct in6_addr source;
+    mask_prefix((const struct in6_addr *)((const struct ipv6_header *)data)->source,
+                config->prefix_len, &source);
+    policer_t *bucket = policer_bucket(tty, &source, config->prefix_len, now);
+
+    // Refill at rate bytes per second, up to burst
+    bucket->tokens += (now - bucket->last_ms) * config->rate;
+    if (bucket->tokens > (uint64_t)config->burst * 1000) {
+        bucket->tokens = (uint64_t)config->burst * 1000;
+    }
+    bucket->last_ms = now;
+    if (bucket->tokens < (uint64_t)numbytes * 1000) {
+        return 0;
+    }
+    bucket->tokens -= (uint64_t)numbytes * 1000;
+    return 1;
+}
+
+/**
+ * Police one forwarded packet, dropping it if its source is over its rate
+ * Returns 1 if the packet was dropped
+ */
+int police_packet(int tty, const char *data, int numbytes) {
+    if (atomic_load_explicit(&policed_ifaces, memory_order_relaxed) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&policer_lock);
+    int conforms = policer_conforms(tty, data, numbytes, monotonic_ms());
+    pthread_mutex_unlock(&policer_lock);
+    if (!conforms) {
+        PKT_LOG("[Iface %d] Source over its policed rate, dropping packet\n", tty);
+        counter_add(tty, CTR_DROP_POLICED, 1);
+    }
+    return !conforms;
+}
+
+/**
+ * Police a batch of forwarded packets under one policer_lock acquisition,
+ * dropping those over their rate. pick[n] is the slot of the n-th packet
+ * and ifaces[n] its output interface; both are compacted in order.
+ * Returns the number of packets kept
+ */
+int police_batch(struct pkt_slot **slots, int *pick, int *ifaces, int count) {
+    if (atomic_load_explicit(&policed_ifaces, memory_order_relaxed) == 0) {
+        return count;
+    }
+    int kept = 0;
+    uint64_t now = monotonic_ms();
+    pthread_mutex_lock(&policer_lock);
+    for (int n = 0; n < count; n++) {
+        struct pkt_slot *slot = slots[pick[n]];
+        if (policer_conforms(slot->tty, slot->data, slot->numbytes, now)) {
+            pick[kept] = pick[n];
+            ifaces[kept] = ifaces[n];
+            kept++;
+        } else {
+            PKT_LOG("[Iface %d] Source over its policed rate, dropping packet\n", slot->tty);
+            counter_add(slot->tty, CTR_DROP_POLICED, 1);
+        }
+    }
+    pthread_mutex_unlock(&policer_lock);
+    return kept;
+}
+
+/**
+ * Set the policer of an ingress interface, prefix_len -1 turns it off.
+ * Buckets keyed by an earlier setting are left to be reclaimed.
+ */
+void configure_policer(int tty, int prefix_len, uint32_t rate, uint32_t burst) {
+    pthread_mutex_lock(&policer_lock);
+    int was_policed = policer_config[tty].prefix_len >= 0;
+    policer_config[tty].prefix_len = prefix_len;
+    policer_config[tty].rate = rate;
+    policer_config[tty].burst = burst;
+    atomic_fetch_add(&policed_ifaces, (prefix_len >= 0) - was_policed);
+    pthread_mutex_unlock(&policer_lock);
+}
+
+/**
+ * Mark every interface unpoliced and every bucket empty
+ */
+void initialize_policers() {
+    for (int i = 0; i < num_addrs; i++) {
+        policer_config[i].prefix_len = -1;
+    }
+    for (int b = 0; b < POLICER_TABLE_SIZE; b++) {
+        policers[b].tty = -1;
+    }
+}
+
+// ============================================================================
+// FLOW TELEMETRY
+// ============================================================================
+
+/**
+ * Count a forwarded packet in its flow
+ */
+void sample_flow(int tty, int output_interface, const char *data, int numbytes) {
+    const struct ipv6_header *ip6 = (const struct ipv6_header *)data;
+    struct flow_key key;
+    memcpy(&key.src, ip6->source, sizeof(key.src));
+    memcpy(&key.dst, ip6->destination, sizeof(key.dst));
+    key.flow_label = ((ip6->class_lo_flow_hi & 0x0f) << 16) | ntohs(ip6->flow_lo);
+    key.next_header = ip6->next_header;
+    flows_record(&key, tty, output_interface, numbytes, monotonic_ms());
+}
+
+/**
+ * Sample a batch of packets about to be sent, pick[n] is the slot of the
+ * n-th packet and ifaces[n] its output interface
+ */
+void sample_batch(struct pkt_slot **slots, const int *pick, const int *ifaces, int count) {
+    for (int n = 0; n < count; n++) {
+        if (flows_should_sample()) {
+            struct pkt_slot *slot = slots[pick[n]];
+            sample_flow(slot->tty, ifaces[n], slot->data, slot->numbytes);
+        }
+    }
+}
+
+/**
+ * Flow export thread - exports aged out flows once a second
+ */
+void *flow_export_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(1);
+        flows_export(monotonic_ms(), 0);
+    }
+    return NULL;
+}
+
+// ============================================================================
+// NETWORK PACKET HANDLING
+// ============================================================================
+
+/**
+ * Process received routing protocol packet from the neighbor on tty, adding
+ * the cost of its link to every advertised metric
+ */
+void process_routing_packet(int tty, const char *data, int numbytes,
+                            const struct in6_addr *src_addr) {
+    char src_str[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, src_addr, src_str, sizeof(src_str));
+
+    printf("[Recv] Received a routing protocol packet from %s\n", src_str);
+
+    // Validate packet size
+    size_t min_size = sizeof(struct ipv6_header) + sizeof(struct routing_packet_header);
+    if (numbytes < (int)min_size) {
+        printf("[Recv] Routing packet too short, dropping packet from %s\n", src_str);
+        return;
+    }
+
+    // Parse routing packet header
+    struct routing_packet_header rp_hdr;
+    memcpy(&rp_hdr, data + sizeof(struct ipv6_header), sizeof(rp_hdr));
+    if (rp_hdr.version != ROUTING_VERSION) {
+        printf("[Recv] Unsupported routing packet version %u, dropping packet from %s\n",
+               rp_hdr.version, src_str);
+        return;
+    }
+    uint16_t num_advertised = ntohs(rp_hdr.num_routes);
+    uint16_t sequence = ntohs(rp_hdr.sequence);
+    if (rp_hdr.segment >= rp_hdr.num_segments) {
+        printf("[Recv] Segment %u of %u is inconsistent, dropping packet from %s\n",
+               rp_hdr.segment + 1, rp_hdr.num_segments, src_str);
+        return;
+    }
+    if (num_advertised > (numbytes - min_size) / 2) {  // Each route is 2 bytes or more
+        printf("[Recv] %u routes cannot fit in %d bytes, dropping packet from %s\n",
+               num_advertised, (int)(numbytes - min_size), src_str);
+        return;
+    }
+
+    printf("[Recv] Processing %u advertised routes (segment %u of %u) from %s\n",
+           num_advertised, rp_hdr.segment + 1, rp_hdr.num_segments, src_str);
+
+    // Decode the whole segment first, so it is applied in one go
+    uint32_t cost = link_cost(tty);
+    struct route_update updates[MAX_ROUTING_PAYLOAD / 2];  // Each route is 2 bytes or more
+    int num_updates = 0;
+    const uint8_t *in = (const uint8_t *)data + min_size;
+    const uint8_t *end = (const uint8_t *)data + numbytes;
+    for (uint16_t i = 0; i < num_advertised; i++) {
+        struct route_update *update = &updates[num_updates];
+        int len = decode_route(in, end, &update->prefix, &update->prefix_len, &update->metric);
+        if (len < 0) {
+            // Nothing in a segment that decodes wrongly can be trusted
+            printf("[Recv] Malformed route %u, dropping packet from %s\n", i, src_str);
+            return;
+        }
+        in += len;
+        update->metric = update->metric > UINT32_MAX - cost ? UINT32_MAX : update->metric + cost;
+        num_updates++;
+    }
+
+    // Apply it under one routing_lock acquisition, logging after
+    pthread_mutex_lock(&routing_lock);
+    advert_seen_t *seen = &advert_seen[tty];
+    uint64_t now = monotonic_ms();
+    if (seen->heard && (int16_t)(sequence - seen->sequence) < 0 &&
+        now - seen->heard_ms < ADVERT_STALE_MS) {
+        uint16_t newest = seen->sequence;
+        pthread_mutex_unlock(&routing_lock);
+        printf("[Recv] Segment of sequence %u is older than %u, dropping packet from %s\n",
+               sequence, newest, src_str);
+        return;
+    }
+    seen->heard = 1;
+    seen->sequence = sequence;
+    seen->heard_ms = now;
+    for (int u = 0; u < num_updates; u++) {
+        update_routing_table(&updates[u], src_addr, 0);
+        PROBE(route_change, updates[u].change, &updates[u].prefix, updates[u].prefix_len,
+              src_addr, updates[u].metric);
+    }
+    pthread_mutex_unlock(&routing_lock);
+
+    int changed = 0;
+    for (int u = 0; u < num_updates; u++) {
+        report_route_update(&updates[u], src_str);
+        changed += updates[u].change != ROUTE_UNCHANGED;
+    }
+    printf("[Recv] Applied %d routes from %s, %d changed\n", num_updates, src_str, changed);
+}
+
+/**
+ * Forward packet to next hop
+ */
+void forward_packet(const char *data, int numbytes, int tty, const struct ipv6_header *ip6) {
+    char src_str[INET6_ADDRSTRLEN];
+    char dst_str[INET6_ADDRSTRLEN];
+    if (verbose) {
+        inet_ntop(AF_INET6, ip6->source, src_str, sizeof(src_str));
+        inet_ntop(AF_INET6, ip6->destination, dst_str, sizeof(dst_str));
+    }
+
+    PKT_LOG("[Iface %d] Received packet not for this router, attempting to forward\n", tty);
+
+    // Check hop limit
+    if (ip6->hop_limit <= 1) {
+        PKT_LOG("[Iface %d] Hop limit reached 0, dropping packet from %s\n", tty, src_str);
+        counter_add(tty, CTR_DROP_HOP_LIMIT, 1);
+        send_icmp_error(tty, data, numbytes, ICMPV6_TIME_EXCEEDED, 0);  // Hop limit exceeded
+        return;
+    }
+
+    // Look up route in routing table
+    struct in6_addr dst_addr, next_hop;
+    memcpy(&dst_addr, ip6->destination, sizeof(dst_addr));
+
+    int route_idx = lookup_route(&dst_addr, flow_hash(ip6), &next_hop);
+    PROBE(fib_lookup, tty, numbytes, ip6->source, ip6->destination, route_idx);
+    if (route_idx == -1) {
+        PKT_LOG("[Iface %d] No route found for destination %s, dropping packet\n", tty, dst_str);
+        counter_add(tty, CTR_DROP_NO_ROUTE, 1);
+        send_icmp_error(tty, data, numbytes, ICMPV6_DEST_UNREACHABLE, 0);  // No route
+        return;
+    }
+
+    char nexthop_str[INET6_ADDRSTRLEN];
+    if (verbose) {
+        inet_ntop(AF_INET6, &next_hop, nexthop_str, sizeof(nexthop_str));
+    }
+    PKT_LOG("[Iface %d] Found route to %s via gateway %s\n", tty, dst_str, nexthop_str);
+
+    // Find which interface can reach the next hop
+    int output_interface = find_output_interface(&next_hop);
+    if (output_interface == -1) {
+        PKT_LOG("[Iface %d] Cannot find output interface for gateway %s, dropping packet\n", tty, nexthop_str);
+        counter_add(tty, CTR_DROP_NO_INTERFACE, 1);
+        send_icmp_error(tty, data, numbytes, ICMPV6_DEST_UNREACHABLE, 3);  // Address unreachable
+        return;
+    }
+
+    if (filter_packet(ACL_OUT, tty, data, numbytes, output_interface) ||
+        police_packet(tty, data, numbytes)) {
+        return;
+    }
+
+    PKT_LOG("[Iface %d] Forwarding out interface %d\n", tty, output_interface);
+    if (flows_should_sample()) {
+        sample_flow(tty, output_interface, data, numbytes);
+    }
+
+    // Make a copy of the packet for forwarding, queue_send copies it again
+    char packet_copy[MAX_SLIP_SIZE];
+    memcpy(packet_copy, data, numbytes);
+
+    // Modify hop limit in the copy
+    struct ipv6_header *ip6_copy = (struct ipv6_header *) packet_copy;
+    ip6_copy->hop_limit = ip6->hop_limit - 1;
+
+    PKT_LOG("[Iface %d] Forwarding packet with decremented hop limit %d\n", tty, ip6_copy->hop_limit);
+    if (verbose) {
+        print_packet("Forwarding packet", packet_copy, numbytes);
+    }
+
+    // Send packet out the correct interface
+    queue_send(output_interface, packet_copy, numbytes);
+}
+
+/**
+ * Handle a packet addressed to this router
+ */
+void deliver_local(int tty, const char *data, int numbytes, const struct ipv6_header *ip6) {
+    PKT_LOG("[Iface %d] Packet is for this router, processing locally\n", tty);
+
+    if (ip6->next_header == ROUTING_PROTOCOL) {
+        // Routing protocol packet
+        struct in6_addr src_addr;
+        memcpy(&src_addr, ip6->source, sizeof(src_addr));
+        process_routing_packet(tty, data, numbytes, &src_addr);
+    } else if (ip6->next_header == ICMPV6_PROTOCOL) {
+        // ICMPv6, answer pings
+        process_icmp_packet(tty, data, numbytes);
+    } else if (verbose) {
+        // Other protocol - just acknowledge receipt
+        char src_str[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, ip6->source, src_str, sizeof(src_str));
+        printf("[Iface %d] Packet is not a routing or ICMPv6 packet, dropping packet from src=%s\n", 
+               tty, src_str);
+    }
+}
+
+/**
+ * Main packet processing function - handles all incoming packets
+ */
+static void data_handler(int tty, const void *vdata, int numbytes) {
+    const char *data = (const char *)vdata;
+
+    // Validate IPv6 header size
+    if (numbytes < (int)sizeof(struct ipv6_header)) {
+        PKT_LOG("[Iface %d] Received packet too short for IPv6 header, dropping packet\n", tty);
+        counter_add(tty, CTR_DROP_TOO_SHORT, 1);
+        PROBE(classify, tty, numbytes, NULL, NULL, CTR_DROP_TOO_SHORT);
+        return;
+    }
+
+    struct ipv6_header *ip6 = (struct ipv6_header *)data;
+
+    if (filter_packet(ACL_IN, tty, data, numbytes, tty)) {
+        return;
+    }
+
+    // Print packet information
+    if (verbose) {
+        char src_str[INET6_ADDRSTRLEN];
+        char dst_str[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, ip6->source, src_str, sizeof(src_str));
+        inet_ntop(AF_INET6, ip6->destination, dst_str, sizeof(dst_str));
+        printf("[Iface %d] Parsed IPv6 packet - src=%s, dst=%s\n", tty, src_str, dst_str);
+    }
+
+    // Check if packet is for this router
+    if (is_packet_for_router(ip6)) {
+        PROBE(classify, tty, numbytes, ip6->source, ip6->destination, PROBE_LOCAL);
+        deliver_local(tty, data, numbytes, ip6);
+    } else {
+        // Forward packet
+        PROBE(classify, tty, numbytes, ip6->source, ip6->destination, PROBE_FORWARD);
+        forward_packet(data, numbytes, tty, ip6);
+    }
+}
+
+// ============================================================================
+// FORWARDING WORKERS
+// ============================================================================
+
+/**
+ * Handle a batch of packets one stage at a time: validation, ingress
+ * filter and local delivery, hop limit check, FIB lookup, then egress
+ * filter, policing, flow sampling, rewrite and enqueue. Each
+ * stage runs over the whole batch so its code and data stay in cache, and
+ * the whole batch is looked up under a single routing_lock acquisition.
+ * Packets are rewritten in place in their queue slots.
+ */
+void process_batch(struct pkt_slot **slots, int count) {
+    int transit[WORKER_BATCH];          /* Slots still being forwarded */
+    int ifaces[WORKER_BATCH];           /* Interface each is filtered on */
+    int num_transit = 0;
+
+    // Stage 1: header validation, ingress filter and local delivery
+    for (int k = 0; k < count; k++) {
+        struct pkt_slot *slot = slots[k];
+        if (slot->numbytes < (int)sizeof(struct ipv6_header)) {
+            PKT_LOG("[Iface %d] Received packet too short for IPv6 header, dropping packet\n", slot->tty);
+            counter_add(slot->tty, CTR_DROP_TOO_SHORT, 1);
+            PROBE(classify, slot->tty, slot->numbytes, NULL, NULL, CTR_DROP_TOO_SHORT);
+            continue;
+        }
+        ifaces[num_transit] = slot->tty;
+        transit[num_transit++] = k;
+    }
+    num_transit = filter_batch(ACL_IN, slots, transit, ifaces, num_transit);
+    int kept = 0;
+    for (int t = 0; t < num_transit; t++) {
+        struct pkt_slot *slot = slots[transit[t]];
+        const struct ipv6_header *ip6 = (const struct ipv6_header *)slot->data;
+        if (is_packet_for_router(ip6)) {
+            PROBE(classify, slot->tty, slot->numbytes, ip6->source, ip6->destination, PROBE_LOCAL);
+            deliver_local(slot->tty, slot->data, slot->numbytes, ip6);
+            continue;
+        }
+        PROBE(classify, slot->tty, slot->numbytes, ip6->source, ip6->destination, PROBE_FORWARD);
+        transit[kept++] = transit[t];
+    }
+    num_transit = kept;
+
+    // Stage 2: hop limit check
+    kept = 0;
+    for (int t = 0; t < num_transit; t++) {
+        struct pkt_slot *slot = slots[transit[t]];
+        const struct ipv6_header *ip6 = (const struct ipv6_header *)slot->data;
+        if (ip6->hop_limit <= 1) {
+            PKT_LOG("[Iface %d] Hop limit reached 0, dropping packet\n", slot->tty);
+            counter_add(slot->tty, CTR_DROP_HOP_LIMIT, 1);
+            send_icmp_error(slot->tty, slot->data, slot->numbytes, ICMPV6_TIME_EXCEEDED, 0);
+            continue;
+        }
+        transit[kept++] = transit[t];
+    }
+    num_transit = kept;
+
+    // Stage 3: FIB lookup, prefetching hash buckets of the longest prefix
+    // length in use then routes. Misses fall back to the shorter lengths.
+    struct in6_addr prefixes[WORKER_BATCH];
+    uint32_t buckets[WORKER_BATCH];
+    uint32_t hashes[WORKER_BATCH];
+    int routes[WORKER_BATCH];
+    struct in6_addr next_hops[WORKER_BATCH];
+    pthread_mutex_lock(&routing_lock);
+    int longest = num_fib_lengths > 0 ? fib_lengths[0] : -1;
+    for (int t = 0; t < num_transit; t++) {
+        const struct ipv6_header *ip6 = (const struct ipv6_header *)slots[transit[t]]->data;
+        hashes[t] = flow_hash(ip6);
+        if (longest >= 0) {
+            mask_prefix((const struct in6_addr *)ip6->destination, longest, &prefixes[t]);
+            buckets[t] = fib_bucket(&prefixes[t], longest);
+            __builtin_prefetch(&fib_hash[buckets[t]]);
+        }
+    }
+    for (int t = 0; t < num_transit; t++) {
+        const struct ipv6_header *ip6 = (const struct ipv6_header *)slots[transit[t]]->data;
+        routes[t] = longest < 0 ? -1 : fib_find(&prefixes[t], longest, buckets[t]);
+        if (routes[t] < 0 && num_fib_lengths > 1) {
+            routes[t] = fib_lookup((const struct in6_addr *)ip6->destination, 1);
+        }
+        if (routes[t] >= 0) {
+            __builtin_prefetch(&routing_table[routes[t]]);
+        }
+    }
+    for (int t = 0; t < num_transit; t++) {
+        if (routes[t] >= 0) {
+            struct route_entry *route = &routing_table[routes[t]];
+            next_hops[t] = route->gateways[hashes[t] % route->num_gateways];
+        }
+    }
+    pthread_mutex_unlock(&routing_lock);
+
+    // Stage 4: output interface, egress filter, source policers and flow
+    // sampling, then hop limit rewrite and egress enqueue
+    kept = 0;
+    for (int t = 0; t < num_transit; t++) {
+        struct pkt_slot *slot = slots[transit[t]];
+        PROBE(fib_lookup, slot->tty, slot->numbytes, ((struct ipv6_header *)slot->data)->source,
+              ((struct ipv6_header *)slot->data)->destination, routes[t]);
+        if (routes[t] < 0) {
+            PKT_LOG("[Iface %d] No route found for destination, dropping packet\n", slot->tty);
+            counter_add(slot->tty, CTR_DROP_NO_ROUTE, 1);
+            send_icmp_error(slot->tty, slot->data, slot->numbytes, ICMPV6_DEST_UNREACHABLE, 0);
+            continue;
+        }
+        int output_interface = find_output_interface(&next_hops[t]);
+        if (output_interface == -1) {
+            PKT_LOG("[Iface %d] Cannot find output interface for gateway, dropping packet\n", slot->tty);
+            counter_add(slot->tty, CTR_DROP_NO_INTERFACE, 1);
+            send_icmp_error(slot->tty, slot->data, slot->numbytes, ICMPV6_DEST_UNREACHABLE, 3);
+            continue;
+        }
+        transit[kept] = transit[t];
+        ifaces[kept] = output_interface;
+        kept++;
+    }
+    num_transit = filter_batch(ACL_OUT, slots, transit, ifaces, kept);
+    num_transit = police_batch(slots, transit, ifaces, num_transit);
+    sample_batch(slots, transit, ifaces, num_transit);
+    for (int t = 0; t < num_transit; t++) {
+        struct pkt_slot *slot = slots[transit[t]];
+        int output_interface = ifaces[t];
+        ((struct ipv6_header *)slot->data)->hop_limit--;
+        PKT_LOG("[Iface %d] Forwarding out interface %d\n", slot->tty, output_interface);
+        queue_send(output_interface, slot->data, slot->numbytes);
+    }
+}
+
+/**
+ * Worker thread - handles the packets steered to it, in arrival order
+ */
+void *worker_thread(void *arg) {
+    fwd_worker_t *w = arg;
+    int idle = 0;
+
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        printf("[Worker %ld] Could not pin to core %d\n", (long)(w - workers), w->cpu);
+    }
+#endif
+
+    // Workers count the most, so they claim their blocks before the receive
+    // threads do in case there are not enough for every thread
+    if (counters_map != NULL) {
+        counters_thread_block();
+    }
+
+    while (1) {
+        // Take everything queued, up to a batch
+        struct pkt_slot *slots[WORKER_BATCH];
+        int count = 0;
+        while (count < WORKER_BATCH && (slots[count] = pktq_peek(&w->queue, count)) != NULL) {
+            count++;
+        }
+        if (count > 0) {
+            process_batch(slots, count);
+            pktq_release(&w->queue, count);
+            idle = 0;
+            continue;
+        }
+        if (++idle < WORKER_SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        // Nothing to do for a while, sleep until a receive thread wakes us.
+        // The queue is checked again after announcing sleep, so a packet
+        // pushed in between is never missed. The fence pairs with the one
+        // in steer_packet: without both, each side could read the other's
+        // old value, the queue as empty and the worker as awake.
+        pthread_mutex_lock(&w->lock);
+        atomic_store(&w->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (pktq_peek(&w->queue, 0) == NULL) {
+            pthread_cond_wait(&w->wakeup, &w->lock);
+        }
+        atomic_store(&w->sleeping, 0);
+        pthread_mutex_unlock(&w->lock);
+        idle = 0;
+    }
+    return NULL;
+}
+
+#if !defined(FWD_BENCH) || defined(FWD_REPLAY)
+/**
+ * SLIP receive handler - steers each packet to a worker by its flow hash,
+ * so all packets of a flow are handled by one worker in order
+ */
+static void steer_packet(int tty, const void *vdata, int numbytes) {
+    if (atomic_load_explicit(&link_down[tty], memory_order_relaxed)) {
+        return;
+    }
+    counter_add(tty, CTR_RX_PACKETS, 1);
+    counter_add(tty, CTR_RX_BYTES, numbytes);
+
+    if (numbytes > 0 && *(const uint8_t *)vdata == HELLO_TYPE) {
+        handle_hello(tty, vdata, numbytes);
+        return;
+    }
+    if (num_workers == 0) {
+        data_handler(tty, vdata, numbytes);
+        return;
+    }
+
+    // Packets too short to hash still need a worker to report them
+    uint32_t hash = 0;
+    if (numbytes >= (int)sizeof(struct ipv6_header)) {
+        hash = flow_hash((const struct ipv6_header *)vdata);
+    }
+    fwd_worker_t *w = &workers[hash % num_workers];
+
+    if (pktq_push(&w->queue, tty, vdata, numbytes) != 0) {
+        PKT_LOG("[Iface %d] Worker %ld queue full, dropping packet\n", tty, (long)(w - workers));
+        counter_add(tty, CTR_DROP_QUEUE_FULL, 1);
+        return;
+    }
+    atomic_thread_fence(memory_order_seq_cst);  // Push before the check, see worker_thread
+    if (atomic_load(&w->sleeping)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->wakeup);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+#endif /* !FWD_BENCH || FWD_REPLAY */
+
+#if (!defined(FWD_BENCH) || defined(FWD_REPLAY)) && !defined(ROUTER_SIM)
+/**
+ * SLIP receive error handler - counts frames slipnet dropped or repaired
+ */
+static void count_slip_error(int tty, int error) {
+    counter_add(bond_iface(tty), error == SLIP_ERROR_FRAMING ? CTR_DROP_SLIP_FRAMING : CTR_DROP_BAD_ESCAPE, 1);
+}
+#endif /* slipnet receives, the simulated line makes no errors */
+
+/**
+ * Start the forwarding workers, one per core round robin
+ */
+void start_workers() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        cores = 1;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        fwd_worker_t *w = &workers[i];
+        if (pktq_init(&w->queue, WORKER_QUEUE_LEN) != 0) {
+            fprintf(stderr, "Error: Could not allocate queue for worker %d\n", i);
+            exit(1);
+        }
+        w->cpu = i % cores;
+        atomic_init(&w->sleeping, 0);
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wakeup, NULL);
+
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker_thread, w);
+        pthread_detach(tid);
+    }
+    printf("Started %d forwarding worker(s) on %ld core(s)\n", num_workers, cores);
+}
+
+// ============================================================================
+// ROUTING PROTOCOL TIMER
+// ============================================================================
+
+/**
+ * Order routes longest prefix first, then by address, so siblings are adjacent
+ */
+int compare_prefixes(const void *a, const void *b) {
+    const struct route_entry *ra = a, *rb = b;
+    if (ra->prefix_len != rb->prefix_len) {
+        return rb->prefix_len - ra->prefix_len;
+    }
+    return memcmp(&ra->destination, &rb->destination, sizeof(ra->destination));
+}
+
+/**
+ * Whether two routes have the same metric and the same set of next hops
+ */
+int same_next_hops(const struct route_entry *a, const struct route_entry *b) {
+    if (a->metric != b->metric || a->num_gateways != b->num_gateways) {
+        return 0;
+    }
+    for (int p = 0; p < a->num_gateways; p++) {
+        int found = 0;
+        for (int q = 0; q < b->num_gateways && !found; q++) {
+            found = memcmp(&a->gateways[p], &b->gateways[q], sizeof(a->gateways[p])) == 0;
+        }
+        if (!found) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Summarize a copy of the routing table for advertising: two sibling
+ * prefixes (the halves of one prefix a bit shorter) with the same metric and
+ * next hops are replaced by their parent, repeatedly, so contiguous blocks
+ * collapse into one covering route. A parent that is already in the table
+ * is kept as is, and the siblings are only dropped if it has the same
+ * metric and next hops.
+ * Returns the new number of entries, which are left sorted by compare_prefixes,
+ * or count with the entries unchanged if out of memory
+ */
+int aggregate_routes(struct route_entry *entries, int count) {
+    struct route_entry *merged = malloc((count + 1) * sizeof(struct route_entry));
+    if (merged == NULL) {
+        printf("[Timer] Out of memory aggregating %d routes, advertising them as they are\n",
+               count);
+        return count;
+    }
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        qsort(entries, count, sizeof(struct route_entry), compare_prefixes);
+
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            struct route_entry *a = &entries[i];
+            struct route_entry *b = i + 1 < count ? &entries[i + 1] : NULL;
+            if (b == NULL || a->prefix_len == 0 || b->prefix_len != a->prefix_len ||
+                !same_next_hops(a, b)) {
+                merged[n++] = *a;
+                continue;
+            }
+            struct route_entry parent = *a;
+            struct in6_addr other;
+            parent.prefix_len = a->prefix_len - 1;
+            mask_prefix(&a->destination, parent.prefix_len, &parent.destination);
+            mask_prefix(&b->destination, parent.prefix_len, &other);
+            if (memcmp(&parent.destination, &other, sizeof(other)) != 0) {
+                merged[n++] = *a;
+                continue;
+            }
+
+            // Shorter prefixes sort later, and are not yet changed this pass
+            struct route_entry *existing = bsearch(&parent, entries + i + 2, count - i - 2,
+                                                   sizeof(struct route_entry), compare_prefixes);
+            if (existing == NULL) {
+                merged[n++] = parent;
+            } else if (!same_next_hops(existing, &parent)) {
+                merged[n++] = *a;
+                continue;
+            }
+            i++;  // b is covered too
+            changed = 1;
+        }
+        memcpy(entries, merged, n * sizeof(struct route_entry));
+        count = n;
+    }
+    free(merged);
+    return count;
+}
+
+/**
+ * Re-encode an interface's cached advertisement if it is older than generation
+ * Returns 0, or -1 if out of memory, leaving the old advertisement cached
+ */
+int refresh_advert_cache(int iface, const struct route_entry *entries, int count,
+                         uint64_t generation) {
+    advert_cache_t *cache = &advert_cache[iface];
+    if (cache->num_packets > 0 && cache->generation == generation) {
+        return 0;
+    }
+
+    char *packets[MAX_ADVERT_SEGMENTS];
+    int sizes[MAX_ADVERT_SEGMENTS];
+    // The sequence only moves once per advertisement, however many table
+    // changes it takes in, so a neighbor comparing 16-bit sequences never
+    // sees it wrap between two it hears
+    uint16_t sequence = cache->sequence + 1;
+    int num_packets = build_advertisement(entries, count, &sim_addrs[iface],
+                                          sequence, packets, sizes);
+    if (num_packets < 0) {
+        printf("[Timer] Out of memory encoding interface %d, keeping generation %llu\n",
+               iface, (unsigned long long)cache->generation);
+        return -1;
+    }
+    for (int j = 0; j < cache->num_packets; j++) {
+        free(cache->packets[j]);
+    }
+    memcpy(cache->packets, packets, num_packets * sizeof(packets[0]));
+    memcpy(cache->sizes, sizes, num_packets * sizeof(sizes[0]));
+    cache->num_packets = num_packets;
+    cache->generation = generation;
+    cache->sequence = sequence;
+    printf("[Timer] Encoded %d routing packet(s) for interface %d (generation %llu)\n",
+           cache->num_packets, iface, (unsigned long long)generation);
+    return 0;
+}
+
+/**
+ * Send every interface its routing announcement, re-encoding the
+ * advertisements first if the table changed since they were encoded
+ */
+void advertise_routes(int num_ifaces) {
+    // Copy routing table under lock, only if it changed since last encoded
+    struct route_entry *entries = NULL;
+    int current_routes = 0;
+    pthread_mutex_lock(&routing_lock);
+    uint64_t generation = routing_generation;
+    if (generation != encoded_generation) {
+        current_routes = num_routes;
+        entries = malloc((num_routes + 1) * sizeof(struct route_entry));
+        if (entries != NULL) {
+            memcpy(entries, routing_table, num_routes * sizeof(struct route_entry));
+        }
+    }
+    pthread_mutex_unlock(&routing_lock);
+    if (generation != encoded_generation && entries == NULL) {
+        // Resend what is encoded, and try again next time
+        printf("[Timer] Out of memory copying %d routes, advertising generation %llu again\n",
+               current_routes, (unsigned long long)encoded_generation);
+        generation = encoded_generation;
+    }
+
+    // Summarizing is as costly as encoding, so it too only follows a change
+    if (entries != NULL && aggregate_adverts) {
+        int table_routes = current_routes;
+        current_routes = aggregate_routes(entries, current_routes);
+        printf("[Timer] Aggregated %d routes into %d\n", table_routes, current_routes);
+    }
+
+    // Send each interface's routing announcement, re-encoding if stale.
+    // One that could not be re-encoded is retried at the next interval.
+    uint64_t encoded = generation;
+    for (int i = 0; i < num_ifaces; i++) {
+        if (entries != NULL && refresh_advert_cache(i, entries, current_routes, generation) != 0) {
+            encoded = encoded_generation;
+        }
+        advert_cache_t *cache = &advert_cache[i];
+        printf("[Timer] Sending %d routing packet(s) on interface %d\n",
+               cache->num_packets, i);
+        for (int j = 0; j < cache->num_packets; j++) {
+            queue_send(i, cache->packets[j], cache->sizes[j]);
+        }
+    }
+    encoded_generation = encoded;
+    free(entries);
+}
+
+/**
+ * Timer thread for periodic routing updates
+ */
+void *timer_thread(void *n_ifaces) {
+    int num_ifaces = *(int *)n_ifaces;
+
+    while (1) {
+        sleep(ADVERT_INTERVAL_MS / 1000);
+        advertise_routes(num_ifaces);
+    }
+    return NULL;
+}
+
+// ============================================================================
+// CONTROL SOCKET
+// ============================================================================
+
+/**
+ * Counter values at the last reset, subtracted from the shared totals so
+ * resetting never writes to the counters file other processes read
+ */
+static uint64_t (*counter_baseline)[NUM_COUNTERS];  /* Per interface */
+
+/**
+ * Install or replace a static route, it never expires and is never changed
+ * by routing updates
+ * Caller must hold routing_lock
+ * Returns 0 on success, -1 if the prefix is directly connected or the table is full
+ */
+int install_static_route(const struct in6_addr *prefix, int prefix_len,
+                         const struct in6_addr *gateway, uint32_t metric) {
+    int i = fib_find(prefix, prefix_len, fib_bucket(prefix, prefix_len));
+    if (i >= 0 && routing_table[i].is_direct) {
+        return -1;
+    }
+    int is_new = i < 0;
+    if (is_new) {
+        if (num_routes >= MAX_ROUTES) {
+            return -1;
+        }
+        i = num_routes++;
+        routing_table[i].destination = *prefix;
+        routing_table[i].prefix_len = prefix_len;
+        fib_insert(i);
+    }
+    for (int p = 0; p < MAX_PATHS; p++) {
+        tw_cancel(&route_timers[i][p]);
+    }
+    set_path(i, 0, gateway);
+    routing_table[i].num_gateways = 1;
+    routing_table[i].metric = metric;
+    routing_table[i].timestamp = wall_seconds();
+    routing_table[i].is_direct = 0;
+    routing_table[i].is_static = 1;
+    routing_generation++;
+    PROBE(route_change, is_new ? ROUTE_ADDED : ROUTE_IMPROVED, prefix, prefix_len, gateway, metric);
+    return 0;
+}
+
+/**
+ * Withdraw a static route
+ * Caller must hold routing_lock
+ * Returns 0 on success, -1 if there is no static route to the prefix
+ */
+int withdraw_static_route(const struct in6_addr *prefix, int prefix_len) {
+    int i = fib_find(prefix, prefix_len, fib_bucket(prefix, prefix_len));
+    if (i < 0 || !routing_table[i].is_static) {
+        return -1;
+    }
+    remove_route(i);
+    return 0;
+}
+
+/**
+ * Parse "add <prefix>[/len] <gateway> [metric]" or "del <prefix>[/len]",
+ * the length defaulting to /64
+ * Returns 0 and fills in the arguments, or -1 with a reason in *error
+ */
+int parse_route_command(char *line, int *is_add, struct in6_addr *prefix, int *prefix_len,
+                        struct in6_addr *gateway, uint32_t *metric, const char **error) {
+    char *save = NULL;
+    char *verb = strtok_r(line, " \t", &save);
+    char *dest = strtok_r(NULL, " \t", &save);
+    char *gw = strtok_r(NULL, " \t", &save);
+    char *cost = strtok_r(NULL, " \t", &save);
+
+    *is_add = strcmp(verb, "add") == 0;
+    if (dest == NULL || (*is_add && gw == NULL) || (!*is_add && gw != NULL) ||
+        strtok_r(NULL, " \t", &save) != NULL) {
+        *error = "usage: add <prefix>[/len] <gateway> [metric] | del <prefix>[/len]";
+        return -1;
+    }
+
+    *prefix_len = ROUTE_PREFIX_LEN;
+    char *slash = strchr(dest, '/');
+    if (slash != NULL) {
+        char *end;
+        long len = strtol(slash + 1, &end, 10);
+        if (slash[1] == '\0' || *end != '\0' || len < 0 || len > 128) {
+            *error = "invalid prefix length";
+            return -1;
+        }
+        *prefix_len = (int)len;
+        *slash = '\0';
+    }
+    struct in6_addr addr;
+    if (inet_pton(AF_INET6, dest, &addr) != 1) {
+        *error = "invalid prefix";
+        return -1;
+    }
+    mask_prefix(&addr, *prefix_len, prefix);
+
+    if (*is_add) {
+        if (inet_pton(AF_INET6, gw, gateway) != 1) {
+            *error = "invalid gateway";
+            return -1;
+        }
+        if (find_output_interface(gateway) < 0) {
+            *error = "gateway is not on a connected network";
+            return -1;
+        }
+        *metric = 1;
+        if (cost != NULL) {
+            char *end;
+            unsigned long value = strtoul(cost, &end, 10);
+            if (*end != '\0' || value == 0 || value > UINT32_MAX) {
+                *error = "invalid metric";
+                return -1;
+            }
+            *metric = (uint32_t)value;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the routing table from a snapshot, so the lock is only held for the copy
+ */
+void control_dump(FILE *out) {
+    pthread_mutex_lock(&routing_lock);
+    int count = num_routes;
+    uint64_t generation = routing_generation;
+    struct route_entry *entries = malloc((count + 1) * sizeof(struct route_entry));
+    if (entries == NULL) {
+        pthread_mutex_unlock(&routing_lock);
+        fprintf(out, "error out of memory\n");
+        return;
+    }
+    memcpy(entries, routing_table, count * sizeof(struct route_entry));
+    pthread_mutex_unlock(&routing_lock);
+
+    time_t now = wall_seconds();
+    fprintf(out, "generation %llu routes %d\n", (unsigned long long)generation, count);
+    for (int i = 0; i < count; i++) {
+        char dest_str[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, &entries[i].destination, dest_str, sizeof(dest_str));
+        fprintf(out, "%s/%u metric %u %s age %ld",
+                dest_str, entries[i].prefix_len, entries[i].metric,
+                entries[i].is_direct ? "direct" :
+                entries[i].is_static ? "static" : "learned",
+                (long)(now - entries[i].timestamp));
+        for (int p = 0; p < entries[i].num_gateways; p++) {
+            char gateway_str[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, &entries[i].gateways[p], gateway_str, sizeof(gateway_str));
+            fprintf(out, " via %s", gateway_str);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "end\n");
+    free(entries);
+}
+
+/**
+ * Write every interface's counters since the last reset
+ */
+void control_counters(FILE *out) {
+    static const char *names[NUM_COUNTERS] = COUNTER_NAMES;
+    if (counters_map == NULL) {
+        fprintf(out, "error counters disabled\n");
+        return;
+    }
+    for (int iface = 0; iface < num_addrs; iface++) {
+        fprintf(out, "iface %d", iface);
+        for (int id = 0; id < NUM_COUNTERS; id++) {
+            fprintf(out, " %s %llu", names[id], (unsigned long long)
+                    (counters_total(iface, id) - counter_baseline[iface][id]));
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "end\n");
+}
+
+/**
+ * Filter rules as configured, in priority order, only touched by the
+ * control thread. The active tables are compiled from these.
+ */
+static struct acl_rule acl_rules[ACL_DIRECTIONS][ACL_MAX_RULES];
+static _Atomic uint64_t *acl_rule_hits[ACL_DIRECTIONS][ACL_MAX_RULES];
+static int acl_num_rules[ACL_DIRECTIONS];
+static const char *acl_direction_names[] = { "in", "out" };
+
+/**
+ * Parse "lo[-hi]" into a port range
+ * Returns 0, or -1 if it is not one
+ */
+int parse_port_range(const char *text, uint16_t *lo, uint16_t *hi) {
+    char *end;
+    unsigned long first = strtoul(text, &end, 10);
+    unsigned long last = first;
+    if (end != text && *end == '-') {
+        const char *rest = end + 1;
+        last = strtoul(rest, &end, 10);
+        if (end == rest) {
+            return -1;
+        }
+    }
+    if (end == text || *end != '\0' || first > last || last > 65535) {
+        return -1;
+    }
+    *lo = (uint16_t)first;
+    *hi = (uint16_t)last;
+    return 0;
+}
+
+/**
+ * Parse "<prefix>[/len]" into a masked prefix, a bare address is a /128
+ * Returns 0, or -1 if it is not one
+ */
+int parse_acl_prefix(char *text, struct in6_addr *prefix, uint8_t *prefix_len) {
+    int len = 128;
+    char *slash = strchr(text, '/');
+    if (slash != NULL) {
+        char *end;
+        long value = strtol(slash + 1, &end, 10);
+        if (slash[1] == '\0' || *end != '\0' || value < 0 || value > 128) {
+            return -1;
+        }
+        len = (int)value;
+        *slash = '\0';
+    }
+    struct in6_addr addr;
+    if (inet_pton(AF_INET6, text, &addr) != 1) {
+        return -1;
+    }
+    mask_prefix(&addr, len, prefix);
+    *prefix_len = (uint8_t)len;
+    return 0;
+}
+
+/**
+ * Parse the rule of "acl add in|out permit|deny [iface <n>] [src <prefix>[/len]]
+ * [dst <prefix>[/len]] [proto <n>|tcp|udp|icmp6] [sport <lo>[-<hi>]] [dport <lo>[-<hi>]]"
+ * from the tokens after the direction
+ * Returns 0, or -1 with a reason in *error
+ */
+int parse_acl_rule(char **save, struct acl_rule *rule, const char **error) {
+    memset(rule, 0, sizeof(*rule));
+    rule->iface = -1;
+    rule->proto = -1;
+    rule->sport_hi = 65535;
+    rule->dport_hi = 65535;
+
+    char *action = strtok_r(NULL, " \t", save);
+    if (action != NULL && strcmp(action, "permit") == 0) {
+        rule->action = ACL_PERMIT;
+    } else if (action != NULL && strcmp(action, "deny") == 0) {
+        rule->action = ACL_DENY;
+    } else {
+        *error = "rule action must be permit or deny";
+        return -1;
+    }
+
+    char *field;
+    while ((field = strtok_r(NULL, " \t", save)) != NULL) {
+        char *value = strtok_r(NULL, " \t", save);
+        if (value == NULL) {
+            *error = "missing value for rule field";
+            return -1;
+        }
+        char *end;
+        if (strcmp(field, "iface") == 0) {
+            long iface = strtol(value, &end, 10);
+            if (*end != '\0' || iface < 0 || iface >= num_addrs) {
+                *error = "invalid interface";
+                return -1;
+            }
+            rule->iface = (int)iface;
+        } else if (strcmp(field, "src") == 0) {
+            if (parse_acl_prefix(value, &rule->src, &rule->src_len) != 0) {
+                *error = "invalid source prefix";
+                return -1;
+            }
+        } else if (strcmp(field, "dst") == 0) {
+            if (parse_acl_prefix(value, &rule->dst, &rule->dst_len) != 0) {
+                *error = "invalid destination prefix";
+                return -1;
+            }
+        } else if (strcmp(field, "proto") == 0) {
+            long proto;
+            if (strcmp(value, "tcp") == 0) {
+                proto = IPPROTO_TCP;
+            } else if (strcmp(value, "udp") == 0) {
+                proto = IPPROTO_UDP;
+            } else if (strcmp(value, "icmp6") == 0) {
+                proto = ICMPV6_PROTOCOL;
+            } else {
+                proto = strtol(value, &end, 10);
+                proto = *end == '\0' ? proto : -1;
+            }
+            if (proto < 0 || proto > 255) {
+                *error = "invalid protocol";
+                return -1;
+            }
+            rule->proto = (int)proto;
+        } else if (strcmp(field, "sport") == 0) {
+            if (parse_port_range(value, &rule->sport_lo, &rule->sport_hi) != 0) {
+                *error = "invalid source port range";
+                return -1;
+            }
+        } else if (strcmp(field, "dport") == 0) {
+            if (parse_port_range(value, &rule->dport_lo, &rule->dport_hi) != 0) {
+                *error = "invalid destination port range";
+                return -1;
+            }
+        } else {
+            *error = "unknown rule field";
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write a rule in the syntax parse_acl_rule reads
+ */
+void format_acl_rule(FILE *out, const struct acl_rule *rule) {
+    char addr_str[INET6_ADDRSTRLEN];
+    fprintf(out, "%s", rule->action == ACL_DENY ? "deny" : "permit");
+    if (rule->iface >= 0) {
+        fprintf(out, " iface %d", rule->iface);
+    }
+    if (rule->src_len > 0) {
+        inet_ntop(AF_INET6, &rule->src, addr_str, sizeof(addr_str));
+        fprintf(out, " src %s/%u", addr_str, rule->src_len);
+    }
+    if (rule->dst_len > 0) {
+        inet_ntop(AF_INET6, &rule->dst, addr_str, sizeof(addr_str));
+        fprintf(out, " dst %s/%u", addr_str, rule->dst_len);
+    }
+    if (rule->proto >= 0) {
+        fprintf(out, " proto %d", rule->proto);
+    }
+    if (rule->sport_lo != 0 || rule->sport_hi != 65535) {
+        fprintf(out, rule->sport_lo == rule->sport_hi ? " sport %u" : " sport %u-%u",
+                rule->sport_lo, rule->sport_hi);
+    }
+    if (rule->dport_lo != 0 || rule->dport_hi != 65535) {
+        fprintf(out, rule->dport_lo == rule->dport_hi ? " dport %u" : " dport %u-%u",
+                rule->dport_lo, rule->dport_hi);
+    }
+}
+
+/**
+ * Write every filter rule with its hit count
+ */
+void control_acl_show(FILE *out) {
+    for (int dir = 0; dir < ACL_DIRECTIONS; dir++) {
+        for (int r = 0; r < acl_num_rules[dir]; r++) {
+            fprintf(out, "acl %s %d ", acl_direction_names[dir], r);
+            format_acl_rule(out, &acl_rules[dir][r]);
+            fprintf(out, " hits %llu\n", (unsigned long long)
+                    atomic_load_explicit(acl_rule_hits[dir][r], memory_order_relaxed));
+        }
+    }
+    fprintf(out, "end\n");
+}
+
+/**
+ * Compile a direction's rule list and swap it in for the active table.
+ * The old table is freed once no worker can still be using it.
+ * Returns 0, or -1 if the rules could not be compiled
+ */
+int publish_acl_table(enum acl_direction dir) {
+    int count = acl_num_rules[dir];
+    acl_table_t fresh = { NULL, NULL, NULL };
+    if (count > 0) {
+        fresh.set = acl_compile(acl_rules[dir], count);
+        fresh.actions = malloc(count * sizeof(enum acl_action));
+        fresh.hits = malloc(count * sizeof(_Atomic uint64_t *));
+        if (fresh.set == NULL || fresh.actions == NULL || fresh.hits == NULL) {
+            acl_free(fresh.set);
+            free(fresh.actions);
+            free(fresh.hits);
+            return -1;
+        }
+        for (int r = 0; r < count; r++) {
+            fresh.actions[r] = acl_rules[dir][r].action;
+            fresh.hits[r] = acl_rule_hits[dir][r];
+        }
+    }
+
+    pthread_rwlock_wrlock(&acl_lock);
+    acl_table_t old = acl_tables[dir];
+    acl_tables[dir] = fresh;
+    atomic_store(&acl_active_rules[dir], count);
+    pthread_rwlock_unlock(&acl_lock);
+
+    acl_free(old.set);
+    free(old.actions);
+    free(old.hits);
+    if (fresh.set != NULL) {
+        printf("[Ctl] Compiled %d %s filter rule(s) into %d shape(s)\n",
+               count, acl_direction_names[dir], acl_num_tuples(fresh.set));
+    } else {
+        printf("[Ctl] Cleared %s filter\n", acl_direction_names[dir]);
+    }
+    return 0;
+}
+
+/**
+ * Append count rule counters to the list freed once a batch is published.
+ * Returns 0, or -1 if the list could not grow, leaving it unchanged
+ */
+int retire_acl_counters(_Atomic uint64_t ***list, int *num, int *capacity,
+                        _Atomic uint64_t **hits, int count) {
+    if (*num + count > *capacity) {
+        int grown = *num + count > 2 * *capacity ? *num + count : 2 * *capacity;
+        _Atomic uint64_t **bigger = realloc(*list, grown * sizeof(_Atomic uint64_t *));
+        if (bigger == NULL) {
+            return -1;
+        }
+        *list = bigger;
+        *capacity = grown;
+    }
+    memcpy(*list + *num, hits, count * sizeof(_Atomic uint64_t *));
+    *num += count;
+    return 0;
+}
+
+/**
+ * Apply a run of consecutive acl add/del/clear lines to the rule lists,
+ * then compile and swap in each changed direction once, so a bulk load is
+ * compiled once rather than once per rule. Replies are held until the run
+ * is published; if memory runs out or a direction cannot be compiled the
+ * whole run is undone and every line gets the same error.
+ * Returns the number of lines consumed
+ */
+int control_acl_batch(char **lines, int count, FILE *out) {
+    static struct acl_rule saved_rules[ACL_DIRECTIONS][ACL_MAX_RULES];
+    static _Atomic uint64_t *saved_hits[ACL_DIRECTIONS][ACL_MAX_RULES];
+    int saved_num[ACL_DIRECTIONS];
+    int changed[ACL_DIRECTIONS] = { 0, 0 };
+    _Atomic uint64_t **removed = NULL;
+    int num_added = 0, num_removed = 0, removed_capacity = 0;
+    const char *failure = NULL;
+
+    int n = 0;
+    while (n < count && (strncmp(lines[n], "acl add ", 8) == 0 ||
+                         strncmp(lines[n], "acl del ", 8) == 0 ||
+                         strncmp(lines[n], "acl clear ", 10) == 0)) {
+        n++;
+    }
+    _Atomic uint64_t **added = malloc(n * sizeof(_Atomic uint64_t *));
+    const char **errors = malloc(n * sizeof(const char *));
+    if (added == NULL || errors == NULL) {
+        free(added);
+        free(errors);
+        for (int l = 0; l < n; l++) {
+            fprintf(out, "error out of memory, acl batch not applied\n");
+        }
+        return n;
+    }
+
+    // Saved so the run can be undone
+    for (int dir = 0; dir < ACL_DIRECTIONS; dir++) {
+        saved_num[dir] = acl_num_rules[dir];
+        memcpy(saved_rules[dir], acl_rules[dir], saved_num[dir] * sizeof(struct acl_rule));
+        memcpy(saved_hits[dir], acl_rule_hits[dir], saved_num[dir] * sizeof(_Atomic uint64_t *));
+    }
+
+    for (int l = 0; l < n && failure == NULL; l++) {
+        char *save = NULL;
+        strtok_r(lines[l], " \t", &save);
+        char *verb = strtok_r(NULL, " \t", &save);
+        char *direction = strtok_r(NULL, " \t", &save);
+        const char *error = NULL;
+        int dir = -1;
+        for (int d = 0; d < ACL_DIRECTIONS; d++) {
+            if (direction != NULL && strcmp(direction, acl_direction_names[d]) == 0) {
+                dir = d;
+            }
+        }
+
+        if (dir < 0) {
+            error = "direction must be in or out";
+        } else if (strcmp(verb, "add") == 0) {
+            struct acl_rule rule;
+            if (parse_acl_rule(&save, &rule, &error) == 0) {
+                _Atomic uint64_t *hits = NULL;
+                if (acl_num_rules[dir] == ACL_MAX_RULES) {
+                    error = "filter is full";
+                } else if ((hits = calloc(1, sizeof(_Atomic uint64_t))) == NULL) {
+                    failure = "out of memory, acl batch undone";
+                } else {
+                    added[num_added++] = hits;
+                    acl_rules[dir][acl_num_rules[dir]] = rule;
+                    acl_rule_hits[dir][acl_num_rules[dir]] = hits;
+                    acl_num_rules[dir]++;
+                }
+            }
+        } else if (strcmp(verb, "del") == 0) {
+            char *number = strtok_r(NULL, " \t", &save);
+            char *end = NULL;
+            long r = number != NULL ? strtol(number, &end, 10) : -1;
+            if (number == NULL || *end != '\0' || r < 0 || r >= acl_num_rules[dir] ||
+                strtok_r(NULL, " \t", &save) != NULL) {
+                error = "usage: acl del in|out <rule number>";
+            } else if (retire_acl_counters(&removed, &num_removed, &removed_capacity,
+                                           &acl_rule_hits[dir][r], 1) != 0) {
+                failure = "out of memory, acl batch undone";
+            } else {
+                int after = acl_num_rules[dir] - r - 1;
+                memmove(&acl_rules[dir][r], &acl_rules[dir][r + 1], after * sizeof(struct acl_rule));
+                memmove(&acl_rule_hits[dir][r], &acl_rule_hits[dir][r + 1],
+                        after * sizeof(_Atomic uint64_t *));
+                acl_num_rules[dir]--;
+            }
+        } else if (retire_acl_counters(&removed, &num_removed, &removed_capacity,
+                                       acl_rule_hits[dir], acl_num_rules[dir]) != 0) {
+            failure = "out of memory, acl batch undone";
+        } else {
+            acl_num_rules[dir] = 0;
+        }
+
+        errors[l] = error;
+        if (error == NULL && failure == NULL) {
+            changed[dir] = 1;
+        }
+    }
+
+    for (int dir = 0; dir < ACL_DIRECTIONS && failure == NULL; dir++) {
+        if (changed[dir] && publish_acl_table(dir) != 0) {
+            failure = "filter too large to compile, acl batch undone";
+        }
+    }
+    if (failure != NULL) {
+        // Put back the rule lists, and the tables compiled before the failure
+        int restored = 1;
+        for (int dir = 0; dir < ACL_DIRECTIONS; dir++) {
+            acl_num_rules[dir] = saved_num[dir];
+            memcpy(acl_rules[dir], saved_rules[dir], saved_num[dir] * sizeof(struct acl_rule));
+            memcpy(acl_rule_hits[dir], saved_hits[dir], saved_num[dir] * sizeof(_Atomic uint64_t *));
+            if (changed[dir] && publish_acl_table(dir) != 0) {
+                restored = 0;
+            }
+        }
+        // A table that could not be put back may still count into the new rules
+        for (int a = 0; restored && a < num_added; a++) {
+            free(added[a]);
+        }
+        for (int l = 0; l < n; l++) {
+            fprintf(out, "error %s\n", failure);
+        }
+    } else {
+        // No table refers to the counters of removed rules any more
+        for (int r = 0; r < num_removed; r++) {
+            free(removed[r]);
+        }
+        for (int l = 0; l < n; l++) {
+            if (errors[l] != NULL) {
+                fprintf(out, "error %s\n", errors[l]);
+            } else {
+                fprintf(out, "ok\n");
+            }
+        }
+    }
+    free(added);
+    free(errors);
+    free(removed);
+    return n;
+}
+
+/**
+ * Write every link's neighbor state, what was measured of it and its cost,
+ * then the members of bonded links
+ */
+void control_links(FILE *out) {
+    pthread_mutex_lock(&liveness_lock);
+    for (int iface = 0; iface < num_addrs; iface++) {
+        const neighbor_t *n = &neighbors[iface];
+        fprintf(out, "link %d %s rtt %u.%03u ms rate %u bits/s cost %u\n", iface,
+                hello_interval_ms > 0 ? neighbor_state_names[n->state] : "unknown",
+                n->srtt_us / 1000, n->srtt_us % 1000,
+                n->rate_bps > 0 ? n->rate_bps : link_rate_bps, n->cost);
+    }
+    pthread_mutex_unlock(&liveness_lock);
+    for (int iface = 0; iface < num_addrs; iface++) {
+        struct bond_stats stats;
+        if (bond_get_stats(iface, &stats) == 0) {
+            fprintf(out, "bond %d %s members %d live %d reordered %lu lost %lu late %lu "
+                    "dropped %lu\n",
+                    iface, stats.mode == BOND_ROUND_ROBIN ? "rr" : "hash", stats.members,
+                    stats.live, stats.reordered, stats.lost, stats.late, stats.dropped);
+        }
+    }
+    fprintf(out, "end\n");
+}
+
+/**
+ * Write every interface's policer and how many buckets are in use
+ */
+void control_police_show(FILE *out) {
+    pthread_mutex_lock(&policer_lock);
+    for (int iface = 0; iface < num_addrs; iface++) {
+        const policer_config_t *config = &policer_config[iface];
+        if (config->prefix_len < 0) {
+            fprintf(out, "police %d off\n", iface);
+        } else {
+            fprintf(out, "police %d %d %u %u\n", iface, config->prefix_len,
+                    config->rate, config->burst);
+        }
+    }
+    int in_use = 0;
+    for (int b = 0; b < POLICER_TABLE_SIZE; b++) {
+        in_use += policers[b].tty >= 0;
+    }
+    pthread_mutex_unlock(&policer_lock);
+    fprintf(out, "buckets %d of %d\nend\n", in_use, POLICER_TABLE_SIZE);
+}
+
+/**
+ * Handle "police <iface>|all <prefix_len> <rate> <burst>" or
+ * "police <iface>|all off"
+ */
+void control_police(char *args, FILE *out) {
+    char target[16];
+    int prefix_len;
+    unsigned long rate, burst;
+    char off[4];
+    int first = 0, last = num_addrs - 1;
+    int fields = sscanf(args, "%15s %d %lu %lu", target, &prefix_len, &rate, &burst);
+    int turn_off = fields < 4 && sscanf(args, "%15s %3s", target, off) == 2 && strcmp(off, "off") == 0;
+
+    if (fields >= 1 && strcmp(target, "all") != 0) {
+        char *end;
+        first = last = (int)strtol(target, &end, 10);
+        if (*end != '\0' || first < 0 || first >= num_addrs) {
+            fprintf(out, "error invalid interface\n");
+            return;
+        }
+    }
+    if (!turn_off && (fields != 4 || prefix_len < 0 || prefix_len > 128 || rate == 0 ||
+                      rate > UINT32_MAX || burst < MAX_SLIP_SIZE || burst > UINT32_MAX)) {
+        fprintf(out, "error usage: police <iface>|all <prefix_len> <bytes/s> <burst bytes> | "
+                     "police <iface>|all off (burst at least %d)\n", MAX_SLIP_SIZE);
+        return;
+    }
+    for (int iface = first; iface <= last; iface++) {
+        configure_policer(iface, turn_off ? -1 : prefix_len, (uint32_t)rate, (uint32_t)burst);
+    }
+    if (turn_off) {
+        printf("[Ctl] Policer off on %s\n", target);
+    } else {
+        printf("[Ctl] Policing each /%d source on %s to %lu bytes/s, burst %lu\n",
+               prefix_len, target, rate, burst);
+    }
+    fprintf(out, "ok\n");
+}
+
+/**
+ * Handle "flows" and "flows sample <N>|off"
+ */
+void control_flows(char *line, FILE *out) {
+    if (flow_target == NULL) {
+        fprintf(out, "error flow export disabled, start the router with -e\n");
+        return;
+    }
+    if (strcmp(line, "flows") == 0) {
+        struct flow_stats stats;
+        flows_get_stats(&stats);
+        if (stats.interval == 0) {
+            fprintf(out, "sampling off\n");
         } else {
-            // Other protocol - just acknowledge receipt
-            printf("[Iface %d] Packet is not a routing packet, dropping packet from src=%s\n", 
-                   tty, src_str);
+            fprintf(out, "sampling 1 in %u\n", stats.interval);
+        }
+        fprintf(out, "export %s\nactive %d of %d\nsampled %llu\nexported %llu in %llu messages\n"
+                     "dropped %llu\nend\n", flow_target, stats.active, FLOW_TABLE_SIZE,
+                (unsigned long long)stats.sampled, (unsigned long long)stats.exported,
+                (unsigned long long)stats.messages, (unsigned long long)stats.dropped);
+        return;
+    }
+
+    unsigned long interval = 0;
+    char *end = NULL;
+    if (strcmp(line, "flows sample off") != 0) {
+        if (strncmp(line, "flows sample ", 13) == 0) {
+            interval = strtoul(line + 13, &end, 10);
+        }
+        if (end == NULL || end == line + 13 || *end != '\0' ||
+            interval == 0 || interval > UINT32_MAX / 2) {
+            fprintf(out, "error usage: flows | flows sample <N>|off\n");
+            return;
         }
+    }
+    flows_set_interval((uint32_t)interval);
+    if (interval == 0) {
+        printf("[Ctl] Flow sampling off\n");
     } else {
-        // Forward packet
-        forward_packet(data, numbytes, tty, ip6);
+        printf("[Ctl] Sampling 1 in %lu forwarded packets\n", interval);
+    }
+    fprintf(out, "ok\n");
+}
+
+/**
+ * Handle one command line that is not a route change
+ */
+void control_command(char *line, FILE *out) {
+    if (strcmp(line, "dump") == 0) {
+        control_dump(out);
+    } else if (strcmp(line, "counters") == 0) {
+        control_counters(out);
+    } else if (strcmp(line, "reset") == 0) {
+        if (counters_map == NULL) {
+            fprintf(out, "error counters disabled\n");
+            return;
+        }
+        for (int iface = 0; iface < num_addrs; iface++) {
+            for (int id = 0; id < NUM_COUNTERS; id++) {
+                counter_baseline[iface][id] = counters_total(iface, id);
+            }
+        }
+        fprintf(out, "ok\n");
+    } else if (strncmp(line, "link ", 5) == 0) {
+        int iface;
+        char state[8];
+        if (sscanf(line + 5, "%d %7s", &iface, state) != 2 || iface < 0 || iface >= num_addrs ||
+            (strcmp(state, "up") != 0 && strcmp(state, "down") != 0)) {
+            fprintf(out, "error usage: link <iface> up|down\n");
+            return;
+        }
+        atomic_store(&link_down[iface], strcmp(state, "down") == 0);
+        printf("[Ctl] Link on interface %d is %s\n", iface, state);
+        fprintf(out, "ok\n");
+    } else if (strcmp(line, "links") == 0) {
+        control_links(out);
+    } else if (strcmp(line, "acl show") == 0) {
+        control_acl_show(out);
+    } else if (strcmp(line, "police show") == 0) {
+        control_police_show(out);
+    } else if (strncmp(line, "police ", 7) == 0) {
+        control_police(line + 7, out);
+    } else if (strcmp(line, "flows") == 0 || strncmp(line, "flows ", 6) == 0) {
+        control_flows(line, out);
+    } else if (strcmp(line, "help") == 0) {
+        fprintf(out, "commands: dump | counters | reset | link <iface> up|down | links | "
+                     "add <prefix>[/len] <gateway> [metric] | del <prefix>[/len] | "
+                     "acl add in|out permit|deny [iface <n>] [src <prefix>[/len]] "
+                     "[dst <prefix>[/len]] [proto <n>] [sport <lo>[-<hi>]] [dport <lo>[-<hi>]] | "
+                     "acl del in|out <n> | acl clear in|out | acl show | "
+                     "police <iface>|all <prefix_len> <bytes/s> <burst> | police <iface>|all off | "
+                     "police show | flows | flows sample <N>|off\n");
+    } else if (*line != '\0') {
+        fprintf(out, "error unknown command '%s'\n", line);
+    }
+}
+
+/**
+ * Apply a run of consecutive add/del lines under one routing_lock acquisition,
+ * so bulk loads do not contend with the forwarding workers once per route
+ * Returns the number of lines consumed
+ */
+int control_route_batch(char **lines, int count, FILE *out) {
+    int applied = 0;
+    int n = 0;
+    pthread_mutex_lock(&routing_lock);
+    while (n < count && (strncmp(lines[n], "add ", 4) == 0 || strncmp(lines[n], "del ", 4) == 0)) {
+        int is_add;
+        struct in6_addr prefix, gateway;
+        int prefix_len;
+        uint32_t metric;
+        const char *error = NULL;
+        if (parse_route_command(lines[n], &is_add, &prefix, &prefix_len,
+                                &gateway, &metric, &error) == 0) {
+            if (is_add && install_static_route(&prefix, prefix_len, &gateway, metric) != 0) {
+                error = "prefix is directly connected or table is full";
+            } else if (!is_add && withdraw_static_route(&prefix, prefix_len) != 0) {
+                error = "no static route to prefix";
+            }
+        }
+        if (error != NULL) {
+            fprintf(out, "error %s\n", error);
+        } else {
+            fprintf(out, "ok\n");
+            applied++;
+        }
+        n++;
+    }
+    pthread_mutex_unlock(&routing_lock);
+
+    if (applied > 0) {
+        printf("[Ctl] Applied %d static route change(s)\n", applied);
+    }
+    return n;
+}
+
+/**
+ * Serve one control connection until the client closes it
+ */
+void control_session(int fd) {
+    FILE *out = fdopen(dup(fd), "w");
+    if (out == NULL) {
+        return;
+    }
+
+    static char buf[CONTROL_BUF_SIZE];
+    char *lines[CONTROL_BUF_SIZE / 2];
+    int used = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + used, sizeof(buf) - 1 - used)) > 0) {
+        used += n;
+
+        // Split every complete line in the buffer
+        int num_lines = 0;
+        char *start = buf;
+        char *newline;
+        while ((newline = memchr(start, '\n', buf + used - start)) != NULL) {
+            *newline = '\0';
+            if (newline > start && newline[-1] == '\r') {
+                newline[-1] = '\0';
+            }
+            lines[num_lines++] = start;
+            start = newline + 1;
+        }
+        if (num_lines == 0 && used == (int)sizeof(buf) - 1) {
+            fprintf(out, "error line too long\n");
+            fflush(out);
+            break;
+        }
+
+        for (int i = 0; i < num_lines; ) {
+            if (strncmp(lines[i], "add ", 4) == 0 || strncmp(lines[i], "del ", 4) == 0) {
+                i += control_route_batch(lines + i, num_lines - i, out);
+            } else if (strncmp(lines[i], "acl add ", 8) == 0 || strncmp(lines[i], "acl del ", 8) == 0 ||
+                       strncmp(lines[i], "acl clear ", 10) == 0) {
+                i += control_acl_batch(lines + i, num_lines - i, out);
+            } else {
+                control_command(lines[i], out);
+                i++;
+            }
+        }
+        fflush(out);
+
+        // Keep the partial last line for the next read
+        used = buf + used - start;
+        memmove(buf, start, used);
+    }
+    fclose(out);
+}
+
+/**
+ * Control thread - accepts one control connection at a time on CONTROL_SOCKET
+ */
+void *control_thread(void *arg) {
+    int listen_fd = *(int *)arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        control_session(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * Create the control socket, replacing a stale one from an earlier run
+ * Returns the listening fd, or -1 on failure
+ */
+int open_control_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
 }
 
 // ============================================================================
-// ROUTING PROTOCOL TIMER
+// ROUTE CHECKPOINT
 // ============================================================================
 
 /**
- * Timer thread for periodic routing updates
+ * Map the checkpoint file, keeping what an earlier run left in it
+ * Returns 0 on success, -1 if the file cannot be created or mapped
  */
-void *timer_thread(void *n_ifaces) {
-    int num_ifaces = *(int *)n_ifaces;
-    
-    while (1) {
-        sleep(30);
+int checkpoint_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size != (off_t)CHECKPOINT_SIZE) {
+        if (st.st_size != 0) {
+            fprintf(stderr, "Warning: %s is %lld bytes, not the %zu of this build, resizing it\n",
+                    path, (long long)st.st_size, (size_t)CHECKPOINT_SIZE);
+        }
+        if (ftruncate(fd, CHECKPOINT_SIZE) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    void *map = mmap(NULL, CHECKPOINT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    checkpoint_map = map;
+    return 0;
+}
 
-        // Remove expired routes first
-        remove_expired_routes();
+/**
+ * Milliseconds of lifetime left on a path's expiry timer
+ * Caller must hold routing_lock
+ */
+uint32_t path_remaining_ms(int i, int p) {
+    uint64_t now = expiry_ticks_now();
+    if (!tw_pending(&route_timers[i][p]) || route_timers[i][p].expires <= now) {
+        return 0;
+    }
+    return (uint32_t)((route_timers[i][p].expires - now) * EXPIRY_TICK_MS);
+}
 
-        // Copy routing table under lock
-        pthread_mutex_lock(&routing_lock);
-        struct route_entry entries[num_routes];
-        int current_routes = num_routes;
-        memcpy(entries, routing_table, num_routes * sizeof(struct route_entry));
-        pthread_mutex_unlock(&routing_lock);
+/**
+ * Copy the learned and static routes with their paths' remaining lifetimes,
+ * so the checkpoint is written without holding the lock
+ * Caller must hold routing_lock
+ * Returns the number of routes copied
+ */
+int snapshot_routes(struct route_entry *entries, uint32_t (*remaining_ms)[MAX_PATHS]) {
+    int count = 0;
+    for (int i = 0; i < num_routes; i++) {
+        if (routing_table[i].is_direct) {
+            continue;
+        }
+        entries[count] = routing_table[i];
+        for (int p = 0; p < routing_table[i].num_gateways; p++) {
+            remaining_ms[count][p] = path_remaining_ms(i, p);
+        }
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Save a snapshot of the routes. The header is marked incomplete while
+ * routes are written, so a router killed mid-write leaves a checkpoint that
+ * is ignored rather than half read.
+ */
+void write_checkpoint(const struct route_entry *entries, uint32_t (*remaining_ms)[MAX_PATHS],
+                      int count) {
+    struct checkpoint_header *header = &checkpoint_map->header;
+    header->complete = 0;
+    atomic_thread_fence(memory_order_release);
+
+    for (int r = 0; r < count; r++) {
+        struct checkpoint_route *saved = &checkpoint_map->routes[r];
+        memset(saved, 0, sizeof(*saved));
+        saved->destination = entries[r].destination;
+        saved->prefix_len = entries[r].prefix_len;
+        saved->metric = entries[r].metric;
+        saved->num_gateways = entries[r].num_gateways;
+        saved->is_static = entries[r].is_static;
+        saved->timestamp = entries[r].timestamp;
+        for (int p = 0; p < entries[r].num_gateways; p++) {
+            saved->gateways[p] = entries[r].gateways[p];
+            saved->remaining_ms[p] = remaining_ms[r][p];
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->max_routes = MAX_ROUTES;
+    header->num_routes = count;
+    header->saved_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    atomic_thread_fence(memory_order_release);
+    header->complete = 1;
+}
+
+/**
+ * Reload the routes of the last complete checkpoint. Learned paths keep the
+ * lifetime they had left, less the time the router was down, and are used
+ * for forwarding until neighbors refresh or replace them. Paths whose
+ * gateway is no longer on a connected network are skipped.
+ * Returns the number of routes restored
+ */
+int restore_checkpoint() {
+    const struct checkpoint_header *header = &checkpoint_map->header;
+    if (header->magic != CHECKPOINT_MAGIC) {
+        return 0;
+    }
+    if (header->version != CHECKPOINT_VERSION || header->max_routes != MAX_ROUTES) {
+        fprintf(stderr, "Warning: Ignoring checkpoint of version %u for %u routes, "
+                "this build writes version %d for %d\n",
+                header->version, header->max_routes, CHECKPOINT_VERSION, MAX_ROUTES);
+        return 0;
+    }
+    if (!header->complete || header->num_routes > MAX_ROUTES) {
+        fprintf(stderr, "Warning: Ignoring checkpoint left incomplete\n");
+        return 0;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    uint64_t downtime_ms = now_ms > header->saved_ms ? now_ms - header->saved_ms : 0;
+
+    int restored = 0;
+    pthread_mutex_lock(&routing_lock);
+    for (uint32_t r = 0; r < header->num_routes; r++) {
+        const struct checkpoint_route *saved = &checkpoint_map->routes[r];
+        if (saved->prefix_len > 128 || saved->num_gateways > MAX_PATHS ||
+            fib_find(&saved->destination, saved->prefix_len,
+                     fib_bucket(&saved->destination, saved->prefix_len)) >= 0) {
+            continue;
+        }
+        if (saved->is_static) {
+            if (find_output_interface(&saved->gateways[0]) >= 0 &&
+                install_static_route(&saved->destination, saved->prefix_len,
+                                     &saved->gateways[0], saved->metric) == 0) {
+                restored++;
+            }
+            continue;
+        }
+        if (num_routes >= MAX_ROUTES) {
+            break;
+        }
 
-        // Calculate packet size
-        int packet_size = sizeof(struct ipv6_header) + sizeof(struct routing_packet_header) + 
-                         current_routes * sizeof(struct route_entry);
-
-        // Build IPv6 header
-        struct ipv6_header ip6_hdr;
-        memset(&ip6_hdr, 0, sizeof(ip6_hdr));
-        ip6_hdr.ver_class_hi = 0x60;
-        ip6_hdr.class_lo_flow_hi = 0;
-        ip6_hdr.flow_lo = htons(0);
-        ip6_hdr.length = htons(packet_size - sizeof(ip6_hdr));
-        ip6_hdr.next_header = 2;  // Routing protocol
-        ip6_hdr.hop_limit = 1;    // Send only to neighbors
-
-        // Set destination to link-local broadcast IP ff02::1
-        struct in6_addr dest_addr;
-        inet_pton(AF_INET6, "ff02::1", &dest_addr);
-        memcpy(ip6_hdr.destination, dest_addr.s6_addr, 16);
-
-        // Build and send routing announcements for each interface
-        for (int i = 0; i < num_ifaces; i++) {
-            // Set source IP address to interface address
-            memcpy(ip6_hdr.source, sim_addrs[i].s6_addr, 16);
-
-            // Build routing packet header
-            struct routing_packet_header routing_hdr;
-            memcpy(routing_hdr.sender.s6_addr, sim_addrs[i].s6_addr, 16);
-            routing_hdr.num_routes = htonl(current_routes);
-
-            // Convert metrics to network byte order for transmission
-            struct route_entry network_entries[current_routes];
-            for (int j = 0; j < current_routes; j++) {
-                network_entries[j].destination = entries[j].destination;
-                network_entries[j].gateway = entries[j].gateway;
-                network_entries[j].metric = htonl(entries[j].metric);
-                network_entries[j].timestamp = entries[j].timestamp;
-                network_entries[j].is_direct = entries[j].is_direct;
-            }
-
-            // Assemble complete packet
-            char *announce_packet = malloc(packet_size);
-            memcpy(announce_packet, &ip6_hdr, sizeof(ip6_hdr)); // IPv6 header
-            memcpy(announce_packet + sizeof(ip6_hdr), &routing_hdr, sizeof(routing_hdr)); // Routing header
-            memcpy(announce_packet + sizeof(ip6_hdr) + sizeof(routing_hdr), 
-                   network_entries, current_routes * sizeof(struct route_entry)); // Routing entries
-
-            // Send announcement
-            printf("[Timer] Sending a routing packet on interface %d\n", i);
-            queue_send(i, announce_packet, packet_size);
-            free(announce_packet);
+        int i = num_routes;
+        routing_table[i].num_gateways = 0;
+        for (int p = 0; p < saved->num_gateways; p++) {
+            if (saved->remaining_ms[p] <= downtime_ms ||
+                find_output_interface(&saved->gateways[p]) < 0) {
+                continue;
+            }
+            int q = routing_table[i].num_gateways++;
+            set_path(i, q, &saved->gateways[p]);
+            tw_schedule(&route_wheel, &route_timers[i][q],
+                        expiry_ticks_now() + (saved->remaining_ms[p] - downtime_ms) / EXPIRY_TICK_MS);
         }
+        if (routing_table[i].num_gateways == 0) {
+            continue;
+        }
+        routing_table[i].destination = saved->destination;
+        routing_table[i].prefix_len = saved->prefix_len;
+        routing_table[i].metric = saved->metric;
+        routing_table[i].timestamp = saved->timestamp;
+        routing_table[i].is_direct = 0;
+        routing_table[i].is_static = 0;
+        fib_insert(i);
+        num_routes++;
+        restored++;
+    }
+    if (restored > 0) {
+        routing_generation++;
+    }
+    pthread_mutex_unlock(&routing_lock);
+    return restored;
+}
+
+/**
+ * Checkpoint thread - saves the routing table every CHECKPOINT_INTERVAL_MS,
+ * holding the lock only to snapshot it
+ */
+void *checkpoint_thread(void *arg) {
+    (void)arg;
+    struct timespec interval = { CHECKPOINT_INTERVAL_MS / 1000,
+                                 (CHECKPOINT_INTERVAL_MS % 1000) * 1000000L };
+    struct route_entry *entries = malloc(MAX_ROUTES * sizeof(struct route_entry));
+    uint32_t (*remaining_ms)[MAX_PATHS] = malloc(MAX_ROUTES * sizeof(*remaining_ms));
+    if (entries == NULL || remaining_ms == NULL) {
+        fprintf(stderr, "Warning: Out of memory for route snapshots, checkpoints disabled\n");
+        free(entries);
+        free(remaining_ms);
+        return NULL;
+    }
+    while (1) {
+        nanosleep(&interval, NULL);
+
+        pthread_mutex_lock(&routing_lock);
+        int count = snapshot_routes(entries, remaining_ms);
+        pthread_mutex_unlock(&routing_lock);
+        write_checkpoint(entries, remaining_ms, count);
     }
     return NULL;
 }
@@ -585,16 +3887,48 @@ void initialize_routing_table() {
         get_network_prefix(&sim_addrs[i], &prefix);
         
         routing_table[num_routes].destination = prefix;
-        routing_table[num_routes].gateway = sim_addrs[i];  // Gateway is self for direct routes
+        routing_table[num_routes].prefix_len = ROUTE_PREFIX_LEN;
+        set_path(num_routes, 0, &sim_addrs[i]);  // Gateway is self for direct routes
+        routing_table[num_routes].num_gateways = 1;
         routing_table[num_routes].metric = 0;             // Direct routes have metric 0
-        routing_table[num_routes].timestamp = time(NULL);
+        routing_table[num_routes].timestamp = wall_seconds();
         routing_table[num_routes].is_direct = 1;          // Mark as direct route
+        routing_table[num_routes].is_static = 0;
+        fib_insert(num_routes);
         num_routes++;
     }
     
     print_routing_table();
 }
 
+/**
+ * Allocate the per-interface state of num_addrs interfaces, zeroed but for
+ * each link's starting cost
+ * Returns 0, or -1 if out of memory
+ */
+int allocate_interfaces() {
+    sim_addrs = calloc(num_addrs, sizeof(struct in6_addr));
+    send_slots = aligned_alloc(alignof(send_lock_t), num_addrs * sizeof(send_lock_t));
+    link_down = calloc(num_addrs, sizeof(atomic_int));
+    policer_config = calloc(num_addrs, sizeof(policer_config_t));
+    advert_cache = calloc(num_addrs, sizeof(advert_cache_t));
+    advert_seen = calloc(num_addrs, sizeof(advert_seen_t));
+    neighbors = calloc(num_addrs, sizeof(neighbor_t));
+    icmp_buckets = calloc(num_addrs, sizeof(icmp_bucket_t));
+    counter_baseline = calloc(num_addrs, sizeof(*counter_baseline));
+    if (sim_addrs == NULL || send_slots == NULL || link_down == NULL || policer_config == NULL ||
+        advert_cache == NULL || advert_seen == NULL || neighbors == NULL ||
+        icmp_buckets == NULL || counter_baseline == NULL) {
+        return -1;
+    }
+    memset(send_slots, 0, num_addrs * sizeof(send_lock_t));
+    // Until something is measured a link costs what its configured rate does
+    for (int i = 0; i < num_addrs; i++) {
+        neighbors[i].cost = link_rate_bps > 0 ? measure_link_cost(&neighbors[i]) : 1;
+    }
+    return 0;
+}
+
 /**
  * Initialize send locks for all interfaces
  */
@@ -605,23 +3939,316 @@ void initialize_send_locks() {
     }
 }
 
+#ifdef RUN_ROUTER_TEST
+// ============================================================================
+// SELF TEST
+// ============================================================================
+
+/**
+ * Encode value, check its length, and decode it back whole and truncated
+ */
+static void test_varint(uint32_t value, int expected_len) {
+    uint8_t buf[8];
+    uint32_t decoded = ~value;
+    int len = encode_varint(buf, value);
+    assert(len == expected_len);
+    assert(decode_varint(buf, buf + len, &decoded) == len);
+    assert(decoded == value);
+    assert(decode_varint(buf, buf + len - 1, &decoded) == -1);
+}
+
+/**
+ * Check that updating a message's checksum for a new type, as Echo Replies
+ * are made, gives what summing the whole message again does
+ */
+static void test_checksum_update(const struct ipv6_header *ip6, uint8_t *message, int len,
+                                 uint8_t new_type) {
+    struct icmpv6_header icmp;
+    memcpy(&icmp, message, sizeof(icmp));
+    icmp.checksum = 0;
+    memcpy(message, &icmp, sizeof(icmp));
+    icmp.checksum = icmpv6_checksum(ip6, message, len);
+
+    uint16_t old_word, new_word;
+    memcpy(&old_word, &icmp, 2);
+    icmp.type = new_type;
+    memcpy(&new_word, &icmp, 2);
+    uint16_t updated = checksum_update(icmp.checksum, old_word, new_word);
+
+    icmp.checksum = 0;
+    memcpy(message, &icmp, sizeof(icmp));
+    uint16_t full = icmpv6_checksum(ip6, message, len);
+    // 0 and 0xffff are both zero in one's complement, RFC 1624 section 3
+    assert(updated == full || (uint16_t)(updated + full) == 0xffff);
+    icmp.checksum = updated;
+    memcpy(message, &icmp, sizeof(icmp));
+    assert(icmpv6_checksum(ip6, message, len) == 0);
+}
+
+/**
+ * Learn a route to fd00:9::/64 with metric 5 via a gateway on each listed
+ * interface, returning its index
+ */
+static int test_learn_route(const int *ifaces, int n) {
+    struct route_update update;
+    memset(&update, 0, sizeof(update));
+    inet_pton(AF_INET6, "fd00:9::", &update.prefix);
+    update.prefix_len = 64;
+    pthread_mutex_lock(&routing_lock);
+    for (int k = 0; k < n; k++) {
+        struct in6_addr gateway = sim_addrs[ifaces[k]];
+        gateway.s6_addr[15] = 2;
+        update.metric = 5;
+        update_routing_table(&update, &gateway, 0);
+    }
+    int i = fib_find(&update.prefix, 64, fib_bucket(&update.prefix, 64));
+    pthread_mutex_unlock(&routing_lock);
+    assert(i >= 0 && routing_table[i].num_gateways == n);
+    return i;
+}
+
+/**
+ * Reprice interface 0's link on routes with a path over it, alone or
+ * alongside a path over interface 1
+ */
+static void test_reprice(void) {
+    num_addrs = 2;
+    assert(allocate_interfaces() == 0);
+    inet_pton(AF_INET6, "fd00:1::1", &sim_addrs[0]);
+    inet_pton(AF_INET6, "fd00:2::1", &sim_addrs[1]);
+    tw_init(&route_wheel, expiry_ticks_now());
+    initialize_routing_table();
+    static const int both[] = { 0, 1 }, first[] = { 0 };
+
+    // Dearer: the path over the link goes, the other keeps its metric
+    int i = test_learn_route(both, 2);
+    reprice_link_routes(0, 1, 3);
+    assert(routing_table[i].num_gateways == 1 && routing_table[i].ifaces[0] == 1);
+    assert(routing_table[i].metric == 5);
+    remove_route(i);
+
+    // Cheaper: only the path over the link stays, at the lower metric
+    i = test_learn_route(both, 2);
+    reprice_link_routes(0, 3, 1);
+    assert(routing_table[i].num_gateways == 1 && routing_table[i].ifaces[0] == 0);
+    assert(routing_table[i].metric == 3);
+    remove_route(i);
+
+    // Only over the link: the metric follows its cost either way
+    i = test_learn_route(first, 1);
+    reprice_link_routes(0, 1, 3);
+    assert(routing_table[i].num_gateways == 1 && routing_table[i].metric == 7);
+    uint64_t generation = routing_generation;
+    reprice_link_routes(0, 3, 3);
+    assert(routing_generation == generation);  // Nothing moved
+    remove_route(i);
+}
+
+/**
+ * Self test of the routing wire codec, ICMPv6 checksums and link
+ * repricing, prints ok or fails an assertion
+ */
+int router_self_test(void) {
+    // Each 7 bits of value take one more byte
+    static const uint32_t limits[] = { 0x7f, 0x3fff, 0x1fffff, 0xfffffff };
+    test_varint(0, 1);
+    for (int i = 0; i < 4; i++) {
+        test_varint(limits[i] - 1, i + 1);
+        test_varint(limits[i], i + 1);
+        test_varint(limits[i] + 1, i + 2);
+    }
+    test_varint(UINT32_MAX, 5);
+    uint8_t buf[8];
+    assert(encode_varint(buf, 300) == 2 && buf[0] == 0xac && buf[1] == 0x02);
+    assert(encode_varint(buf, UINT32_MAX) == 5 && buf[0] == 0xff && buf[4] == 0x0f);
+    uint32_t value = 0;
+    for (uint64_t x = 1; x <= UINT32_MAX; x = x * 3 + 1) {
+        int len = encode_varint(buf, (uint32_t)x);
+        assert(decode_varint(buf, buf + sizeof(buf), &value) == len && value == x);
+    }
+
+    // More than five bytes is malformed, as are bits past 32 and an empty buffer
+    static const uint8_t too_long[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 };
+    static const uint8_t too_big[] = { 0xff, 0xff, 0xff, 0xff, 0x1f };
+    static const uint8_t biggest[] = { 0xff, 0xff, 0xff, 0xff, 0x0f };
+    assert(decode_varint(too_long, too_long + sizeof(too_long), &value) == -1);
+    assert(decode_varint(too_big, too_big + sizeof(too_big), &value) == -1);
+    assert(decode_varint(biggest, biggest + sizeof(biggest), &value) == 5);
+    assert(value == UINT32_MAX);
+    assert(decode_varint(buf, buf, &value) == -1);
+
+    // Routes of every prefix length come back with their host bits zeroed
+    for (int prefix_len = 0; prefix_len <= 128; prefix_len++) {
+        struct route_entry route;
+        memset(&route, 0, sizeof(route));
+        memset(route.destination.s6_addr, 0xa5, 16);
+        route.prefix_len = prefix_len;
+        route.metric = prefix_len * 1000003u;
+        uint8_t wire[ROUTE_WIRE_MAX];
+        int len = encode_route(wire, &route);
+        assert(len <= ROUTE_WIRE_MAX && len == route_wire_size(&route));
+
+        struct in6_addr prefix, expected;
+        uint8_t decoded_len;
+        uint32_t metric;
+        assert(decode_route(wire, wire + len, &prefix, &decoded_len, &metric) == len);
+        mask_prefix(&route.destination, prefix_len, &expected);
+        assert(memcmp(&prefix, &expected, sizeof(prefix)) == 0);
+        assert(decoded_len == prefix_len && metric == route.metric);
+        assert(decode_route(wire, wire + len - 1, &prefix, &decoded_len, &metric) == -1);
+    }
+
+    // Incremental checksums of messages of every length, odd ones included
+    struct ipv6_header ip6;
+    uint8_t message[MAX_SLIP_SEND];
+    srand(1);
+    for (int len = sizeof(struct icmpv6_header); len <= (int)sizeof(message); len++) {
+        for (size_t i = 0; i < sizeof(ip6); i++) {
+            ((uint8_t *)&ip6)[i] = rand();
+        }
+        for (int i = 0; i < len; i++) {
+            message[i] = rand();
+        }
+        message[0] = ICMPV6_ECHO_REQUEST;
+        test_checksum_update(&ip6, message, len, ICMPV6_ECHO_REPLY);
+        message[0] = rand();
+        test_checksum_update(&ip6, message, len, rand());
+    }
+    // And an all-zero one
+    memset(&ip6, 0, sizeof(ip6));
+    memset(message, 0, sizeof(message));
+    message[0] = ICMPV6_ECHO_REQUEST;
+    test_checksum_update(&ip6, message, sizeof(struct icmpv6_header), ICMPV6_ECHO_REPLY);
+    test_checksum_update(&ip6, message, sizeof(struct icmpv6_header), 0);
+
+    test_reprice();
+    printf("ok\n");
+    return 0;
+}
+#endif /* RUN_ROUTER_TEST */
+
+#if !defined(FWD_BENCH) && !defined(ROUTER_SIM)
 /**
  * Main function - entry point
  */
 int main(int argc, char *argv[]) {
+#ifdef RUN_ROUTER_TEST
+    return router_self_test();
+#endif
+    // Parse options, which come before the addresses
+    int argi = 1;
+    long flow_interval = FLOW_DEFAULT_INTERVAL;
+    long link_rate = 0;
+    int num_bonds = 0;
+    int bond_ifaces[argc], bond_members[argc];
+    enum bond_mode bond_modes[argc];
+    // One worker per core by default, however many cores the host has
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = cores < 1 ? 1 : cores > MAX_WORKERS ? MAX_WORKERS : (int)cores;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-q") == 0) {
+            verbose = 0;
+            argi++;
+        } else if (strcmp(argv[argi], "-a") == 0) {
+            aggregate_adverts = 1;
+            argi++;
+        } else if (strcmp(argv[argi], "-w") == 0 && argi + 1 < argc) {
+            num_workers = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-i") == 0 && argi + 1 < argc) {
+            hello_interval_ms = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-m") == 0 && argi + 1 < argc) {
+            hello_multiplier = atoi(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-e") == 0 && argi + 1 < argc) {
+            flow_target = argv[argi + 1];
+            argi += 2;
+        } else if (strcmp(argv[argi], "-s") == 0 && argi + 1 < argc) {
+            flow_interval = atol(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-c") == 0 && argi + 1 < argc) {
+            link_rate = atol(argv[argi + 1]);
+            argi += 2;
+        } else if (strcmp(argv[argi], "-b") == 0 && argi + 1 < argc) {
+            // <iface>:<ttys>[:rr|hash]
+            char mode[8] = "hash";
+            int fields = sscanf(argv[argi + 1], "%d:%d:%7s", &bond_ifaces[num_bonds],
+                                &bond_members[num_bonds], mode);
+            if (fields < 2 || bond_members[num_bonds] < 1 ||
+                (strcmp(mode, "rr") != 0 && strcmp(mode, "hash") != 0)) {
+                fprintf(stderr, "Error: Bond must be <iface>:<ttys>[:rr|hash], not '%s'.\n",
+                        argv[argi + 1]);
+                return 1;
+            }
+            bond_modes[num_bonds++] = strcmp(mode, "rr") == 0 ? BOND_ROUND_ROBIN : BOND_HASH;
+            argi += 2;
+        } else {
+            fprintf(stderr, "Error: Unknown option or missing value '%s'.\n", argv[argi]);
+            return 1;
+        }
+    }
+    if (num_workers < 0 || num_workers > MAX_WORKERS) {
+        fprintf(stderr, "Error: Number of workers must be 0 to %d.\n", MAX_WORKERS);
+        return 1;
+    }
+    if (hello_interval_ms < 0 || hello_interval_ms > 65535 ||
+        hello_multiplier < 1 || hello_multiplier > 255) {
+        fprintf(stderr, "Error: Hello interval must be 0 to 65535 ms and multiplier 1 to 255.\n");
+        return 1;
+    }
+    if (flow_interval < 1 || flow_interval > UINT32_MAX / 2) {
+        fprintf(stderr, "Error: Flow sampling must be 1 in 1 to %u packets.\n", UINT32_MAX / 2);
+        return 1;
+    }
+    if (link_rate < 0 || link_rate > UINT32_MAX) {
+        fprintf(stderr, "Error: Line rate must be 1 to %u bits/s, or 0 for hop count.\n", UINT32_MAX);
+        return 1;
+    }
+    link_rate_bps = link_rate;
+    if (link_rate_bps > 0 && hello_interval_ms == 0) {
+        fprintf(stderr, "Warning: Link costs are measured from hellos, enable them with -i %d.\n",
+                HELLO_INTERVAL_MS);
+    }
+
     // Validate command line arguments
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <IPv6_addr1> <IPv6_addr2> ... <IPv6_addrN>\n", argv[0]);
+    if (argc - argi < 1) {
+        fprintf(stderr, "Usage: %s [-q] [-a] [-w num_workers] [-i hello_ms] [-m multiplier] [-e flow_file|udp:port] [-s 1_in_n] [-c bits_per_s] [-b iface:ttys[:rr|hash]]... <IPv6_addr1> <IPv6_addr2> ... <IPv6_addrN>\n", argv[0]);
         return 1;
     }
 
-    // Check maximum number of addresses
-    num_addrs = argc - 1;
-    if (num_addrs > MAX_TTYS) {
-        fprintf(stderr, "Error: Maximum number of addresses is %d.\n", MAX_TTYS);
+    // One interface per address, its state allocated for just that many
+    num_addrs = argc - argi;
+    if (allocate_interfaces() != 0) {
+        fprintf(stderr, "Error: Out of memory for %d interfaces.\n", num_addrs);
         return 1;
     }
 
+    // Bonded interfaces take several consecutive ttys, the rest one each
+    int num_ttys = num_addrs;
+    if (num_bonds > 0) {
+        int members[num_addrs];
+        enum bond_mode modes[num_addrs];
+        for (int i = 0; i < num_addrs; i++) {
+            members[i] = 1;
+            modes[i] = BOND_HASH;
+        }
+        for (int b = 0; b < num_bonds; b++) {
+            if (bond_ifaces[b] < 0 || bond_ifaces[b] >= num_addrs) {
+                fprintf(stderr, "Error: Bonded interface %d is not one of the %d addresses.\n",
+                        bond_ifaces[b], num_addrs);
+                return 1;
+            }
+            members[bond_ifaces[b]] = bond_members[b];
+            modes[bond_ifaces[b]] = bond_modes[b];
+        }
+        if (bond_configure(num_addrs, members, modes, monotonic_ms) != 0) {
+            fprintf(stderr, "Error: Out of memory for bonds.\n");
+            return 1;
+        }
+        num_ttys = bond_num_ttys();
+    }
+
     // Validate simconfig file
     FILE *simconfig = fopen("simconfig", "r");
     if (simconfig == NULL) {
@@ -639,22 +4266,59 @@ int main(int argc, char *argv[]) {
     }
     fclose(simconfig);
 
-    if (num_addrs > num_interfaces) {
-        fprintf(stderr, "Error: More IPv6 addresses provided than defined in simconfig.\n");
+    if (num_ttys > num_interfaces) {
+        fprintf(stderr, "Error: More IPv6 addresses and bond members provided than defined in simconfig.\n");
         return 1;
     }
 
     // Parse and validate IPv6 addresses
     for (int i = 0; i < num_addrs; i++) {
-        if (inet_pton(AF_INET6, argv[i + 1], &sim_addrs[i]) != 1) {
-            fprintf(stderr, "Error: Invalid IPv6 address '%s'.\n", argv[i + 1]);
+        if (inet_pton(AF_INET6, argv[argi + i], &sim_addrs[i]) != 1) {
+            fprintf(stderr, "Error: Invalid IPv6 address '%s'.\n", argv[argi + i]);
+            return 1;
+        }
+    }
+
+    // Open the flow exporter, asked for explicitly so failing is fatal
+    if (flow_target != NULL) {
+        if (flows_open(flow_target, flow_interval) != 0) {
+            fprintf(stderr, "Error: Could not open flow exporter %s\n", flow_target);
             return 1;
         }
+        printf("Sampling 1 in %ld forwarded packets, exporting flows to %s\n",
+               flow_interval, flow_target);
     }
 
+    // Nothing is policed until configured over the control socket
+    initialize_policers();
+
     // Initialize routing table
+    tw_init(&route_wheel, expiry_ticks_now());
     initialize_routing_table();
 
+    // Warm restart from the last checkpoint, the router still runs without one
+    if (checkpoint_open(CHECKPOINT_FILE) != 0) {
+        fprintf(stderr, "Warning: Could not map %s, checkpoints disabled\n", CHECKPOINT_FILE);
+    } else {
+        int restored = restore_checkpoint();
+        if (restored > 0) {
+            printf("Restored %d route(s) from %s\n", restored, CHECKPOINT_FILE);
+            print_routing_table();
+        }
+    }
+
+    // Publish counters, the router still runs without them. Counting threads
+    // are a receive thread per tty, a send thread per interface, the
+    // workers and the service threads.
+    if (counters_open(COUNTERS_FILE, num_addrs,
+                      num_ttys + num_addrs + num_workers + SERVICE_THREADS) != 0) {
+        fprintf(stderr, "Warning: Could not create %s, counters disabled\n", COUNTERS_FILE);
+    }
+    install_slip_error_handler(count_slip_error);
+
+    // Start forwarding workers before packets can arrive
+    start_workers();
+
     // Install SLIP data handlers
     int slip_fds[num_addrs];
     for (int i = 0; i < num_addrs; i++) {
@@ -662,7 +4326,7 @@ int main(int argc, char *argv[]) {
         inet_ntop(AF_INET6, &sim_addrs[i], addr_str, sizeof(addr_str));
 
         printf("Setting up SLIP data handler on interface: %s\n", addr_str);
-        slip_fds[i] = install_slip_data_handler(i, data_handler);
+        slip_fds[i] = bond_install_handler(i, steer_packet);
         if (slip_fds[i] < 0) {
             fprintf(stderr, "Error: Failed to install SLIP data handler on %s\n", addr_str);
             return 1;
@@ -678,6 +4342,38 @@ int main(int argc, char *argv[]) {
     pthread_t timer_tid;
     pthread_create(&timer_tid, NULL, timer_thread, &num_addrs);
 
+    // Start expiry thread for learned routes
+    pthread_t expiry_tid;
+    pthread_create(&expiry_tid, NULL, expiry_thread, NULL);
+
+    // Start route checkpoints
+    if (checkpoint_map != NULL) {
+        pthread_t checkpoint_tid;
+        pthread_create(&checkpoint_tid, NULL, checkpoint_thread, NULL);
+    }
+
+    // Start flow telemetry
+    if (flow_target != NULL) {
+        pthread_t flow_tid;
+        pthread_create(&flow_tid, NULL, flow_export_thread, NULL);
+    }
+
+    // Start neighbor liveness detection, which also watches bond members
+    if (hello_interval_ms > 0 || num_bonds > 0) {
+        pthread_t liveness_tid;
+        pthread_create(&liveness_tid, NULL, liveness_thread, NULL);
+    }
+
+    // Start control socket, the router still runs without it
+    static int control_fd;
+    control_fd = open_control_socket(CONTROL_SOCKET);
+    if (control_fd < 0) {
+        fprintf(stderr, "Warning: Could not create %s, control socket disabled\n", CONTROL_SOCKET);
+    } else {
+        pthread_t control_tid;
+        pthread_create(&control_tid, NULL, control_thread, &control_fd);
+    }
+
     // Main loop
     printf("Router is running. Press Ctrl+C to exit.\n");
     while (1) {
@@ -685,4 +4381,80 @@ int main(int argc, char *argv[]) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif /* !FWD_BENCH && !ROUTER_SIM */
+
+#ifdef ROUTER_SIM
+// ============================================================================
+// SIMULATION
+// ============================================================================
+
+// netsim.c loads this file, built with -DROUTER_SIM, once per simulated
+// router. No thread is started: the simulator calls in to deliver a frame,
+// to let an interface send its next one, and to run the timers below, one
+// call at a time on its virtual clock.
+static uint64_t sim_next_advert_ms;
+static uint64_t sim_next_expiry_ms;
+static uint64_t sim_next_liveness_ms;
+
+/**
+ * Bring up a router with these interface addresses, as main does before it
+ * starts its threads. Packets are forwarded by the receiving call, and a
+ * negative hello_ms keeps the default, hellos off.
+ * Returns 0, or -1 if an interface could not be attached
+ */
+int sim_router_init(int n, const struct in6_addr *addrs, int hello_ms) {
+    verbose = 0;
+    num_workers = 0;
+    num_addrs = n;
+    if (allocate_interfaces() != 0) {
+        return -1;
+    }
+    memcpy(sim_addrs, addrs, n * sizeof(struct in6_addr));
+    if (hello_ms >= 0) {
+        hello_interval_ms = hello_ms;
+    }
+
+    initialize_policers();
+    tw_init(&route_wheel, expiry_ticks_now());
+    initialize_routing_table();
+    for (int i = 0; i < num_addrs; i++) {
+        if (install_slip_data_handler(i, steer_packet) < 0) {
+            return -1;
+        }
+    }
+    initialize_send_locks();
+
+    uint64_t now = monotonic_ms();
+    sim_next_advert_ms = now + ADVERT_INTERVAL_MS;
+    sim_next_expiry_ms = now + EXPIRY_TICK_MS;
+    sim_next_liveness_ms = now + LIVENESS_TICK_MS;
+    return 0;
+}
+
+/**
+ * Do the timer, expiry and liveness threads' work that is due
+ * Returns the time in ms the next is due
+ */
+uint64_t sim_run_timers() {
+    uint64_t now = monotonic_ms();
+    if (now >= sim_next_expiry_ms) {
+        expire_routes();
+        sim_next_expiry_ms = now + EXPIRY_TICK_MS;
+    }
+    if (hello_interval_ms > 0 && now >= sim_next_liveness_ms) {
+        check_neighbors(now);
+        sim_next_liveness_ms = now + LIVENESS_TICK_MS;
+    }
+    if (now >= sim_next_advert_ms) {
+        advertise_routes(num_addrs);
+        sim_next_advert_ms = now + ADVERT_INTERVAL_MS;
+    }
+
+    uint64_t next = sim_next_advert_ms < sim_next_expiry_ms ? sim_next_advert_ms : sim_next_expiry_ms;
+    if (hello_interval_ms > 0 && sim_next_liveness_ms < next) {
+        next = sim_next_liveness_ms;
+    }
+    return next;
+}
+#endif /* ROUTER_SIM */
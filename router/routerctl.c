@@ -0,0 +1,114 @@
+/**
+ * routerctl.c
+ * Send commands to a running router over its control socket.
+ *
+ * to compile: gcc -Wall -Wextra routerctl.c -o routerctl
+ * usage: routerctl [-s socket] [command ...]
+ *   with a command, sends it as one line, e.g. routerctl dump
+ *   without one, sends stdin line by line, e.g. routerctl < routes.txt
+ *   commands: dump, counters, reset, link <iface> up|down, links,
+ *   add <prefix>[/len] <gateway> [metric], del <prefix>[/len],
+ *   acl add in|out permit|deny [iface <n>] [src <prefix>[/len]] [dst <prefix>[/len]]
+ *   [proto <n>|tcp|udp|icmp6] [sport <lo>[-<hi>]] [dport <lo>[-<hi>]],
+ *   acl del in|out <n>, acl clear in|out, acl show,
+ *   police <iface>|all <prefix_len> <bytes/s> <burst>, police <iface>|all off, police show,
+ *   flows, flows sample <N>|off
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONTROL_SOCKET "./router.ctl"  /* Same path as in router.c */
+
+/**
+ * Write all of buf, returns 0 on success
+ */
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = CONTROL_SOCKET;
+
+    int argi = 1;
+    if (argi < argc && strcmp(argv[argi], "-s") == 0) {
+        if (argi + 1 >= argc) {
+            fprintf(stderr, "Usage: %s [-s socket] [command ...]\n", argv[0]);
+            return 1;
+        }
+        path = argv[argi + 1];
+        argi += 2;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    // A command on the command line is sent as one line
+    if (argi < argc) {
+        for (int i = argi; i < argc; i++) {
+            if (write_all(fd, argv[i], strlen(argv[i])) != 0 ||
+                write_all(fd, i + 1 < argc ? " " : "\n", 1) != 0) {
+                perror("write");
+                return 1;
+            }
+        }
+        shutdown(fd, SHUT_WR);
+    }
+
+    // Otherwise copy stdin while reading replies, so neither side's
+    // socket buffer can fill up and stall a bulk load
+    int input_open = argi >= argc;
+    char buf[65536];
+    while (1) {
+        struct pollfd fds[2] = {
+            { fd, POLLIN, 0 },
+            { STDIN_FILENO, POLLIN, 0 },
+        };
+        if (poll(fds, input_open ? 2 : 1, -1) < 0) {
+            perror("poll");
+            return 1;
+        }
+
+        if (fds[0].revents) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+            fwrite(buf, 1, n, stdout);
+        }
+        if (input_open && fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) {
+                shutdown(fd, SHUT_WR);
+                input_open = 0;
+            } else if (write_all(fd, buf, n) != 0) {
+                perror("write");
+                return 1;
+            }
+        }
+    }
+
+    close(fd);
+    return 0;
+}
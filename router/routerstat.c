@@ -0,0 +1,117 @@
+/**
+ * routerstat.c
+ * Live view of a running router's counters, read from its counters file.
+ *
+ * to compile: gcc -Wall -Wextra routerstat.c -o routerstat
+ * usage: routerstat [-i seconds] [counters_file]
+ *   run it in the router's directory, or give the path to router.counters
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "counters.h"
+
+/**
+ * Sum every counter of every interface over all thread blocks
+ */
+void read_totals(struct counters_header *header, uint64_t *totals) {
+    memset(totals, 0, header->num_ifaces * NUM_COUNTERS * sizeof(uint64_t));
+    for (uint32_t t = 0; t < header->num_threads; t++) {
+        for (uint32_t i = 0; i < header->num_ifaces; i++) {
+            struct iface_counters *c = counters_at(header, t, i);
+            for (int id = 0; id < NUM_COUNTERS; id++) {
+                totals[i * NUM_COUNTERS + id] +=
+                    atomic_load_explicit(&c->value[id], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = COUNTERS_FILE;
+    int interval = 1;
+
+    int argi = 1;
+    if (argi + 1 < argc && strcmp(argv[argi], "-i") == 0) {
+        interval = atoi(argv[argi + 1]);
+        argi += 2;
+    }
+    if (argi < argc) {
+        path = argv[argi];
+    }
+    if (interval < 1) {
+        fprintf(stderr, "Usage: %s [-i seconds] [counters_file]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct counters_header)) {
+        fprintf(stderr, "Error: %s is not a counters file.\n", path);
+        return 1;
+    }
+    struct counters_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (header->magic != COUNTERS_MAGIC || header->version != COUNTERS_VERSION ||
+        header->num_counters != NUM_COUNTERS ||
+        (size_t)st.st_size < COUNTERS_SIZE(header->num_threads, header->num_ifaces)) {
+        fprintf(stderr, "Error: %s is not a version %d counters file.\n", path, COUNTERS_VERSION);
+        return 1;
+    }
+
+    const char *names[] = COUNTER_NAMES;
+    int n = header->num_ifaces * NUM_COUNTERS;
+    uint64_t *previous = calloc(n, sizeof(uint64_t));
+    uint64_t *current = calloc(n, sizeof(uint64_t));
+    read_totals(header, previous);
+
+    while (1) {
+        sleep(interval);
+        read_totals(header, current);
+
+        printf("\n=== Router %u counters (per second over %d s, then totals) ===\n",
+               header->pid, interval);
+        uint32_t shared = __atomic_load_n(&header->shared_threads, __ATOMIC_RELAXED);
+        if (shared > 0) {
+            printf("%u thread(s) had no block of their own and counted in the shared one\n",
+                   shared);
+        }
+        printf("%-5s %10s %10s %10s %10s", "Iface", "rx pps", "rx B/s", "tx pps", "tx B/s");
+        for (int id = CTR_DROP_TOO_SHORT; id < NUM_COUNTERS; id++) {
+            printf(" %12s", names[id]);
+        }
+        printf("\n");
+        for (uint32_t i = 0; i < header->num_ifaces; i++) {
+            uint64_t *now = &current[i * NUM_COUNTERS];
+            uint64_t *then = &previous[i * NUM_COUNTERS];
+            printf("%-5u", i);
+            for (int id = CTR_RX_PACKETS; id <= CTR_TX_BYTES; id++) {
+                printf(" %10.1f", (double)(now[id] - then[id]) / interval);
+            }
+            for (int id = CTR_DROP_TOO_SHORT; id < NUM_COUNTERS; id++) {
+                printf(" %12llu", (unsigned long long)now[id]);
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+
+        uint64_t *swap = previous;
+        previous = current;
+        current = swap;
+    }
+    return 0;
+}
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -49,10 +50,16 @@ struct simulation_config {
   int in_use;
 };
 
-static struct simulation_config tty_sim [MAX_TTYS];
+/* one per valid line of simconfig, grown as they are read */
+static struct simulation_config * tty_sim = NULL;
+static int tty_sim_size = 0;
 
 static int valid_ttys = 0;
 
+/* receive threads run the data handlers, which need little stack, and
+   there may be thousands of them */
+#define RECEIVE_THREAD_STACK (256 * 1024)
+
 #define simerror(message) { perror (message); exit(1); }
 
 static void read_config_file ()
@@ -65,11 +72,13 @@ static void read_config_file ()
     int line = 0;
     struct protoent * protocolentry = getprotobyname ("udp");
     int protocol;
-    int unused_tty;
+    struct rlimit files;
 
-    for (unused_tty = 0; unused_tty < MAX_TTYS; unused_tty++) {
-      tty_sim [unused_tty].socket = -1;
-      tty_sim [unused_tty].in_use = 0;
+    /* every tty is a socket, so allow as many as the hard limit does */
+    if ((getrlimit (RLIMIT_NOFILE, &files) == 0) &&
+        (files.rlim_cur < files.rlim_max)) {
+      files.rlim_cur = files.rlim_max;
+      setrlimit (RLIMIT_NOFILE, &files);
     }
     if (protocolentry == NULL)
       simerror ("getprotobyname");
@@ -94,6 +103,14 @@ static void read_config_file ()
       if ((rport != linebuf) && (hostname != rport) && /* conversion ok */
 	  (local_port <= 65535) && (local_port > 0) && /* looks good */
 	  (remote_port <= 65535) && (remote_port > 0)) {
+	if (valid_ttys == tty_sim_size) {
+	  tty_sim_size = (tty_sim_size == 0) ? 16 : 2 * tty_sim_size;
+	  tty_sim = realloc (tty_sim, tty_sim_size * sizeof (struct simulation_config));
+	  if (tty_sim == NULL)
+	    simerror ("realloc");
+	}
+	tty_sim [valid_ttys].socket = -1;
+	tty_sim [valid_ttys].in_use = 0;
 	tty_sim [valid_ttys].local_port = local_port;
 	/* get rid of whitespace before calling gethostbyname */
 	/* first get rid of any initial whitespace */
@@ -161,7 +178,7 @@ static int initialize_tty (int tty_number)
 {
   read_config_file ();	/* only actually read once, but called many times */
 
-  if (tty_number >= MAX_TTYS) { simerror ("tty number"); }
+  if (tty_number < 0) { simerror ("tty number"); }
   if (tty_number >= valid_ttys) { return -1; }
   if (tty_sim [tty_number].socket < 0) { simerror ("invalid tty"); }
   if (tty_sim [tty_number].in_use) { simerror ("tty already in use"); }
@@ -216,6 +233,7 @@ static void * tty_receive_thread (void * argument)
 int install_tty_data_handler (int tty, void (* data_handler) (int, char))
 {
   pthread_t thread;
+  pthread_attr_t attr;
   int actual_tty = initialize_tty (tty);
   struct receive_thread_arg * arg =
     (struct receive_thread_arg *) malloc (sizeof (struct receive_thread_arg));
@@ -226,10 +244,13 @@ int install_tty_data_handler (int tty, void (* data_handler) (int, char))
   }
   arg->tty = actual_tty;
   arg->data_handler = data_handler;
-  if (pthread_create (&thread, NULL, &tty_receive_thread, (void *) arg) < 0) {
+  pthread_attr_init (&attr);
+  pthread_attr_setstacksize (&attr, RECEIVE_THREAD_STACK);
+  if (pthread_create (&thread, &attr, &tty_receive_thread, (void *) arg) != 0) {
     perror ("pthread_create");
     exit (1);
   }
+  pthread_attr_destroy (&attr);
   return actual_tty;
 }
 
@@ -251,22 +272,24 @@ int write_tty_data (int tty, char data)
 /* this is a sample program to exercise the above code */
 
 /* my data handler simply prints any received data to the screen */
+#define TEST_TTYS 4
+
 static void my_test_data_handler (int tty, char c)
 {
-  static int new [MAX_TTYS];
+  static int new [TEST_TTYS];
   static int initialized = 0;
-  static int most_recent = MAX_TTYS;
+  static int most_recent = TEST_TTYS;
 
   if (! initialized) {
     int i;
-    for (i = 0; i < MAX_TTYS; i++)
+    for (i = 0; i < TEST_TTYS; i++)
       new [i] = 1;
     initialized = 1;
   }
   if (tty == most_recent) {
     putchar (c);
     if (c == '\n')
-      most_recent = MAX_TTYS;
+      most_recent = TEST_TTYS;
   } else {
     most_recent = tty;
     printf ("\n-- %d: ", tty);
@@ -278,11 +301,11 @@ int main (int argc, char ** argv)
 {
   if (argc < 0)
     printf ("%s: error, argc is %d\n", argv [0], argc);
-  int ttys [MAX_TTYS];
+  int ttys [TEST_TTYS];
   char data_to_send [] = "this is my test data\n123\n";
   int i, tty;
 
-  for (tty = 0; tty < MAX_TTYS; tty++) {
+  for (tty = 0; tty < TEST_TTYS; tty++) {
     ttys [tty] = -1;
     if (tty < 4) {
       ttys [tty] = install_tty_data_handler (tty, my_test_data_handler); 
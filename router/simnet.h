@@ -12,6 +12,6 @@ int install_tty_data_handler (int tty, void (*) (int, char));
 
 int write_tty_data (int tty, char data);
 
-#define MAX_TTYS        100
+/* there is one tty per valid line of simconfig, with no fixed maximum */
 
 #define CONFIG_FILE "./simconfig"
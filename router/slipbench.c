@@ -0,0 +1,295 @@
+/**
+ * slipbench.c
+ * Micro-benchmarks for the SLIP codec in slipnet.c and the simnet transport
+ * under it. The link-time wraps below put this program between the two, so
+ * the unmodified slipnet.c and simnet.c are measured:
+ *   codec      write_slip_data into a tty stub that only collects the bytes,
+ *              then the collected bytes fed one at a time to slipnet's
+ *              receive handler, reported as payload MB/s for frames with no
+ *              bytes to escape, all END bytes (worst case), and random bytes
+ *   transport  frames sent on tty 0 of a simnet loopback pair (tty 0 and 1
+ *              in a generated simconfig) and timed until they arrive on
+ *              tty 1, with the sendto, recvfrom and nanosleep calls per frame
+ *
+ * to compile: gcc -O2 -Wall -Wextra slipbench.c slipnet.c simnet.c -lpthread \
+ *             -Wl,--wrap=install_tty_data_handler,--wrap=write_tty_data \
+ *             -Wl,--wrap=sendto,--wrap=recvfrom,--wrap=nanosleep -o slipbench
+ * usage: slipbench codec [-n frames] [-s bytes]
+ *        slipbench transport [-n frames] [-s bytes] [-P port] [-d dir]
+ *   defaults: codec -n 20000 -s 1006, transport -n 20 -s 100 -P 30000 -d ./slipbench.d
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "slipnet.h"
+#include "simnet.h"
+
+// ============================================================================
+// TTY LAYER WRAPS
+// ============================================================================
+
+static int use_stub = 1;                        /* Codec mode, no simnet */
+static void (*tty_handler[2])(int, char);       /* slipnet's receive handlers, ttys 0 and 1 */
+static char *stub_bytes;                        /* Bytes written in codec mode */
+static size_t stub_used, stub_size;
+
+static atomic_long num_sendto, num_recvfrom, num_nanosleep;
+
+int __real_install_tty_data_handler(int tty, void (*handler)(int, char));
+int __real_write_tty_data(int tty, char data);
+ssize_t __real_sendto(int fd, const void *buf, size_t len, int flags,
+                      const struct sockaddr *addr, socklen_t addrlen);
+ssize_t __real_recvfrom(int fd, void *buf, size_t len, int flags,
+                        struct sockaddr *addr, socklen_t *addrlen);
+int __real_nanosleep(const struct timespec *req, struct timespec *rem);
+
+int __wrap_install_tty_data_handler(int tty, void (*handler)(int, char)) {
+    tty_handler[tty] = handler;
+    return use_stub ? tty : __real_install_tty_data_handler(tty, handler);
+}
+
+int __wrap_write_tty_data(int tty, char data) {
+    if (!use_stub) {
+        return __real_write_tty_data(tty, data);
+    }
+    if (stub_used == stub_size) {
+        return -1;
+    }
+    stub_bytes[stub_used++] = data;
+    return 1;
+}
+
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags,
+                      const struct sockaddr *addr, socklen_t addrlen) {
+    atomic_fetch_add(&num_sendto, 1);
+    return __real_sendto(fd, buf, len, flags, addr, addrlen);
+}
+
+ssize_t __wrap_recvfrom(int fd, void *buf, size_t len, int flags,
+                        struct sockaddr *addr, socklen_t *addrlen) {
+    atomic_fetch_add(&num_recvfrom, 1);
+    return __real_recvfrom(fd, buf, len, flags, addr, addrlen);
+}
+
+int __wrap_nanosleep(const struct timespec *req, struct timespec *rem) {
+    atomic_fetch_add(&num_nanosleep, 1);
+    return __real_nanosleep(req, rem);
+}
+
+// ============================================================================
+// FRAMES
+// ============================================================================
+
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rx_cond = PTHREAD_COND_INITIALIZER;
+static long rx_frames;
+static long rx_bytes;
+
+/**
+ * SLIP data handler, counts complete frames
+ */
+static void count_frame(int tty, const void *data, int numbytes) {
+    (void)tty;
+    (void)data;
+    pthread_mutex_lock(&rx_lock);
+    rx_frames++;
+    rx_bytes += numbytes;
+    pthread_cond_signal(&rx_cond);
+    pthread_mutex_unlock(&rx_lock);
+}
+
+/**
+ * Fill a frame: bytes that never need escaping, all END bytes, or random
+ */
+void fill_frame(char *frame, int size, const char *distribution) {
+    for (int i = 0; i < size; i++) {
+        if (strcmp(distribution, "no-escapes") == 0) {
+            frame[i] = 'a' + i % 26;
+        } else if (strcmp(distribution, "all-end") == 0) {
+            frame[i] = (char)SLIP_END;
+        } else {
+            frame[i] = rand();
+        }
+    }
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ============================================================================
+// BENCHMARKS
+// ============================================================================
+
+/**
+ * Encode then decode num_frames frames of each payload distribution
+ */
+void bench_codec(int num_frames, int size) {
+    static const char *distributions[] = { "no-escapes", "all-end", "random" };
+    char frame[MAX_SLIP_SEND];
+    install_slip_data_handler(0, count_frame);
+
+    // Room for the worst case, every byte escaped plus two END bytes a frame
+    stub_size = (size_t)num_frames * (2 * size + 2);
+    stub_bytes = malloc(stub_size);
+
+    printf("codec: %d frames of %d bytes\n", num_frames, size);
+    printf("%-12s %12s %12s %14s\n", "payload", "encode MB/s", "decode MB/s", "wire bytes/B");
+    for (int d = 0; d < 3; d++) {
+        fill_frame(frame, size, distributions[d]);
+
+        stub_used = 0;
+        double start = now_seconds();
+        for (int n = 0; n < num_frames; n++) {
+            write_slip_data(0, frame, size);
+        }
+        double encode = now_seconds() - start;
+
+        rx_frames = 0;
+        start = now_seconds();
+        for (size_t i = 0; i < stub_used; i++) {
+            tty_handler[0](0, stub_bytes[i]);
+        }
+        double decode = now_seconds() - start;
+        if (rx_frames != num_frames) {
+            printf("%-12s decoded %ld of %d frames\n", distributions[d], rx_frames, num_frames);
+        }
+
+        double payload = (double)num_frames * size;
+        printf("%-12s %12.1f %12.1f %14.2f\n", distributions[d],
+               payload / encode / 1e6, payload / decode / 1e6, stub_used / payload);
+    }
+}
+
+/**
+ * Send frames one at a time over a simnet loopback pair, timing each
+ */
+int bench_transport(int num_frames, int size, int port, const char *dir) {
+    // simnet reads ./simconfig, so the pair gets its own directory
+    mkdir(dir, 0755);
+    if (chdir(dir) != 0) {
+        perror(dir);
+        return 1;
+    }
+    FILE *f = fopen(CONFIG_FILE, "w");
+    if (f == NULL) {
+        perror(CONFIG_FILE);
+        return 1;
+    }
+    fprintf(f, "%d %d localhost\n%d %d localhost\n", port, port + 1, port + 1, port);
+    fclose(f);
+
+    use_stub = 0;
+    if (install_slip_data_handler(0, count_frame) < 0 ||
+        install_slip_data_handler(1, count_frame) < 0) {
+        fprintf(stderr, "Error: Could not open the loopback pair.\n");
+        return 1;
+    }
+
+    char frame[MAX_SLIP_SEND];
+    fill_frame(frame, size, "random");
+    double *latency = malloc(num_frames * sizeof(double));
+    atomic_store(&num_sendto, 0);
+    atomic_store(&num_recvfrom, 0);
+    atomic_store(&num_nanosleep, 0);
+
+    rx_frames = 0;
+    double total_start = now_seconds();
+    for (int n = 0; n < num_frames; n++) {
+        double start = now_seconds();
+        write_slip_data(0, frame, size);
+
+        // Wait up to a second after sending for the frame to arrive
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_mutex_lock(&rx_lock);
+        while (rx_frames <= n &&
+               pthread_cond_timedwait(&rx_cond, &rx_lock, &deadline) == 0) {
+        }
+        int arrived = rx_frames > n;
+        pthread_mutex_unlock(&rx_lock);
+        if (!arrived) {
+            printf("transport: frame %d lost, stopping\n", n);
+            num_frames = n;
+            break;
+        }
+        latency[n] = now_seconds() - start;
+    }
+    double total = now_seconds() - total_start;
+    if (num_frames == 0) {
+        return 1;
+    }
+
+    double sum = 0, min = latency[0], max = latency[0];
+    for (int n = 0; n < num_frames; n++) {
+        sum += latency[n];
+        min = latency[n] < min ? latency[n] : min;
+        max = latency[n] > max ? latency[n] : max;
+    }
+    printf("transport: %d frames of %d random bytes over a simnet loopback pair\n",
+           num_frames, size);
+    printf("transport: latency min %.2f avg %.2f max %.2f ms, %.0f payload bytes/s\n",
+           min * 1e3, sum / num_frames * 1e3, max * 1e3, (double)num_frames * size / total);
+    printf("transport: per frame %.1f sendto, %.1f recvfrom, %.1f nanosleep\n",
+           (double)atomic_load(&num_sendto) / num_frames,
+           (double)atomic_load(&num_recvfrom) / num_frames,
+           (double)atomic_load(&num_nanosleep) / num_frames);
+    free(latency);
+    return 0;
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || (strcmp(argv[1], "codec") != 0 && strcmp(argv[1], "transport") != 0)) {
+        fprintf(stderr, "Usage: %s codec [-n frames] [-s bytes]\n"
+                        "       %s transport [-n frames] [-s bytes] [-P port] [-d dir]\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+    int codec = strcmp(argv[1], "codec") == 0;
+    int num_frames = codec ? 20000 : 20;
+    int size = codec ? MAX_SLIP_SEND : 100;
+    int port = 30000;
+    const char *dir = "./slipbench.d";
+
+    for (int argi = 2; argi < argc; argi += 2) {
+        if (argi + 1 >= argc || argv[argi][0] != '-' || strlen(argv[argi]) != 2) {
+            fprintf(stderr, "Error: Missing value for '%s'.\n", argv[argi]);
+            return 1;
+        }
+        const char *value = argv[argi + 1];
+        switch (argv[argi][1]) {
+        case 'n': num_frames = atoi(value); break;
+        case 's': size = atoi(value); break;
+        case 'P': port = atoi(value); break;
+        case 'd': dir = value; break;
+        default:
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[argi]);
+            return 1;
+        }
+    }
+    if (num_frames < 1 || size < 1 || size > MAX_SLIP_SEND || port < 1025 || port > 65534) {
+        fprintf(stderr, "Error: Option out of range.\n");
+        return 1;
+    }
+
+    if (codec) {
+        bench_codec(num_frames, size);
+        return 0;
+    }
+    return bench_transport(num_frames, size, port, dir);
+}
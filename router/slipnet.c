@@ -5,28 +5,89 @@
 /* to compile: gcc -Wall -Wextra -DRUN_SLIP_TEST slipnet.c simnet.c -o slipnet */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "slipnet.h"
 #include "simnet.h"
+#include "probes.h"
 
-/* buffers for the data */
-static char receive_buffer [MAX_TTYS] [MAX_SLIP_SIZE];
-/* this is the position to which we add newly received characters */
-static int receive_position [MAX_TTYS];
-/* record whether the last character for this buffer was an escape character */
-static int escaped [MAX_TTYS];
-/* true if an error was detected in the current frame */
-static int error_frame [MAX_TTYS];
-/* serialize all access to the buffers */
-static pthread_mutex_t receive_mutex [MAX_TTYS];
-static pthread_mutex_t send_mutex [MAX_TTYS];
+typedef void (* my_data_handler) (int, const void *, int);
+
+/* the state of one tty, allocated when it is opened.  What the receive
+   thread touches for every byte fills the first cache line, the handler
+   and buffer follow, and the send lock has a line of its own so senders
+   do not take the receiver's line away */
+#define CACHE_LINE 64
+struct slip_tty {
+  /* serialize all access to the buffer */
+  pthread_mutex_t receive_mutex;
+  /* this is the position to which we add newly received characters */
+  int receive_position;
+  /* record whether the last character for this buffer was an escape character */
+  int escaped;
+  /* true if an error was detected in the current frame */
+  int error_frame;
+  /* count of all bytes received, in frames or not */
+  unsigned long bytes_received;
+  my_data_handler slip_data_handler;
+  /* buffer for the data */
+  char receive_buffer [MAX_SLIP_SIZE];
+  pthread_mutex_t send_mutex __attribute__ ((aligned (CACHE_LINE)));
+};
+
+/* the opened ttys by number, NULL if not opened.  The table only grows,
+   with global_mutex held, and a table that was replaced is never freed
+   since another thread may still be reading it, so looking up a tty
+   takes no lock */
+struct tty_table {
+  int size;
+  struct slip_tty * ttys [];
+};
+static struct tty_table * _Atomic tty_table = NULL;
 /* serialize access to the global data */
 static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
-/* the data handlers are also global. */
-typedef void (* my_data_handler) (int, const void *, int);
-static my_data_handler slip_data_handler [MAX_TTYS];
+/* optional, told about receive errors */
+static void (* slip_error_handler) (int, int) = NULL;
+
+/* returns the state of an opened tty, or NULL */
+static struct slip_tty * tty_state (int tty)
+{
+  struct tty_table * table =
+    atomic_load_explicit (&tty_table, memory_order_acquire);
+
+  if ((table == NULL) || (tty < 0) || (tty >= table->size))
+    return NULL;
+  return table->ttys [tty];
+}
+
+/* makes room in the table for tty, call with global_mutex held.
+   returns 0, or -1 if out of memory */
+static int grow_tty_table (int tty)
+{
+  struct tty_table * old = atomic_load_explicit (&tty_table, memory_order_relaxed);
+  struct tty_table * table;
+  int size = (old == NULL) ? 16 : old->size;
+  int i = 0;
+
+  if (tty < size && old != NULL)
+    return 0;
+  while (size <= tty)
+    size *= 2;
+  table = malloc (sizeof (struct tty_table) + size * sizeof (struct slip_tty *));
+  if (table == NULL)
+    return -1;
+  table->size = size;
+  if (old != NULL)
+    for (; i < old->size; i++)
+      table->ttys [i] = old->ttys [i];
+  for (; i < size; i++)
+    table->ttys [i] = NULL;
+  atomic_store_explicit (&tty_table, table, memory_order_release);
+  return 0;
+}
 
 /* useful for printing IPv6 and other packets */
 /* prints the first 8 bytes, then 16 bytes per line.  This works well
@@ -49,21 +110,25 @@ void print_packet (char * string, const void * vdata, int numbytes)
   }
 }
 
-static void put_char_in_buffer (int tty, unsigned char c)
+static void put_char_in_buffer (struct slip_tty * state, int tty, unsigned char c)
 {
-  if (receive_position [tty] < MAX_SLIP_SIZE - 1) {
-    receive_buffer [tty] [(receive_position [tty])++] = c;
+  if (state->receive_position < MAX_SLIP_SIZE - 1) {
+    state->receive_buffer [(state->receive_position)++] = c;
   } else {
     printf ("error: slip framing error on port %d, maybe lost END\n", tty);
     /* discard the character -- basically, we don't save it anywhere. */
     /* also make sure the current frame is discarded */
-    error_frame [tty] = 1;
+    if ((! state->error_frame) && (slip_error_handler != NULL))
+      slip_error_handler (tty, SLIP_ERROR_FRAMING);
+    state->error_frame = 1;
   }
 }
 
 static void data_handler_for_tty (int tty, char signed_char)
 {
   int c = signed_char & 0xff;   /* convert negative chars to chars >= 128 */
+  struct slip_tty * state;
+  PROBE (slip_rx_byte, tty, c);
 #ifdef DEBUG
   printf ("  received character %x/%o on port %d\n", c, c, tty);
 #endif /* DEBUG */
@@ -71,59 +136,66 @@ static void data_handler_for_tty (int tty, char signed_char)
   pthread_mutex_lock (&global_mutex);
   /* we have been initialized, so proceed */
   pthread_mutex_unlock (&global_mutex);
+  state = tty_state (tty);
+  if (state == NULL)   /* not opened through install_slip_data_handler */
+    return;
   /* acquire the lock for the receive buffer */
-  pthread_mutex_lock (&(receive_mutex [tty]));
-  if (error_frame [tty]) {
+  pthread_mutex_lock (&(state->receive_mutex));
+  state->bytes_received++;
+  if (state->error_frame) {
     if (c == SLIP_END) {
-      error_frame [tty] = 0;
-      receive_position [tty] = 0;
-      escaped [tty] = 0;
+      state->error_frame = 0;
+      state->receive_position = 0;
+      state->escaped = 0;
     }
   } else {
-    if (escaped [tty]) {	/* last character was an escape */
-      escaped [tty] = 0;
+    if (state->escaped) {	/* last character was an escape */
+      state->escaped = 0;
       if (c == SLIP_ESC_END) {
-        put_char_in_buffer (tty, SLIP_END);
+        put_char_in_buffer (state, tty, SLIP_END);
       } else if (c == SLIP_ESC_ESC) {
-        put_char_in_buffer (tty, SLIP_ESC);
+        put_char_in_buffer (state, tty, SLIP_ESC);
       } else {   /* this may be a legitimate oversight in the sender */
         printf ("warning: accepting illegal character after ESC\n");
-        put_char_in_buffer (tty, c);
+        if (slip_error_handler != NULL)
+          slip_error_handler (tty, SLIP_ERROR_ESCAPE);
+        put_char_in_buffer (state, tty, c);
       }
     } else {			/* last character was not ESC */
       if (c == SLIP_END) {	/* done, give packet to data handler. */
-        if (receive_position [tty] > 0) { /* packet is not empty */
-          if (slip_data_handler [tty] == NULL) {
+        if (state->receive_position > 0) { /* packet is not empty */
+          if (state->slip_data_handler == NULL) {
             /* no handler, drop packet */
             printf ("error: received packet, but no slip data handler\n");
-            print_packet ("received packet", receive_buffer [tty],
-                          receive_position [tty]);
-            receive_position [tty] = 0;
+            print_packet ("received packet", state->receive_buffer,
+                          state->receive_position);
+            state->receive_position = 0;
           } else {
 #ifdef DEBUG
-	    printf ("received %d bytes\n", receive_position [tty]);
-            print_packet ("received packet", receive_buffer [tty],
-                          receive_position [tty]);
+	    printf ("received %d bytes\n", state->receive_position);
+            print_packet ("received packet", state->receive_buffer,
+                          state->receive_position);
 #endif /* DEBUG */
+            PROBE (slip_frame, tty, state->receive_position, state->receive_buffer);
             /* note the receive buffer remains locked while we call the
                slip data handler.  If the slip data handler never returns,
                slip will deadlock, i.e., be unable to ever again receive data.
                This would also block the receive thread in ttynet. */
-            slip_data_handler [tty] (tty, receive_buffer [tty],
-                                     receive_position [tty]);
+            state->slip_data_handler (tty, state->receive_buffer,
+                                      state->receive_position);
           }
           /* get ready to start receiving a new packet */
-          receive_position [tty] = 0;
+          state->receive_position = 0;
         } /* else: silently ignore packets of size 0 */
       } else if (c == SLIP_ESC) {     /* signal for the next character */
-	escaped [tty] = 1;
+	state->escaped = 1;
       } else {                        /* 'normal' character */
-        put_char_in_buffer (tty, c);
+        put_char_in_buffer (state, tty, c);
       }
     }
   }
   /* finally make the buffer available to other threads. */
-  pthread_mutex_unlock (&(receive_mutex [tty]));
+  pthread_mutex_unlock (&(state->receive_mutex));
 }
 
 /* returns the identifier (an integer >= 0) to be used for write_slip_data */
@@ -131,48 +203,85 @@ int install_slip_data_handler
       (int tty, void (* data_handler) (int, const void *, int))
 {
   int fd;
-  pthread_mutex_t tmp = PTHREAD_MUTEX_INITIALIZER;
+  struct slip_tty * state;
 
   /* keep thread from executing until we are done initializing */
   pthread_mutex_lock (&(global_mutex));
+  /* the receive thread starts inside install_tty_data_handler and cannot
+     be stopped, so everything that can fail is done before it starts.
+     simnet returns the tty it was given as the identifier */
+  if ((grow_tty_table (tty) != 0) ||
+      (posix_memalign ((void **) &state, CACHE_LINE, sizeof (struct slip_tty)) != 0)) {
+    pthread_mutex_unlock (&global_mutex);
+    printf ("slip: out of memory for tty %d\n", tty);
+    return -1;
+  }
+  memset (state, 0, sizeof (struct slip_tty));
+  pthread_mutex_init (&(state->receive_mutex), NULL);
+  pthread_mutex_init (&(state->send_mutex), NULL);
+  state->slip_data_handler = data_handler;
   fd = install_tty_data_handler (tty, data_handler_for_tty); 
-  if (fd < 0) {
+  if ((fd < 0) || (grow_tty_table (fd) != 0)) {
+    /* if a thread was started it finds no state and drops its bytes */
     pthread_mutex_unlock (&global_mutex);
-    return fd;
+    pthread_mutex_destroy (&(state->receive_mutex));
+    pthread_mutex_destroy (&(state->send_mutex));
+    free (state);
+    return -1;
   }
-  receive_position [fd] = 0;
-  escaped [fd] = 0;
-  error_frame [fd] = 0;
-  memcpy (&(receive_mutex [fd]), &tmp, sizeof (tmp));
-  memcpy (&(send_mutex [fd]), &tmp, sizeof (tmp));
-  slip_data_handler [fd] = data_handler;
+  atomic_load_explicit (&tty_table, memory_order_relaxed)->ttys [fd] = state;
   pthread_mutex_unlock (&global_mutex);
   return fd;
 }
 
+void install_slip_error_handler (void (* handler) (int, int))
+{
+  slip_error_handler = handler;
+}
+
+unsigned long slip_bytes_received (int tty)
+{
+  struct slip_tty * state = tty_state (tty);
+  unsigned long result;
+
+  if (state == NULL)
+    return 0;
+  pthread_mutex_lock (&(state->receive_mutex));
+  result = state->bytes_received;
+  pthread_mutex_unlock (&(state->receive_mutex));
+  return result;
+}
+
 /* this is a macro so the return statement returns from write_slip_data */
 #define WRITE_BYTE(fd, c)                               \
     if (write_tty_data (fd, c) != 1) {                  \
-      pthread_mutex_unlock (&(send_mutex [fd]));        \
+      pthread_mutex_unlock (&(state->send_mutex));      \
       printf ("slip: error writing tty data\n");        \
+      PROBE (slip_tx_done, fd, numbytes, -1);           \
       return -1;                                        \
     }
 
 int write_slip_data (int fd, char * data, int numbytes)
 {
+  struct slip_tty * state = tty_state (fd);
   int byte;
 
   if ((numbytes <= 0) || (numbytes > MAX_SLIP_SEND)) {
     printf ("slip: bad size %d\n", numbytes);
     return -1;
   }
+  if (state == NULL) {
+    printf ("slip: tty %d is not open\n", fd);
+    return -1;
+  }
 #ifdef DEBUG
   printf ("acquiring send lock for tty %d\n", fd);
 #endif /* DEBUG */
-  pthread_mutex_lock (&(send_mutex [fd]));
+  pthread_mutex_lock (&(state->send_mutex));
 #ifdef DEBUG
   print_packet ("sending packet", data, numbytes);
 #endif /* DEBUG */
+  PROBE (slip_tx_start, fd, numbytes, data);
   WRITE_BYTE (fd, SLIP_END);        /* start with an END byte */
   for (byte = 0; byte < numbytes; byte++) {
     int c = (data [byte]) & 0xff;
@@ -187,7 +296,8 @@ int write_slip_data (int fd, char * data, int numbytes)
     }
   }
   WRITE_BYTE (fd, SLIP_END);        /* end with an END byte */
-  pthread_mutex_unlock (&(send_mutex [fd]));
+  pthread_mutex_unlock (&(state->send_mutex));
+  PROBE (slip_tx_done, fd, numbytes, numbytes);
   return numbytes;
 }
 
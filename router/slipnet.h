@@ -8,10 +8,6 @@
 #define MAX_SLIP_SEND   1006
 #define MAX_SLIP_SIZE   1024   /* let senders send us a larger packet */
 
-#ifndef MAX_TTYS
-#define MAX_TTYS	100
-#endif /* MAX_TTYS */
-
 /* call to install a data handler to receive incoming packets.
  * returns its first parameter, which should be a valid TTY number.
  * the handler is called once a complete packet has been received.
@@ -28,6 +24,17 @@ extern int
 
 extern int write_slip_data (int, char *, int);
 
+/* call to be told about receive errors, e.g. to count them.
+ * the handler is called with the tty number and one of: */
+#define SLIP_ERROR_FRAMING   1  /* frame too long (maybe lost END), dropped */
+#define SLIP_ERROR_ESCAPE    2  /* ESC followed by neither ESC_END nor ESC_ESC */
+extern void install_slip_error_handler (void (* handler) (int, int));
+
+/* returns the number of bytes received so far on a tty, whether or not
+ * they completed a packet.  A change shows the sender is alive even while
+ * a long packet is still arriving */
+extern unsigned long slip_bytes_received (int tty);
+
 /* special characters (bytes) defined by SLIP */
 #define SLIP_END             0300    /* indicates end of packet */
 #define SLIP_ESC             0333    /* indicates byte stuffing */
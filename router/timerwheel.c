@@ -0,0 +1,198 @@
+/**
+ * timerwheel.c
+ * Hierarchical timer wheel with O(1) schedule and cancel.
+ *
+ * Level 0 has one slot per tick for the next 64 ticks, level 1 one slot per
+ * 64 ticks for the next 64*64 ticks, and so on. When level 0 wraps, the next
+ * level 1 slot is cascaded down into level 0, so a timer is moved at most
+ * TW_LEVELS - 1 times before it fires, and a timer that is rescheduled
+ * before it ever cascades costs only an unlink and a link. Timers further
+ * out than the top level can reach wait in its farthest slot and are
+ * re-filed when that slot cascades.
+ */
+
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+static void list_init(struct tw_timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_add(struct tw_timer *head, struct tw_timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void tw_init(struct timer_wheel *wheel, uint64_t now) {
+    wheel->now = now;
+    for (int level = 0; level < TW_LEVELS; level++) {
+        for (int slot = 0; slot < TW_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+int tw_pending(const struct tw_timer *timer) {
+    return timer->next != NULL;
+}
+
+void tw_cancel(struct tw_timer *timer) {
+    if (timer->next != NULL) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->next = NULL;
+        timer->prev = NULL;
+    }
+}
+
+/**
+ * File a timer into the slot that covers tick expires, which must not be
+ * earlier than the tick being processed
+ */
+static void file_timer(struct timer_wheel *wheel, struct tw_timer *timer, uint64_t expires) {
+    uint64_t delta = expires - wheel->now;
+    int level;
+
+    for (level = 0; level < TW_LEVELS - 1; level++) {
+        if (delta < ((uint64_t)1 << (TW_SLOT_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    if (level == TW_LEVELS - 1 && delta >= ((uint64_t)1 << (TW_SLOT_BITS * TW_LEVELS))) {
+        // Beyond the wheel, park in the farthest top-level slot
+        expires = wheel->now + ((uint64_t)1 << (TW_SLOT_BITS * TW_LEVELS)) - 1;
+    }
+    list_add(&wheel->slots[level][(expires >> (TW_SLOT_BITS * level)) & TW_MASK], timer);
+}
+
+void tw_schedule(struct timer_wheel *wheel, struct tw_timer *timer, uint64_t expires) {
+    tw_cancel(timer);
+    timer->expires = expires;
+    // The current tick has already fired, so overdue timers take the next one
+    file_timer(wheel, timer, expires > wheel->now ? expires : wheel->now + 1);
+}
+
+/**
+ * Move every timer in a higher-level slot down to where it now belongs
+ */
+static void cascade(struct timer_wheel *wheel, int level, int slot) {
+    struct tw_timer *head = &wheel->slots[level][slot];
+    if (head->next == head) {
+        return;
+    }
+
+    // Detach the whole slot first, since refiling may land in it again
+    struct tw_timer pending;
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+
+    while (pending.next != &pending) {
+        struct tw_timer *timer = pending.next;
+        tw_cancel(timer);
+        file_timer(wheel, timer, timer->expires > wheel->now ? timer->expires : wheel->now);
+    }
+}
+
+void tw_advance(struct timer_wheel *wheel, uint64_t now, tw_expire_fn expire, void *arg) {
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // When a level wraps, pull the next slot of the level above down
+        for (int level = 1; level < TW_LEVELS; level++) {
+            if ((wheel->now & (((uint64_t)1 << (TW_SLOT_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level, (wheel->now >> (TW_SLOT_BITS * level)) & TW_MASK);
+        }
+
+        struct tw_timer *head = &wheel->slots[0][wheel->now & TW_MASK];
+        while (head->next != head) {
+            struct tw_timer *timer = head->next;
+            tw_cancel(timer);
+            expire(timer, arg);
+        }
+    }
+}
+
+#ifdef RUN_TIMERWHEEL_TEST
+/* to compile: gcc -Wall -Wextra -DRUN_TIMERWHEEL_TEST timerwheel.c -o timerwheel */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_TIMERS 1000
+
+struct test_timer {
+    struct tw_timer timer;       /* First, so the timer is the test timer */
+    uint64_t due;                /* Tick it must fire on */
+    int fired;
+};
+
+static struct timer_wheel wheel;
+static struct test_timer timers[TEST_TIMERS];
+
+static void test_schedule(struct test_timer *t, uint64_t expires) {
+    t->due = expires > wheel.now ? expires : wheel.now + 1;
+    tw_schedule(&wheel, &t->timer, expires);
+}
+
+static void test_expire(struct tw_timer *timer, void *arg) {
+    struct test_timer *t = (struct test_timer *)timer;
+    (void)arg;
+    assert(wheel.now == t->due);
+    t->fired++;
+}
+
+/**
+ * Fire timers on either side of every level's reach and beyond the wheel,
+ * each exactly on its tick however often it was refiled on the way, and
+ * timers rescheduled at random while the wheel turns exactly once
+ */
+int main(void) {
+    uint64_t start = 12345;      /* Not aligned to any level */
+    uint64_t span = (uint64_t)1 << (TW_SLOT_BITS * TW_LEVELS);
+    int n = 0;
+    tw_init(&wheel, start);
+    for (int level = 0; level <= TW_LEVELS; level++) {
+        uint64_t reach = (uint64_t)1 << (TW_SLOT_BITS * level);
+        for (uint64_t d = 0; d <= 4; d++) {
+            if (reach + d > 2) {
+                test_schedule(&timers[n++], start + reach + d - 2);
+            }
+        }
+    }
+    test_schedule(&timers[n++], start + 3 * span);
+    test_schedule(&timers[n++], start - 10);  // Overdue, takes the next tick
+    test_schedule(&timers[n++], start + 100);
+    tw_cancel(&timers[n - 1].timer);
+    timers[n - 1].fired = 1;     // Cancelled, so it must not fire again
+    int fixed = n;
+
+    srand(1);
+    for (; n < TEST_TIMERS; n++) {
+        test_schedule(&timers[n], start + 1 + rand() % (1 << 20));
+    }
+    while (wheel.now < start + 4 * span) {
+        tw_advance(&wheel, wheel.now + 1 + rand() % 5000, test_expire, NULL);
+        struct test_timer *t = &timers[fixed + rand() % (TEST_TIMERS - fixed)];
+        if (tw_pending(&t->timer)) {
+            test_schedule(t, wheel.now + 1 + rand() % (1 << 22));
+        }
+    }
+    for (int i = 0; i < TEST_TIMERS; i++) {
+        assert(timers[i].fired == 1 && !tw_pending(&timers[i].timer));
+    }
+    printf("ok\n");
+    return 0;
+}
+#endif /* RUN_TIMERWHEEL_TEST */
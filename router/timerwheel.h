@@ -0,0 +1,52 @@
+/**
+ * timerwheel.h
+ * Hierarchical timer wheel with O(1) schedule and cancel.
+ * Not thread safe: callers serialize access to a wheel and its timers.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define TW_LEVELS 4                  /* Wheels, each 64 times coarser than the last */
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+
+// A timer, kept alongside whatever it times out. A zeroed timer is valid
+// and not pending.
+struct tw_timer {
+    struct tw_timer *next;       /* Slot list links, NULL when not pending */
+    struct tw_timer *prev;
+    uint64_t expires;            /* Absolute tick at which the timer fires */
+};
+
+struct timer_wheel {
+    uint64_t now;                /* Last tick processed by tw_advance */
+    struct tw_timer slots[TW_LEVELS][TW_SLOTS];  /* Circular list heads */
+};
+
+// Called once for each expired timer, which is no longer pending
+typedef void (*tw_expire_fn)(struct tw_timer *timer, void *arg);
+
+void tw_init(struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * (Re)schedule timer to fire at tick expires, replacing any earlier
+ * schedule. Ticks already passed fire on the next advance.
+ */
+void tw_schedule(struct timer_wheel *wheel, struct tw_timer *timer, uint64_t expires);
+
+/**
+ * Stop a pending timer, harmless if it is not pending
+ */
+void tw_cancel(struct tw_timer *timer);
+
+int tw_pending(const struct tw_timer *timer);
+
+/**
+ * Process every tick up to and including now, firing expired timers
+ */
+void tw_advance(struct timer_wheel *wheel, uint64_t now, tw_expire_fn expire, void *arg);
+
+#endif /* TIMERWHEEL_H */
@@ -0,0 +1,511 @@
+/**
+ * topobench.c
+ * Topology launcher and convergence/throughput benchmark. Generates a
+ * simconfig directory per router for a line, ring, grid or random graph,
+ * starts every router, and measures:
+ *   - time until every routing table holds the shortest-path metric to
+ *     every link prefix, read over each router's control socket
+ *   - throughput and latency of a packet train between two hosts that this
+ *     program simulates, attached to the two routers farthest apart
+ *   - the same after failing a link (link down on both ends over the
+ *     control socket) or killing a router on the path between the hosts
+ *
+ * to compile: gcc -Wall -Wextra topobench.c topology.c slipnet.c simnet.c -lpthread -o topobench
+ * usage: topobench [-t line|ring|grid|random] [-n routers] [-e extra_links] [-s seed]
+ *                  [-f none|link|router] [-p packets] [-b bytes] [-T timeout]
+ *                  [-r router_binary] [-d workdir] [-P base_port]
+ *   defaults: -t line -n 4 -e n/2 (random only) -s 1 -f link -p 20 -b 100
+ *             -T 600 -r ./router -d ./topo -P 20000
+ *   router i runs in workdir/rNN with its output in workdir/rNN/out.txt,
+ *   the hosts use workdir/hosts/simconfig
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "slipnet.h"
+#include "topology.h"
+
+#define POLL_MS 200                  /* Interval between routing table checks */
+
+static pid_t pids[MAX_ROUTERS];
+static int base_port = 20000;
+static char workdir[PATH_MAX];
+
+// ============================================================================
+// ROUTER PROCESSES
+// ============================================================================
+
+/**
+ * Write one simconfig line for an end of link k
+ */
+void write_simconfig_line(FILE *f, int k, int end) {
+    int mine = base_port + 2 * k + end;
+    int other = base_port + 2 * k + 1 - end;
+    char addr_str[INET6_ADDRSTRLEN];
+    struct in6_addr addr;
+    link_addr(k, end + 1, &addr);
+    inet_ntop(AF_INET6, &addr, addr_str, sizeof(addr_str));
+    fprintf(f, "# %s\n%d %d localhost\n", addr_str, mine, other);
+}
+
+/**
+ * Create each router's directory and simconfig, and the hosts' simconfig
+ * Returns 0, or -1 if a file could not be written
+ */
+int write_configs() {
+    mkdir(workdir, 0755);
+    for (int r = 0; r < num_routers; r++) {
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s/r%02d", workdir, r);
+        mkdir(path, 0755);
+        strcat(path, "/simconfig");
+        FILE *f = fopen(path, "w");
+        if (f == NULL) {
+            perror(path);
+            return -1;
+        }
+        for (int k = 0; k < num_links + NUM_HOSTS; k++) {
+            if (links[k].a == r) {
+                write_simconfig_line(f, k, 0);
+            }
+            if (links[k].b == r) {
+                write_simconfig_line(f, k, 1);
+            }
+        }
+        fclose(f);
+    }
+
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/hosts", workdir);
+    mkdir(path, 0755);
+    strcat(path, "/simconfig");
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    for (int h = 0; h < NUM_HOSTS; h++) {
+        write_simconfig_line(f, num_links + h, 1);
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Start router r in its directory, with one address per simconfig line
+ */
+void start_router(int r, const char *binary) {
+    char *argv[4 + MAX_LINKS];
+    char addr_strs[MAX_LINKS][INET6_ADDRSTRLEN];
+    int argc = 0;
+    argv[argc++] = (char *)binary;
+    argv[argc++] = "-q";
+    argv[argc++] = "-w";
+    argv[argc++] = "1";
+    for (int k = 0; k < num_links + NUM_HOSTS; k++) {
+        if (links[k].a == r || links[k].b == r) {
+            struct in6_addr addr;
+            link_addr(k, links[k].a == r ? 1 : 2, &addr);
+            inet_ntop(AF_INET6, &addr, addr_strs[argc], sizeof(addr_strs[argc]));
+            argv[argc] = addr_strs[argc];
+            argc++;
+        }
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);
+    pids[r] = fork();
+    if (pids[r] == 0) {
+        char dir[PATH_MAX + 8];
+        snprintf(dir, sizeof(dir), "%s/r%02d", workdir, r);
+        if (chdir(dir) != 0 || freopen("out.txt", "w", stdout) == NULL) {
+            _exit(1);
+        }
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+        execv(binary, argv);
+        _exit(1);
+    }
+    alive[r] = 1;
+}
+
+/**
+ * Stop every router still running
+ */
+void stop_routers() {
+    for (int r = 0; r < num_routers; r++) {
+        if (pids[r] > 0) {
+            kill(pids[r], SIGTERM);
+            waitpid(pids[r], NULL, 0);
+            pids[r] = 0;
+        }
+    }
+}
+
+void stop_on_signal(int sig) {
+    (void)sig;
+    stop_routers();
+    _exit(1);
+}
+
+/**
+ * Send one command to router r's control socket and read the reply up to
+ * and including "end", or its first line for other commands
+ * Returns the reply length, or -1 if the router cannot be reached
+ */
+int control(int r, const char *command, char *reply, int size) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/r%02d/router.ctl",
+                 workdir, r) >= (int)sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        write(fd, command, strlen(command)) < 0 || write(fd, "\n", 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    int used = 0;
+    ssize_t n;
+    while (used < size - 1 && (n = read(fd, reply + used, size - 1 - used)) > 0) {
+        used += n;
+    }
+    reply[used] = '\0';
+    close(fd);
+    return used;
+}
+
+// ============================================================================
+// CONVERGENCE
+// ============================================================================
+
+/**
+ * Check router r's table, read over its control socket
+ */
+int router_converged(int r, int dist_to[MAX_ROUTERS][MAX_ROUTERS]) {
+    static char reply[1 << 20];
+    if (control(r, "dump", reply, sizeof(reply)) <= 0) {
+        return 0;
+    }
+    return table_converged(reply, dist_to[r]);
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Poll every live router until all tables are converged
+ * Returns seconds since start, or -1 after timeout seconds
+ */
+double wait_converged(double start, int timeout) {
+    static int dist_to[MAX_ROUTERS][MAX_ROUTERS];
+    for (int r = 0; r < num_routers; r++) {
+        distances(r, dist_to[r]);
+    }
+
+    struct timespec poll = { 0, POLL_MS * 1000000L };
+    while (now_seconds() - start < timeout) {
+        int converged = 1;
+        for (int r = 0; r < num_routers && converged; r++) {
+            converged = !alive[r] || router_converged(r, dist_to);
+        }
+        if (converged) {
+            return now_seconds() - start;
+        }
+        nanosleep(&poll, NULL);
+    }
+    return -1;
+}
+
+// ============================================================================
+// HOST TRAFFIC
+// ============================================================================
+
+// Test packets carry their sequence number and send time after the header
+struct test_payload {
+    uint32_t sequence;
+    double sent;
+};
+
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rx_count;
+static double rx_first, rx_last;
+static double latency_sum, latency_min, latency_max;
+static long rx_bytes;
+
+/**
+ * Receive handler of the destination host
+ */
+static void host_receive(int tty, const void *vdata, int numbytes) {
+    double now = now_seconds();
+    if (tty != 1 || numbytes < 40 + (int)sizeof(struct test_payload)) {
+        return;
+    }
+    struct test_payload payload;
+    memcpy(&payload, (const char *)vdata + 40, sizeof(payload));
+    double latency = now - payload.sent;
+
+    pthread_mutex_lock(&rx_lock);
+    if (rx_count == 0 || now < rx_first) {
+        rx_first = now;
+    }
+    rx_last = now;
+    rx_count++;
+    rx_bytes += numbytes;
+    latency_sum += latency;
+    if (rx_count == 1 || latency < latency_min) {
+        latency_min = latency;
+    }
+    if (latency > latency_max) {
+        latency_max = latency;
+    }
+    pthread_mutex_unlock(&rx_lock);
+}
+
+/**
+ * Send a train of packets from host 0 to host 1 and report what arrived
+ */
+void measure_traffic(const char *label, int num_packets, int size) {
+    pthread_mutex_lock(&rx_lock);
+    rx_count = 0;
+    rx_bytes = 0;
+    latency_sum = latency_max = 0;
+    pthread_mutex_unlock(&rx_lock);
+
+    char packet[MAX_SLIP_SEND];
+    memset(packet, 0, size);
+    packet[0] = 0x60;
+    packet[4] = (size - 40) >> 8;
+    packet[5] = (size - 40) & 0xff;
+    packet[6] = 17;                  /* UDP, routers only forward it */
+    packet[7] = 64;
+    struct in6_addr src, dst;
+    link_addr(num_links, 2, &src);
+    link_addr(num_links + 1, 2, &dst);
+    memcpy(packet + 8, &src, 16);
+    memcpy(packet + 24, &dst, 16);
+
+    double start = now_seconds();
+    for (int i = 0; i < num_packets; i++) {
+        struct test_payload payload = { i, now_seconds() };
+        memcpy(packet + 40, &payload, sizeof(payload));
+        write_slip_data(0, packet, size);
+    }
+
+    // Wait until everything arrived, or nothing has for a while
+    struct timespec poll = { 0, POLL_MS * 1000000L };
+    double quiet_since = now_seconds();
+    int last_count = -1;
+    while (now_seconds() - quiet_since < 5) {
+        pthread_mutex_lock(&rx_lock);
+        int count = rx_count;
+        pthread_mutex_unlock(&rx_lock);
+        if (count == num_packets) {
+            break;
+        }
+        if (count != last_count) {
+            last_count = count;
+            quiet_since = now_seconds();
+        }
+        nanosleep(&poll, NULL);
+    }
+
+    pthread_mutex_lock(&rx_lock);
+    printf("%s: %d of %d packets of %d bytes arrived\n", label, rx_count, num_packets, size);
+    if (rx_count > 0) {
+        printf("%s: throughput %.0f bytes/s, latency min %.3f avg %.3f max %.3f s\n",
+               label, rx_bytes / (rx_last - start),
+               latency_min, latency_sum / rx_count, latency_max);
+    }
+    pthread_mutex_unlock(&rx_lock);
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+int main(int argc, char *argv[]) {
+    const char *type = "line";
+    const char *failure = "link";
+    const char *binary = "./router";
+    const char *dir = "./topo";
+    int extra = -1;
+    unsigned seed = 1;
+    int num_packets = 20;
+    int size = 100;
+    int timeout = 600;
+    num_routers = 4;
+
+    for (int argi = 1; argi < argc; argi += 2) {
+        if (argi + 1 >= argc || argv[argi][0] != '-' || strlen(argv[argi]) != 2) {
+            fprintf(stderr, "Usage: %s [-t line|ring|grid|random] [-n routers] [-e extra_links] [-s seed]\n"
+                            "       [-f none|link|router] [-p packets] [-b bytes] [-T timeout]\n"
+                            "       [-r router_binary] [-d workdir] [-P base_port]\n", argv[0]);
+            return 1;
+        }
+        const char *value = argv[argi + 1];
+        switch (argv[argi][1]) {
+        case 't': type = value; break;
+        case 'n': num_routers = atoi(value); break;
+        case 'e': extra = atoi(value); break;
+        case 's': seed = atoi(value); break;
+        case 'f': failure = value; break;
+        case 'p': num_packets = atoi(value); break;
+        case 'b': size = atoi(value); break;
+        case 'T': timeout = atoi(value); break;
+        case 'r': binary = value; break;
+        case 'd': dir = value; break;
+        case 'P': base_port = atoi(value); break;
+        default:
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[argi]);
+            return 1;
+        }
+    }
+    if (num_routers < 2 || num_routers > MAX_ROUTERS || num_packets < 0 ||
+        size < 40 + (int)sizeof(struct test_payload) || size > MAX_SLIP_SEND ||
+        timeout < 1 || base_port < 1025 || base_port > 65535 - 2 * (MAX_LINKS + NUM_HOSTS)) {
+        fprintf(stderr, "Error: Option out of range.\n");
+        return 1;
+    }
+    if (strcmp(failure, "none") != 0 && strcmp(failure, "link") != 0 &&
+        strcmp(failure, "router") != 0) {
+        fprintf(stderr, "Error: Unknown failure '%s'.\n", failure);
+        return 1;
+    }
+    if (build_topology(type, extra < 0 ? num_routers / 2 : extra, seed) != 0) {
+        fprintf(stderr, "Error: Unknown topology '%s'.\n", type);
+        return 1;
+    }
+
+    // Paths are absolute, the hosts run from their own directory
+    char binary_path[PATH_MAX];
+    mkdir(dir, 0755);
+    if (realpath(binary, binary_path) == NULL || realpath(dir, workdir) == NULL) {
+        perror(realpath(binary, binary_path) == NULL ? binary : dir);
+        return 1;
+    }
+    if (strlen(workdir) + sizeof("/r00/router.ctl") > sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        fprintf(stderr, "Error: Work directory path is too long for a control socket.\n");
+        return 1;
+    }
+
+    // Hosts hang off router 0 and the router farthest from it
+    int hops = attach_hosts();
+
+    printf("topobench: %s of %d routers, %d links, hosts on r%02d and r%02d (%d hops)\n",
+           type, num_routers, num_links, host_router[0], host_router[1], hops);
+    if (write_configs() != 0) {
+        return 1;
+    }
+
+    // Start the routers and the hosts
+    signal(SIGINT, stop_on_signal);
+    signal(SIGTERM, stop_on_signal);
+    double start = now_seconds();
+    for (int r = 0; r < num_routers; r++) {
+        start_router(r, binary_path);
+    }
+    char hosts_dir[PATH_MAX + 8];
+    snprintf(hosts_dir, sizeof(hosts_dir), "%s/hosts", workdir);
+    if (chdir(hosts_dir) != 0 ||
+        install_slip_data_handler(0, host_receive) < 0 ||
+        install_slip_data_handler(1, host_receive) < 0) {
+        fprintf(stderr, "Error: Could not attach the hosts.\n");
+        stop_routers();
+        return 1;
+    }
+
+    double converged = wait_converged(start, timeout);
+    if (converged < 0) {
+        printf("initial convergence: not converged after %d s\n", timeout);
+        stop_routers();
+        return 1;
+    }
+    printf("initial convergence: %.1f s\n", converged);
+    measure_traffic("before failure", num_packets, size);
+
+    if (strcmp(failure, "none") == 0) {
+        stop_routers();
+        return 0;
+    }
+
+    // Fail the first link, or kill the middle router, of a shortest host path
+    int path[MAX_ROUTERS];
+    int path_len = host_path(path);
+
+    if (strcmp(failure, "link") == 0) {
+        if (path_len < 2) {
+            printf("failure: hosts share a router, no link to fail\n");
+            stop_routers();
+            return 0;
+        }
+        for (int k = 0; k < num_links; k++) {
+            if ((links[k].a == path[0] && links[k].b == path[1]) ||
+                (links[k].a == path[1] && links[k].b == path[0])) {
+                char command[32], reply[64];
+                start = now_seconds();
+                snprintf(command, sizeof(command), "link %d down", links[k].iface_a);
+                control(links[k].a, command, reply, sizeof(reply));
+                snprintf(command, sizeof(command), "link %d down", links[k].iface_b);
+                control(links[k].b, command, reply, sizeof(reply));
+                links[k].up = 0;
+                printf("failure: link r%02d-r%02d down\n", links[k].a, links[k].b);
+                break;
+            }
+        }
+    } else {
+        if (path_len < 3) {
+            printf("failure: no router between the hosts' routers to kill\n");
+            stop_routers();
+            return 0;
+        }
+        int victim = path[path_len / 2];
+        start = now_seconds();
+        kill(pids[victim], SIGKILL);
+        waitpid(pids[victim], NULL, 0);
+        pids[victim] = 0;
+        alive[victim] = 0;
+        printf("failure: router r%02d killed\n", victim);
+    }
+
+    converged = wait_converged(start, timeout);
+    if (converged < 0) {
+        printf("reconvergence: not converged after %d s\n", timeout);
+        stop_routers();
+        return 1;
+    }
+    printf("reconvergence: %.1f s\n", converged);
+    int dist[MAX_ROUTERS];
+    distances(host_router[0], dist);
+    if (dist[host_router[1]] >= 0) {
+        measure_traffic("after failure", num_packets, size);
+    } else {
+        printf("after failure: hosts are partitioned\n");
+    }
+
+    stop_routers();
+    return 0;
+}
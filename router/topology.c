@@ -0,0 +1,194 @@
+/**
+ * topology.c
+ * Test topologies of routers joined by point-to-point links.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "topology.h"
+
+int num_routers;
+struct link links[MAX_LINKS + NUM_HOSTS];
+int num_links;
+int host_router[NUM_HOSTS];
+int num_ifaces[MAX_ROUTERS];
+int alive[MAX_ROUTERS];
+
+void add_link(int a, int b) {
+    if (a == b) {
+        return;
+    }
+    for (int k = 0; k < num_links; k++) {
+        if ((links[k].a == a && links[k].b == b) || (links[k].a == b && links[k].b == a)) {
+            return;
+        }
+    }
+    links[num_links].a = a;
+    links[num_links].b = b;
+    links[num_links].up = 1;
+    num_links++;
+}
+
+int build_topology(const char *type, int extra, unsigned seed) {
+    if (strcmp(type, "line") == 0 || strcmp(type, "ring") == 0) {
+        for (int i = 0; i + 1 < num_routers; i++) {
+            add_link(i, i + 1);
+        }
+        if (strcmp(type, "ring") == 0 && num_routers > 2) {
+            add_link(num_routers - 1, 0);
+        }
+    } else if (strcmp(type, "grid") == 0) {
+        int cols = 1;
+        while (cols * cols < num_routers) {
+            cols++;
+        }
+        for (int i = 0; i < num_routers; i++) {
+            if ((i + 1) % cols != 0 && i + 1 < num_routers) {
+                add_link(i, i + 1);
+            }
+            if (i + cols < num_routers) {
+                add_link(i, i + cols);
+            }
+        }
+    } else if (strcmp(type, "random") == 0) {
+        // Random spanning tree, so the graph is connected, then extra links
+        srand(seed);
+        for (int i = 1; i < num_routers; i++) {
+            add_link(i, rand() % i);
+        }
+        for (int e = 0; e < extra * 10 && num_links < num_routers - 1 + extra; e++) {
+            add_link(rand() % num_routers, rand() % num_routers);
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int attach_hosts(void) {
+    for (int r = 0; r < num_routers; r++) {
+        alive[r] = 1;
+    }
+    int dist[MAX_ROUTERS];
+    distances(0, dist);
+    host_router[0] = 0;
+    host_router[1] = 0;
+    for (int r = 0; r < num_routers; r++) {
+        if (dist[r] > dist[host_router[1]]) {
+            host_router[1] = r;
+        }
+    }
+    for (int h = 0; h < NUM_HOSTS; h++) {
+        links[num_links + h].a = host_router[h];
+        links[num_links + h].b = -1;
+        links[num_links + h].up = 1;
+    }
+    for (int k = 0; k < num_links + NUM_HOSTS; k++) {
+        links[k].iface_a = num_ifaces[links[k].a]++;
+        if (links[k].b >= 0) {
+            links[k].iface_b = num_ifaces[links[k].b]++;
+        }
+    }
+    return dist[host_router[1]];
+}
+
+void distances(int src, int *dist) {
+    int queue[MAX_ROUTERS];
+    int head = 0, tail = 0;
+    for (int i = 0; i < num_routers; i++) {
+        dist[i] = -1;
+    }
+    if (!alive[src]) {
+        return;
+    }
+    dist[src] = 0;
+    queue[tail++] = src;
+    while (head < tail) {
+        int r = queue[head++];
+        for (int k = 0; k < num_links; k++) {
+            int other = links[k].a == r ? links[k].b : links[k].b == r ? links[k].a : -1;
+            if (other >= 0 && links[k].up && alive[other] && dist[other] < 0) {
+                dist[other] = dist[r] + 1;
+                queue[tail++] = other;
+            }
+        }
+    }
+}
+
+int host_path(int *path) {
+    int dist[MAX_ROUTERS];
+    int path_len = 0;
+    distances(host_router[1], dist);
+    for (int r = host_router[0]; ; ) {
+        path[path_len++] = r;
+        if (dist[r] == 0) {
+            break;
+        }
+        for (int k = 0; k < num_links; k++) {
+            int other = links[k].a == r ? links[k].b : links[k].b == r ? links[k].a : -1;
+            if (other >= 0 && dist[other] == dist[r] - 1) {
+                r = other;
+                break;
+            }
+        }
+    }
+    return path_len;
+}
+
+void link_addr(int k, int end, struct in6_addr *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->s6_addr[0] = 0xfd;
+    addr->s6_addr[6] = k >> 8;
+    addr->s6_addr[7] = k & 0xff;
+    addr->s6_addr[15] = end;
+}
+
+int table_converged(char *reply, const int *dist) {
+    int seen[MAX_LINKS + NUM_HOSTS] = { 0 };
+    char *save = NULL;
+    for (char *line = strtok_r(reply, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        char prefix_str[INET6_ADDRSTRLEN + 4];
+        unsigned metric;
+        if (sscanf(line, "%49s metric %u", prefix_str, &metric) != 2) {
+            continue;
+        }
+        char *slash = strchr(prefix_str, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        struct in6_addr prefix;
+        if (inet_pton(AF_INET6, prefix_str, &prefix) != 1 || prefix.s6_addr[0] != 0xfd) {
+            return 0;
+        }
+        int k = prefix.s6_addr[6] << 8 | prefix.s6_addr[7];
+        if (k >= num_links + NUM_HOSTS) {
+            return 0;
+        }
+
+        // Expected metric is the distance to the nearest live end of the link
+        int expected = -1;
+        int ends[2] = { links[k].a, links[k].b };
+        for (int e = 0; e < 2; e++) {
+            int d = ends[e] >= 0 ? dist[ends[e]] : -1;
+            if (d >= 0 && (expected < 0 || d < expected)) {
+                expected = d;
+            }
+        }
+        if (expected < 0 || (int)metric != expected) {
+            return 0;
+        }
+        seen[k] = 1;
+    }
+
+    for (int k = 0; k < num_links + NUM_HOSTS; k++) {
+        int reachable = (links[k].a >= 0 && dist[links[k].a] >= 0) ||
+                        (links[k].b >= 0 && dist[links[k].b] >= 0);
+        if (reachable && !seen[k]) {
+            return 0;
+        }
+    }
+    return 1;
+}
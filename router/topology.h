@@ -0,0 +1,76 @@
+/**
+ * topology.h
+ * Test topologies of routers joined by point-to-point links, shared by the
+ * benchmarks that run them: topobench with one router process per node,
+ * netsim with every router simulated in one process. Link k is the prefix
+ * fd00:0:0:k::/64, and the links to the two hosts, which hang off the
+ * routers farthest apart, come after the routers' links.
+ */
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <netinet/in.h>
+
+#define MAX_ROUTERS 64
+#define MAX_LINKS (4 * MAX_ROUTERS)
+#define NUM_HOSTS 2
+
+// A point-to-point link, ends b is -1 for the links to the hosts
+struct link {
+    int a, b;                        /* Routers at each end */
+    int iface_a, iface_b;            /* Interface number at each end */
+    int up;                          /* 0 once failed */
+};
+
+extern int num_routers;
+extern struct link links[MAX_LINKS + NUM_HOSTS];
+extern int num_links;                /* Router-to-router links */
+extern int host_router[NUM_HOSTS];   /* Router each host is attached to */
+extern int num_ifaces[MAX_ROUTERS];
+extern int alive[MAX_ROUTERS];
+
+/**
+ * Add a router-to-router link unless it exists
+ */
+void add_link(int a, int b);
+
+/**
+ * Build the router-to-router links of a line, ring, grid or random graph
+ * of num_routers, the random one from seed with extra links beyond a
+ * spanning tree
+ * Returns 0, or -1 for an unknown topology
+ */
+int build_topology(const char *type, int extra, unsigned seed);
+
+/**
+ * Attach the hosts to router 0 and the router farthest from it, mark every
+ * router alive and number each router's interfaces in link order
+ * Returns the hops between the hosts' routers
+ */
+int attach_hosts(void);
+
+/**
+ * Hop distances from router src over links that are up, -1 if unreachable
+ */
+void distances(int src, int *dist);
+
+/**
+ * Routers on a shortest path from host 0's router to host 1's
+ * Returns the number of routers on it
+ */
+int host_path(int *path);
+
+/**
+ * Address of link k's end, 1 for the router at end a and 2 for the other
+ */
+void link_addr(int k, int end, struct in6_addr *addr);
+
+/**
+ * Check a router's "dump" reply, modified in place: every reachable link
+ * prefix at its shortest-path metric, and no route to a prefix that cannot
+ * be reached. dist holds the router's distances from distances().
+ */
+int table_converged(char *reply, const int *dist);
+
+#endif /* TOPOLOGY_H */